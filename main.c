@@ -34,6 +34,18 @@ int main(int argc, char *argv[]) {
     to the interpreter */
     add_io_functions(global);
 
+    /* `-vm` selects the bytecode virtual machine and `-closure`
+    the closure compiler instead of the default tree walking evaluator */
+    if(argc > 1 && !strcmp(argv[1], "-vm")) {
+        sk_set_engine(global, SK_ENGINE_VM);
+        argv++;
+        argc--;
+    } else if(argc > 1 && !strcmp(argv[1], "-closure")) {
+        sk_set_engine(global, SK_ENGINE_CLOSURE);
+        argv++;
+        argc--;
+    }
+
     if(argc > 1) {
         /* Executing a file */
         char *text = readfile(argv[1]);
@@ -89,6 +101,10 @@ int main(int argc, char *argv[]) {
     /* Release the global object through the  */
     rc_release(global);
 
+    /* Free any lambdas that are left in cycles with the environments
+    that they captured */
+    sk_collect();
+
     return rv;
 }
 
@@ -144,8 +160,9 @@ static void file_dtor(void *p) {
 }
 
 static SkObj *bif_fopen(SkEnv *env, SkObj *e) {
-    const char *filename = sk_get_text(sk_car(e));
-    const char *filemode = sk_get_text(sk_car(sk_cdr(e)));
+    char fbuf[SK_TEXT_SIZE], mbuf[SK_TEXT_SIZE];
+    const char *filename = sk_get_text_buf(sk_car(e), fbuf);
+    const char *filemode = sk_get_text_buf(sk_car(sk_cdr(e)), mbuf);
     if(!filename[0] || !filemode[0])
         return sk_error("'fopen' expects a filename and mode");
 
@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stdint.h>
 
 #include "refcnt.h"
 
@@ -61,6 +62,10 @@ static void *default_allocator(void *ptr, size_t size) {
 }
 void *(*rc_allocator)(void *ptr, size_t size) = default_allocator;
 
+/* Pointers with either of their lowest two bits set can't have come from
+`rc_alloc()`, so they are treated as immediate values and ignored */
+#define IS_IMMEDIATE(p) ((uintptr_t)(p) & 3)
+
 #define MALLOC(s)       rc_allocator(NULL, s)
 #define REALLOC(p,s)    rc_allocator(p, s)
 #define FREE(p)         rc_allocator(p, 0)
@@ -292,8 +297,8 @@ void *rc_retain(void *p) {
 void *rc_retain_(void *p, const char *file, int line) {
 #endif
     RefObj *r;
-    if(!p)
-        return NULL;
+    if(!p || IS_IMMEDIATE(p))
+        return p;
     r = (RefObj *)((char *)p - sizeof *r);
     r->refcnt++;
 #ifndef NDEBUG
@@ -308,7 +313,7 @@ void rc_release(void *p) {
 void rc_release_(void *p, const char *file, int line) {
 #endif
     RefObj *r;
-    if(!p)
+    if(!p || IS_IMMEDIATE(p))
         return;
     r = (RefObj *)((char *)p - sizeof *r);
     r->refcnt--;
@@ -355,11 +360,28 @@ void rc_release_(void *p, const char *file, int line) {
 #endif
 }
 
-void rc_set_dtor(void *p, ref_dtor dtor) {
+int rc_unique(void *p) {
+    RefObj *r;
+    if(!p || IS_IMMEDIATE(p))
+        return 0;
+    r = (RefObj *)((char *)p - sizeof *r);
+    return r->refcnt == 1;
+}
+
+unsigned int rc_count(void *p) {
+    RefObj *r;
+    if(!p || IS_IMMEDIATE(p))
+        return 0;
+    r = (RefObj *)((char *)p - sizeof *r);
+    return r->refcnt;
+}
+
+int rc_set_dtor(void *p, ref_dtor dtor) {
     RefObj *r;
-    if(!p) return;
+    if(!p || IS_IMMEDIATE(p)) return 1;
     r = (RefObj *)((char *)p - sizeof *r);
     r->dtor = dtor;
+    return 1;
 }
 
 #ifdef NDEBUG
@@ -10,6 +10,9 @@
  * * `rc_release()` decrements an object's reference count. If it becomes 0
  *   the object's destructor is called and the object is free()'d.
  * * Use `rc_retain()` to increment an object's reference count.
+ * * Pointers with either of their two lowest bits set are never returned by
+ *   `rc_alloc()`, so `rc_retain()` and `rc_release()` treat them as immediate
+ *   values (tagged pointers) and ignore them.
  *
  * ## Debug mode
  * 
@@ -124,6 +127,21 @@ void rc_release_(void *p, const char *file, int line);
 #define rc_release(p) rc_release_(p, __FILE__, __LINE__)
 #endif
 
+/**
+ * #### `int rc_unique(void *p)`
+ * Returns non-zero if `p` has one and only one reference to it.
+ *
+ * The holder of the only reference can safely modify an object that is
+ * otherwise treated as immutable (see also `rc_realloc()`).
+ */
+int rc_unique(void *p);
+
+/**
+ * #### `unsigned int rc_count(void *p)`
+ * Returns the number of references to `p`.
+ */
+unsigned int rc_count(void *p);
+
 /**
  * #### `void *rc_assign(void **p, void *val)`
  * Does the equivalent of `if(*p) rc_release(*p); *p = val;` 
@@ -157,8 +175,11 @@ typedef void (*ref_dtor)(void *);
  * other resources.
  * 
  * Destructors are optional.
+ *
+ * It returns non-zero; the return value is there for compatibility with
+ * Skeem's built-in reference counter, whose table of destructors can fill up.
  */
-void rc_set_dtor(void *p, ref_dtor dtor);
+int rc_set_dtor(void *p, ref_dtor dtor);
 
 /**
  * #### `void rc_init()`
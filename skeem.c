@@ -6,6 +6,10 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include <assert.h>
@@ -22,72 +26,207 @@
 #  define MEMCHECK(p) assert(p)
 #endif
 
+#if defined(_MSC_VER)
+#  define THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#  define THREAD_LOCAL __thread
+#else
+#  define THREAD_LOCAL _Thread_local
+#endif
+
+/* Counters and pointers that more than one thread may change */
+#if defined(_MSC_VER)
+#  include <intrin.h>
+typedef volatile long AtomicCount;
+typedef void *volatile AtomicPtr;
+#  define ATOMIC_LOAD(p)            (*(p))
+#  define ATOMIC_ADD(p, n)          (_InterlockedExchangeAdd((p), (n)) + (n))
+#  define ATOMIC_CAS(p, old, new)   (_InterlockedCompareExchangePointer((p), (new), (old)) == (old))
+#elif defined(__GNUC__)
+typedef long AtomicCount;
+typedef void *AtomicPtr;
+#  define ATOMIC_LOAD(p)            __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#  define ATOMIC_ADD(p, n)          __atomic_add_fetch((p), (n), __ATOMIC_ACQ_REL)
+#  define ATOMIC_CAS(p, old, new)   __sync_bool_compare_and_swap((p), (old), (new))
+#else
+#  include <stdatomic.h>
+typedef _Atomic long AtomicCount;
+typedef _Atomic(void *) AtomicPtr;
+#  define ATOMIC_LOAD(p)            atomic_load(p)
+#  define ATOMIC_ADD(p, n)          (atomic_fetch_add((p), (n)) + (n))
+#  define ATOMIC_CAS(p, old, new)   atomic_compare_exchange_strong((p), &(void *){(old)}, (new))
+#endif
+
+/* The memory used by an interpreter; see `sk_set_memory_limit()` */
+typedef struct Account {
+    SkMemStats stats;
+    size_t limit; /* 0 for no limit */
+    int orphaned; /* its global environment is gone; freed when nothing is charged to it */
+} Account;
+
+/* Objects are charged to the account that is in use when they are allocated,
+and the text and hash tables of objects to the account of the object.
+Account 0 means objects aren't charged to any account. */
+static unsigned int rc_account_create(void);
+static void rc_account_drop(unsigned int id);
+static unsigned int rc_account_use(unsigned int id);
+static Account *rc_account_get(unsigned int id);
+static int rc_over_limit(void);
+static int rc_can_charge(void *p, size_t size);
+static int rc_accounted(void *p);
+static void rc_charge(void *p, ptrdiff_t size);
+
+/* `rc_alloc()` returns NULL for a large object that would take the account
+over its limit. Objects whose size is fixed by the program rather than by
+the data, like frames and closures, are allocated with this instead */
+static void *rc_alloc_fixed(size_t size);
+
 /* I'm working from the assumtion that most funtions won't have lots of
    paramters or loval variables */
 #define DEFAULT_HASH_SIZE   8
 
 /* Anonymous structs and unions are not part of the C standard, but they are
 so useful that I can't get myself to remove them */
+enum {SYMBOL, VALUE, NUMBER, INTEGER, CONS, CFUN, TRUE, FALSE, LAMBDA, CDATA, ERROR, VECTOR,
+    SCOPE, LOCAL, GLOBAL, CAPTURED, BOX, /* internal to the interpreter; see `resolve()` */
+    COMPILED /* see `sk_compile()` */};
+
 typedef struct SkObj {
-    enum {SYMBOL, VALUE, CONS, CFUN, TRUE, FALSE, LAMBDA, CDATA, ERROR} type;
+    unsigned char type; /* one of the above; a byte so that it packs with the flags */
+    unsigned char flags; /* for sk_cons cells and LOCAL references; see FLAG_CHECKED */
+    unsigned char form; /* for symbols: the special form it names, if any */
+    unsigned int closure_index; /* for closures: see the cycle collector */
     union {
-        char *value;
+        struct {
+            /* Text of symbols, values and errors. For numbers it caches the
+            text representation, and is only filled in when it is needed */
+            char *value;
+            union {
+                double number;
+                long long integer;
+                struct {
+                    /* for symbols */
+                    unsigned int hash;
+                    unsigned int locals; /* The number of live frames that have it as a variable */
+                };
+            };
+        };
         sk_cfun_t func;
         struct {
            struct SkObj *car, *cdr; /* for sk_cons cells */
         };
         struct {
-           struct SkObj *args, *body; /* for lambdas */
+           /* for lambdas: the SCOPE of the parameters (which also holds the
+           body) and the values of the variables it captured, which are
+           allocated after the object itself */
+           struct SkObj *args, **captured;
         };
         struct {
             void *cdata; ref_dtor_t cdtor;
         };
+        struct {
+            /* for vectors: the items are allocated after the object itself */
+            struct SkObj **items; unsigned int length;
+        };
+        struct Scope *scope;
+        struct {
+            struct SkObj *name;
+            union {
+                /* LOCAL: A reference to the variable `name` in the slot `slot`
+                of the frame `depth` levels up from the current one.
+                CAPTURED: A reference to the value in slot `slot` of the
+                variables captured by the current lambda */
+                struct {
+                    unsigned int depth, slot;
+                };
+                /* GLOBAL: Any other reference to `name` */
+                struct GlobalCache *cache;
+            };
+        };
+        struct {
+            struct SkObj *program; struct Node *node; /* for sk_compile() */
+        };
     };
 } SkObj;
 
-/* =============================================================
-  Environments
-============================================================= */
-
-typedef struct hash_element {
-    char *name;
-    SkObj *ex;
-} hash_element;
-
-typedef struct SkEnv {
-    struct hash_element *table;
-    unsigned int mask; /* allocated size == mask + 1 */
-    unsigned int count;
-
-    struct SkEnv *parent;
-} SkEnv;
-
-static void env_dtor(SkEnv *env) {
-    int i;
-    for(i = 0; i <= env->mask; i++) {
-        if(env->table[i].name) {
-            hash_element* v = &env->table[i];
-            rc_release(v->ex);
-            free(v->name);
-        }
-    }
-    free(env->table);
-    rc_release(env->parent);
+/* The variables of a lambda or a `let`, as worked out by `resolve()`.
+Each call to the lambda or evaluation of the `let` gets a frame with
+a slot for each name. */
+typedef struct Scope {
+    SkObj *source; /* The parameter list or bindings it was made from */
+    unsigned int nslots;
+    unsigned int nparams; /* Lambdas: the number of fixed parameters */
+    int rest; /* Lambdas: slot `nparams` takes the rest of the arguments */
+    struct Code *code; /* Lambdas: the bytecode of the body, once it is compiled */
+    struct Node *node; /* Lambdas: the closure compiled body, once it is compiled */
+    SkObj *body; /* Lambdas: `(begin . body)` */
+    unsigned int ncaptured; /* Lambdas: the number of variables it captures */
+    SkObj **captures; /* Lambdas: LOCAL or CAPTURED references to them where the lambda is created */
+    SkObj **guards; /* Lambdas: for each slot, the functions called after a last use of it; see `last_uses()` */
+    SkObj *names[];
+} Scope;
+
+/* Set on a form once `check_form()` has validated its structure (and
+`resolve()` has resolved its variables), so `sk_eval()` never needs
+to check it again */
+#define FLAG_CHECKED    0x01
+
+/* Set on a LOCAL reference from which a lambda captures a variable that is
+also assigned with `set!`, so that the variable is put in a BOX first */
+#define FLAG_BOXED      0x02
+
+/* Set on a LOCAL reference that is the last use of its variable in the
+frame of a lambda, so that its value can be moved out of the frame rather
+than copied; see `last_uses()` */
+#define FLAG_LAST       0x04
+
+/* Set on the CFUNs of the builtins that don't call back into the
+interpreter, so they never look up a variable by name; see `can_move()` */
+#define FLAG_PURE       0x08
+
+/* Immediate values: `#t`, `#f` and small integers are encoded in the
+`SkObj` pointer itself, so they are never allocated or reference counted.
+Real objects are always aligned, so their lowest two bits are 0:
+
+    ...xxxx1 - a fixnum: the integer is the pointer shifted right by 1
+    ...00010 - #f
+    ...00110 - #t
+
+Use `type_of()` rather than `e->type` on anything that might be immediate.
+*/
+#define IS_IMMEDIATE(e)     ((uintptr_t)(e) & 3)
+#define IS_FIXNUM(e)        ((uintptr_t)(e) & 1)
+#define FIXNUM_VALUE(e)     ((intptr_t)(e) >> 1)
+#define MAKE_FIXNUM(n)      ((SkObj *)(((uintptr_t)(intptr_t)(n) << 1) | 1))
+#define FIXNUM_MIN          (INTPTR_MIN >> 1)
+#define FIXNUM_MAX          (INTPTR_MAX >> 1)
+#define SK_FALSE            ((SkObj *)2)
+#define SK_TRUE             ((SkObj *)6)
+
+/* Marks a frame slot that hasn't been assigned yet. It is tagged like an
+immediate value so that the reference counter ignores it, but it is
+never visible outside the interpreter */
+#define UNBOUND             ((SkObj *)10)
+
+static int type_of(SkObj *e) {
+    assert(e);
+    if(IS_FIXNUM(e))
+        return INTEGER;
+    else if(IS_IMMEDIATE(e))
+        return e == SK_TRUE ? TRUE : FALSE;
+    return e->type;
 }
 
-SkEnv *sk_env_createn(SkEnv *parent, unsigned int size) {
-    SkEnv *env = rc_alloc(sizeof *env);
-    env->mask = size-1;
-    env->count = 0;
-    env->table = calloc(size, sizeof *env->table);
-    env->parent = rc_retain(parent);
-    rc_set_dtor(env, (ref_dtor_t)env_dtor);
-    return env;
+/* A variable that lambdas capture and `set!` assigns is kept in a BOX
+(in its `car`) that the frame and the lambdas share. Returns where the
+value of the variable in the slot `v` is stored */
+static SkObj **unbox(SkObj **v) {
+    return (*v && !IS_IMMEDIATE(*v) && (*v)->type == BOX) ? &(*v)->car : v;
 }
 
-SkEnv *sk_env_create(SkEnv *parent) {
-    return sk_env_createn(parent, DEFAULT_HASH_SIZE);
-}
+/* =============================================================
+  Symbol table
+============================================================= */
 
 /*
 FNV-1a hash, 32-bit version
@@ -111,529 +250,1700 @@ static unsigned int hash(const char *s) {
 }
 */
 
-static hash_element *find_entry(hash_element *elements, unsigned int mask, const char *name) {
-    unsigned int h = hash(name) & mask;
-    for(;;) {
-        if(!elements[h].name || !strcmp(elements[h].name, name))
-            return &elements[h];
-        h = (h + 1) & mask;
-    }
-    return NULL;
+/* Special forms are resolved when their symbols are created,
+so that `sk_eval()` can dispatch on them with a switch instead of
+comparing the text of every form it evaluates */
+enum special_form {
+    SF_NONE, SF_DEFINE, SF_SET, SF_LET, SF_LETSTAR, SF_LAMBDA,
+    SF_IF, SF_AND, SF_OR, SF_QUOTE, SF_BEGIN
+};
+
+static int special_form(const char *name) {
+    static const char *names[] = {
+        NULL, "define", "set!", "let", "let*", "lambda",
+        "if", "and", "or", "quote", "begin"
+    };
+    int i;
+    for(i = SF_BEGIN; i > SF_NONE; i--)
+        if(!strcmp(name, names[i]))
+            break;
+    return i;
 }
 
-SkObj *sk_env_put(SkEnv *env, const char *name, SkObj *e) {
+/* Symbols are interned, so that there is only ever one symbol object
+with a given name, and symbols can be compared by their pointers.
+
+Each interpreter has its own table, which its global environment points to.
+The table doesn't hold a reference to the symbols in it: A symbol removes
+itself from the table when it is destroyed, and it keeps a pointer to its
+table after the object for that (see `SYMBOL_TABLE()`), so it can be
+released on whichever thread the interpreter has been handed to.
+
+The table is resized a bit at a time, like the tables of environments
+(see `TableResize` below): While it is resized, each new symbol moves a few
+symbols from the front of the `old` table to the new one. Symbols are
+removed through backward shift deletion, so that the old table stays
+consistent, and the symbols that remain in it always have their home slot
+at or after `next` */
+typedef struct SymbolTable {
+    SkObj **table;
+    unsigned int mask;
+    unsigned int count;
+    SkObj **old;
+    unsigned int old_mask, next;
+
+    /* Held by the interpreter, each of the symbols, and each
+    thread that interns symbols in the table (see `symbols`) */
+    AtomicCount refs;
+} SymbolTable;
+
+#define SYMBOL_TABLE(sym)   (*(SymbolTable **)((sym) + 1))
+
+/* The table that `sk_symbol()` interns symbols in on this thread: That of
+the interpreter that was last created, or evaluated in, on the thread.
+A thread that hasn't used an interpreter gets a table of its own */
+static THREAD_LOCAL SymbolTable *symbols;
+
+/* Number of slots of the old table that are looked at for each new
+symbol while the table is resized */
+#define SYMBOL_RESIZE_STEP 8
+
+static SymbolTable *symbols_create(void) {
+    SymbolTable *t = calloc(1, sizeof *t);
+    MEMCHECK(t);
+    t->refs = 1;
+    return t;
+}
 
-    if(!env)
-        return NULL;
+static SymbolTable *symbols_retain(SymbolTable *t) {
+    ATOMIC_ADD(&t->refs, 1);
+    return t;
+}
 
-    hash_element *f = find_entry(env->table, env->mask, name);
-    if(f->name) {
-        /* Replacing an existing entry */
-        rc_release(f->ex);
-    } else {
-        /* new entry */
-        if(env->count >= env->mask * 3 / 4) {
-            /* grow the table */
-            int new_size = (env->mask + 1) << 1;
+static void symbols_release(SymbolTable *t) {
+    if(t && ATOMIC_ADD(&t->refs, -1) == 0) {
+        assert(!t->count);
+        free(t);
+    }
+}
 
-            hash_element *new_table = calloc(new_size, sizeof *new_table);
-            unsigned int i;
-            for(i = 0; i <= env->mask; i++) {
-                hash_element *from = &env->table[i];
-                if(from->name) {
-                    hash_element *to = find_entry(new_table, new_size-1, from->name);
-                    to->name = from->name;
-                    to->ex = from->ex;
-                }
-            }
-            free(env->table);
+/* Makes `t` the table that symbols are interned in on this thread, and
+returns the one that was, whose reference passes to the caller. A NULL
+`t` leaves the table as it is, and returns NULL */
+static SymbolTable *symbols_use(SymbolTable *t) {
+    SymbolTable *was = symbols;
+    if(!t)
+        return NULL;
+    symbols = symbols_retain(t);
+    return was;
+}
 
-            env->table = new_table;
-            env->mask = new_size - 1;
+/* Undoes `symbols_use()`. When there was no table before, the
+new one stays in use, so that `sk_parse()` interns its symbols in
+the interpreter that was last used on the thread */
+static void symbols_restore(SymbolTable *was) {
+    if(!was)
+        return;
+    symbols_release(symbols);
+    symbols = was;
+}
 
-            f = find_entry(env->table, env->mask, name);
-        }
+static SymbolTable *current_symbols(void) {
+    if(!symbols)
+        symbols = symbols_create();
+    return symbols;
+}
 
-        f->name = strdup(name); /* TODO: get rid of this strdup()? */
-        env->count++;
+static SkObj **find_symbol_slot(SkObj **table, unsigned int mask, const char *name, unsigned int h) {
+    unsigned int i = h & mask;
+    for(;;) {
+        if(!table[i] || (table[i]->hash == h && !strcmp(table[i]->value, name)))
+            return &table[i];
+        i = (i + 1) & mask;
     }
-    f->ex = e;
-    return e;
 }
 
-static hash_element *env_findg_r(SkEnv *env, const char *name) {
-    if(!env)
+/* Looks in both the tables while the table is resized */
+static SkObj *lookup_symbol(SymbolTable *t, const char *name, unsigned int h) {
+    SkObj *s = *find_symbol_slot(t->table, t->mask, name, h);
+    if(!s && t->old)
+        s = *find_symbol_slot(t->old, t->old_mask, name, h);
+    return s;
+}
+
+/* Finds an existing symbol in `t` without creating one */
+static SkObj *find_symbol(SymbolTable *t, const char *name) {
+    if(!t || !t->table)
         return NULL;
-    hash_element *f = find_entry(env->table, env->mask, name);
-    if(f->name)
-        return f;
-    return env_findg_r(env->parent, name);
+    return lookup_symbol(t, name, hash(name));
 }
 
-SkObj *sk_env_get(SkEnv *env, const char *name) {
-    hash_element* v = env_findg_r(env, name);
-    if(v)
-        return v->ex;
-    return sk_errorf("no such variable '%s'", name);
+/* Removes the symbol in slot `i` of `table` through backward shift
+deletion, so that the linear probing doesn't need tombstones */
+static void remove_symbol_slot(SkObj **table, unsigned int mask, unsigned int i) {
+    unsigned int j, k;
+    table[i] = NULL;
+    for(j = i;;) {
+        j = (j + 1) & mask;
+        if(!table[j])
+            break;
+        k = table[j]->hash & mask;
+        if((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        table[i] = table[j];
+        table[j] = NULL;
+        i = j;
+    }
 }
 
-/* This function is here because it can be used to iterate through the
-hash tables, but it is not generally useful because it won't be able to
-deal with a situation where a key is in a SkEnv and in that SkEnv's parent.
-That's why I don't expose it in the API */
-static const char *sk_env_next(SkEnv *env, const char *name) {
-    unsigned int h = 0;
-    assert(env->count < env->mask);
-    if(name) {
-        int oh;
-        oh = hash(name) & env->mask;
-        h = oh;
-        while(strcmp(env->table[h].name, name)) {
-            if(!env->table[h].name)
-                return NULL;
-            h = (h + 1) & env->mask;
-        }
-        if(++h > env->mask)
-            return NULL;
+/* Moves symbols from the old table to the new one, looking at up to `n`
+slots. A slot is looked at again after its symbol has been moved, because
+the deletion may have shifted another symbol into it */
+static void move_symbols(SymbolTable *t, unsigned int n) {
+    for(; n && t->next <= t->old_mask; n--) {
+        SkObj *s = t->old[t->next];
+        if(!s) {
+            t->next++;
+            continue;
+        }
+        remove_symbol_slot(t->old, t->old_mask, t->next);
+        *find_symbol_slot(t->table, t->mask, s->value, s->hash) = s;
     }
-    while(!env->table[h].name) {
-        if(h == env->mask)
-            return NULL;
-        h = h + 1;
+    if(t->next > t->old_mask) {
+        free(t->old);
+        t->old = NULL;
     }
-    return env->table[h].name;
+}
+
+static void intern_symbol(SymbolTable *t, SkObj *sym) {
+    if(!t->table) {
+        t->table = calloc(256, sizeof *t->table);
+        MEMCHECK(t->table);
+        t->mask = 255;
+    } else if(t->old) {
+        move_symbols(t, SYMBOL_RESIZE_STEP);
+    } else if(t->count >= (t->mask + 1) / 2) {
+        /* The new table is big enough that the old one is empty well
+        before the new one is half full */
+        t->old = t->table;
+        t->old_mask = t->mask;
+        t->next = 0;
+        t->mask = ((t->mask + 1) << 1) - 1;
+        t->table = calloc(t->mask + 1, sizeof *t->table);
+        MEMCHECK(t->table);
+        move_symbols(t, SYMBOL_RESIZE_STEP);
+    }
+    *find_symbol_slot(t->table, t->mask, sym->value, sym->hash) = sym;
+    t->count++;
+    SYMBOL_TABLE(sym) = symbols_retain(t);
+}
+
+/* Finds the slot of `sym` by its pointer */
+static SkObj **symbol_slot(SkObj **table, unsigned int mask, SkObj *sym) {
+    unsigned int i = sym->hash & mask;
+    for(; table[i]; i = (i + 1) & mask) {
+        if(table[i] == sym)
+            return &table[i];
+    }
+    return NULL;
+}
+
+static void unintern_symbol(SkObj *sym) {
+    SymbolTable *t = SYMBOL_TABLE(sym);
+    SkObj **slot;
+    assert(t->table);
+    if((slot = symbol_slot(t->table, t->mask, sym)))
+        remove_symbol_slot(t->table, t->mask, slot - t->table);
+    else {
+        slot = symbol_slot(t->old, t->old_mask, sym);
+        assert(slot);
+        remove_symbol_slot(t->old, t->old_mask, slot - t->old);
+    }
+    if(--t->count == 0) {
+        free(t->table);
+        free(t->old);
+        t->table = NULL;
+        t->old = NULL;
+    }
+    symbols_release(t);
 }
 
 /* =============================================================
-  Objects
+  Environments
 ============================================================= */
 
-static void SkExpr_dtor(SkObj *e) {
-    switch(e->type) {
-        case ERROR:
-        case SYMBOL:
-        case VALUE: free(e->value); break;
-        case CONS: rc_release(e->car); rc_release(e->cdr); break;
-        case LAMBDA: rc_release(e->args); rc_release(e->body); break;
-        case CDATA: if(e->cdtor) e->cdtor(e->cdata); break;
-        default: break;
-    }
+/* Environments are keyed on interned symbols, so lookups
+compare pointers.
+
+The hash tables are split in two, like Python's dictionaries: The
+elements are kept in a dense array in the order they were added, and
+the slots of the index that is probed refer to them by their position.
+Iterating through a table is a scan of the dense array, and the index
+is small enough that probing it stays in the cache.
+
+Each slot keeps a copy of its element's hash, so that probing doesn't
+need to look at the elements at all */
+typedef struct hash_element {
+    SkObj *sym; /* NULL if the element has been removed */
+    SkObj *ex;
+    unsigned int hash;
+} hash_element;
+
+typedef struct hash_slot {
+    unsigned int element; /* Position of the element + 1, 0 if empty */
+    unsigned int hash;
+} hash_slot;
+
+/* Number of elements a table with an index of `size` slots has room for,
+which keeps the load of the index under 3/4 */
+#define TABLE_CAPACITY(size)    ((size) - (size) / 4)
+/* The elements and the index are allocated together */
+#define TABLE_BYTES(size)       (TABLE_CAPACITY(size) * sizeof(hash_element) + (size) * sizeof(hash_slot))
+
+typedef struct HashTable {
+    hash_element *elements; /* NULL if the environment doesn't have a table */
+    hash_slot *index;
+    unsigned int mask; /* size of the index == mask + 1 */
+    unsigned int used; /* Elements used, including removed ones */
+} HashTable;
+
+/* A table isn't resized in one go, because moving all the elements of a
+large table would pause the program. The elements are moved from the front
+of the old table to the new table a few at a time on each change instead.
+Meanwhile new elements are still added to the end of the old table, so that
+they stay in the order they were added, and lookups look in both tables */
+typedef struct TableResize {
+    HashTable from;
+    unsigned int next; /* Position in `from` of the next element to move */
+    uintptr_t released; /* The elements of `from` below this address have been given back; see `release_moved()` */
+} TableResize;
+
+typedef struct SkEnv {
+    HashTable table;
+    TableResize *resize; /* While the table is being resized */
+    unsigned int count; /* Elements in the table */
+
+    struct SkEnv *parent;
+    struct SkEnv *global; /* The root of the chain of parents */
+    int engine; /* Root environments: see `sk_set_engine()` */
+    unsigned int account; /* Root environments: see `sk_set_memory_limit()` */
+    SymbolTable *symbols; /* Root environments of interpreters: see `symbols` */
+    struct Closures *closures; /* Root environments of interpreters: see `closures` */
+    unsigned int chained; /* Root environments: the environments below it with hash tables */
+
+    /* Changes whenever elements move or are removed from the hash
+    table, so that the GlobalCaches that point into it know to look again */
+    unsigned int version;
+
+    /* Frames of lambdas and `let`s keep their variables in `slots`, which
+    are named by the SCOPE object `scope`. The hash table of a frame is only
+    created if a variable that isn't in its scope is put into it. */
+    SkObj *scope;
+
+    /* Frames: the lambda that was called, for the variables it captured.
+    The frames of `let`s share the lambda of their parent */
+    SkObj *fn;
+    SkObj *slots[];
+} SkEnv;
+
+/* Global variable references cache where they found the variable.
+The cache is only used while no frame has a variable with the same
+name, and no environment with a hash table has a parent: then the
+variable can only be in the root environment.
+
+The versions are unique across all the environments, and across threads,
+so that an environment that is freed and another that is later allocated
+at the same address can't be mistaken for each other */
+typedef struct GlobalCache {
+    SkEnv *env;
+    hash_element *slot;
+    unsigned int version;
+} GlobalCache;
+
+static AtomicCount env_version = 0;
+
+static unsigned int next_version(void) {
+    return (unsigned int)ATOMIC_ADD(&env_version, 1);
 }
 
-SkObj *sk_symbol(const char *sk_value) {
-    SkObj *e = rc_alloc(sizeof *e);
-    MEMCHECK(e);
-    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
-    e->type = SYMBOL;
-    e->value = strdup(sk_value);
-    return e;
+/* Allocates the elements and index of a hash table with `size` slots */
+static void table_alloc(SkEnv *env, HashTable *t, unsigned int size) {
+    t->elements = calloc(1, TABLE_BYTES(size));
+    MEMCHECK(t->elements);
+    t->index = (hash_slot *)(t->elements + TABLE_CAPACITY(size));
+    t->mask = size - 1;
+    t->used = 0;
+    rc_charge(env, TABLE_BYTES(size));
 }
 
-SkObj *sk_value(const char *val) {
-    SkObj *e = rc_alloc(sizeof *e);
-    MEMCHECK(e);
-    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
-    e->type = VALUE;
-    e->value = strdup(val);
-    return e;
+static void table_free(SkEnv *env, HashTable *t) {
+    rc_charge(env, -(ptrdiff_t)TABLE_BYTES(t->mask + 1));
+    free(t->elements);
+    t->elements = NULL;
 }
 
-SkObj *sk_value_o(char *val) {
-    SkObj *e = rc_alloc(sizeof *e);
-    MEMCHECK(e);
-    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
-    e->type = VALUE;
-    e->value = val;
-    return e;
+/* Returns the element after `f` in the order they were added, or the
+first element if `f` is NULL, skipping the elements that were removed */
+static hash_element *next_element(SkEnv *env, hash_element *f) {
+    HashTable *t = &env->table;
+    TableResize *r = env->resize;
+    unsigned int i = 0;
+    if(!t->elements)
+        return NULL;
+    if(!f || (f >= t->elements && f < t->elements + t->used)) {
+        /* The elements that were moved to the new table come first */
+        if(f)
+            i = f - t->elements + 1;
+        for(; i < t->used; i++) {
+            if(t->elements[i].sym)
+                return &t->elements[i];
+        }
+        if(!r)
+            return NULL;
+        i = r->next;
+    } else
+        i = f - r->from.elements + 1;
+    for(; i < r->from.used; i++) {
+        if(r->from.elements[i].sym)
+            return &r->from.elements[i];
+    }
+    return NULL;
 }
 
-SkObj *sk_error(const char *val) {
-    SkObj *e = rc_alloc(sizeof *e);
-    MEMCHECK(e);
-    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
-    e->type = ERROR;
-    e->value = strdup(val);
-    return e;
+/* Releases what the frame `env` refers to, except its parent */
+static void frame_clear(SkEnv *env) {
+    Scope *s = env->scope->scope;
+    unsigned int i;
+    for(i = 0; i < s->nslots; i++) {
+        rc_release(env->slots[i]);
+        s->names[i]->locals--;
+    }
+    rc_release(env->scope);
+    rc_release(env->fn);
 }
 
-SkObj *sk_errorf(const char *fmt, ...) {
-    va_list arg;
-    char buffer[512];
-    va_start(arg, fmt);
-    vsnprintf (buffer, sizeof(buffer)-1, fmt, arg);
-    va_end(arg);
-    return sk_error(buffer);
+static void closures_drop(struct Closures *c);
+
+static void env_dtor(SkEnv *env) {
+    if(env->table.elements) {
+        hash_element *v;
+        if(env->parent)
+            env->global->chained--;
+        for(v = next_element(env, NULL); v; v = next_element(env, v)) {
+            rc_release(v->ex);
+            rc_release(v->sym);
+        }
+        if(env->resize) {
+            table_free(env, &env->resize->from);
+            free(env->resize);
+        }
+        table_free(env, &env->table);
+    }
+    if(env->scope)
+        frame_clear(env);
+    rc_release(env->parent);
+    if(env->account)
+        rc_account_drop(env->account);
+    if(env->symbols) {
+        if(symbols == env->symbols) {
+            symbols = NULL;
+            symbols_release(env->symbols);
+        }
+        symbols_release(env->symbols);
+    }
+    if(env->closures)
+        closures_drop(env->closures);
 }
 
-SkObj *sk_boolean(int val) {
-    SkObj *e = rc_alloc(sizeof *e);
-    MEMCHECK(e);
-    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
-    e->type = val ? TRUE : FALSE;
-    return e;
+SkEnv *sk_env_createn(SkEnv *parent, unsigned int size) {
+    SkEnv *env = rc_alloc(sizeof *env);
+    env->account = 0;
+    env->symbols = NULL;
+    env->closures = NULL;
+    env->chained = 0;
+    table_alloc(env, &env->table, size);
+    env->resize = NULL;
+    env->count = 0;
+    env->parent = rc_retain(parent);
+    env->global = parent ? parent->global : env;
+    env->engine = SK_ENGINE_TREE;
+    env->version = next_version();
+    env->scope = NULL;
+    env->fn = NULL;
+    if(parent)
+        env->global->chained++;
+    rc_set_dtor(env, (ref_dtor_t)env_dtor);
+    return env;
 }
 
-/*
-https://randomascii.wordpress.com/2012/03/08/float-precisionfrom-zero-to-100-digits-2/
-*/
-#define RESULT_SIZE 128
-SkObj *sk_number(double n) {
-    char result[RESULT_SIZE];
-    snprintf(result, sizeof result - 1, "%.17g", n);
-    return sk_value(result);
+SkEnv *sk_env_create(SkEnv *parent) {
+    return sk_env_createn(parent, DEFAULT_HASH_SIZE);
 }
 
-SkObj *sk_cons(SkObj *car, SkObj *sk_cdr) {
-    SkObj *e = rc_alloc(sizeof *e);
-    MEMCHECK(e);
-    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
-    e->type = CONS;
-    e->car = car;
-    e->cdr = sk_cdr;
-    return e;
+/* Creates a frame for the SCOPE `scope`. `fn` is the lambda being
+called, or the lambda of `parent` for `let`s */
+static void frame_init(SkEnv *env, SkObj *scope, SkEnv *parent, SkObj *fn) {
+    unsigned int i, n = scope->scope->nslots;
+    env->table.elements = NULL;
+    env->resize = NULL;
+    env->count = 0;
+    env->parent = rc_retain(parent);
+    env->global = parent ? parent->global : env;
+    env->engine = SK_ENGINE_TREE;
+    env->account = 0;
+    env->symbols = NULL;
+    env->closures = NULL;
+    env->chained = 0;
+    env->version = 0;
+    env->scope = rc_retain(scope);
+    env->fn = rc_retain(fn);
+    for(i = 0; i < n; i++) {
+        env->slots[i] = UNBOUND;
+        scope->scope->names[i]->locals++;
+    }
 }
 
-SkObj *sk_lambda(SkObj *args, SkObj *body) {
-    SkObj *e = rc_alloc(sizeof *e);
-    MEMCHECK(e);
-    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
-    e->type = LAMBDA;
-    e->args = args;
-    e->body = body;
-    return e;
+static SkEnv *frame_create(SkObj *scope, SkEnv *parent, SkObj *fn) {
+    SkEnv *env = rc_alloc_fixed(sizeof *env + scope->scope->nslots * sizeof *env->slots);
+    MEMCHECK(env);
+    frame_init(env, scope, parent, fn);
+    rc_set_dtor(env, (ref_dtor_t)env_dtor);
+    return env;
 }
 
-SkObj *sk_cfun(sk_cfun_t func) {
-    SkObj *e = rc_alloc(sizeof *e);
-    MEMCHECK(e);
-    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
-    e->type = CFUN;
-    e->func = func;
-    return e;
+/* The VM keeps the frames of the calls that have returned for the next
+calls with the same number of slots, rather than freeing them. Frames
+that something else still refers to, or that got a hash table from an
+internal `define`, are released as usual */
+#define FRAME_POOL_SLOTS    8
+
+typedef struct FramePool {
+    SkEnv *free[FRAME_POOL_SLOTS]; /* linked through `parent` */
+} FramePool;
+
+static SkEnv *frame_get(FramePool *pool, SkObj *scope, SkEnv *parent, SkObj *fn) {
+    unsigned int n = scope->scope->nslots;
+    SkEnv *env;
+    if(n >= FRAME_POOL_SLOTS || !pool->free[n])
+        return frame_create(scope, parent, fn);
+    env = pool->free[n];
+    pool->free[n] = env->parent;
+    frame_init(env, scope, parent, fn);
+    return env;
 }
 
-SkObj *sk_cdata(void *cdata, ref_dtor_t dtor) {
-    SkObj *e = rc_alloc(sizeof *e);
-    MEMCHECK(e);
-    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
-    e->type = CDATA;
-    e->cdata = cdata;
-    e->cdtor = dtor;
-    return e;
+static void frame_put(FramePool *pool, SkEnv *env) {
+    unsigned int n;
+    if(!rc_unique(env) || env->table.elements || !env->scope
+            || (n = env->scope->scope->nslots) >= FRAME_POOL_SLOTS) {
+        rc_release(env);
+        return;
+    }
+    frame_clear(env);
+    rc_release(env->parent);
+    env->scope = NULL;
+    env->parent = pool->free[n];
+    pool->free[n] = env;
 }
 
-void *sk_get_cdata(SkObj *e) {
-    if(!e || e->type != CDATA) return NULL;
-    return e->cdata;
+static void frame_pool_free(FramePool *pool) {
+    unsigned int n;
+    for(n = 0; n < FRAME_POOL_SLOTS; n++) {
+        while(pool->free[n]) {
+            SkEnv *env = pool->free[n];
+            pool->free[n] = env->parent;
+            env->parent = NULL;
+            rc_release(env);
+        }
+    }
 }
 
-ref_dtor_t sk_get_cdtor(SkObj *e) {
-    if(!e || e->type != CDATA) return NULL;
-    return e->cdtor;
+/* Finds the slot named `sym` in a frame. If `bound` is set, slots that
+haven't been assigned yet are skipped. Later slots shadow earlier
+ones, for `(let* ((x 1) (x (+ x 1))) x)` */
+static SkObj **frame_slot(SkEnv *env, SkObj *sym, int bound) {
+    Scope *s = env->scope->scope;
+    unsigned int i = s->nslots;
+    while(i--) {
+        if(s->names[i] == sym && (!bound || *unbox(&env->slots[i]) != UNBOUND))
+            return unbox(&env->slots[i]);
+    }
+    return NULL;
 }
 
-/* O(1) way to append items to a list,
-but it needs a separate pointer to track the last item in the list.
+/* The index uses Robin Hood hashing: A slot that is inserted takes the
+place of any slot that is closer to its home position than the new slot
+is to its own, and that slot moves further along instead. This keeps the
+probe sequences short and even, and a lookup can stop as soon as it
+passes a slot that is closer to its home than the symbol it is looking
+for would be */
+#define PROBE_DISTANCE(mask, i, h) (((i) - (h)) & (mask))
+
+/* Finds the slot of `sym` in the index of `t`, ignoring the slots of
+elements before position `first`, which have been moved elsewhere */
+static hash_slot *find_slot(HashTable *t, SkObj *sym, unsigned int first) {
+    unsigned int h = sym->hash, mask = t->mask, i = h & mask, dist;
+    for(dist = 0;; dist++, i = (i + 1) & mask) {
+        hash_slot *s = &t->index[i];
+        if(!s->element || PROBE_DISTANCE(mask, i, s->hash) < dist)
+            return NULL;
+        if(s->hash == h && s->element > first && t->elements[s->element - 1].sym == sym)
+            return s;
+    }
+}
 
-Also, be careful to only use it when constructing new lists as existing
-lists are supposed to be immutable.
-*/
-static void list_append1(SkObj **list, SkObj *a, SkObj **last) {
-    SkObj *item = sk_cons(NULL, NULL);
-    item->car = a;
-    if(!*last)
-        *list = item;
-    else
-        (*last)->cdr = item;
-    *last = item;
-}
-
-int sk_equal(SkObj *a, SkObj *b) {
-    if(!a || !b)
-        return !a && !b;
-    else if(a->type != b->type)
-        return 0;
-    else switch(a->type) {
-        case CFUN: return a->func == b->func;
-        case CDATA: return a->cdata == b->cdata && a->cdtor == b->cdtor;
-        case ERROR: return 0;
-        case SYMBOL: return !strcmp(a->value, b->value);
-        case VALUE: return !strcmp(a->value, b->value);
-        case TRUE:
-        case FALSE: return 1;
-        case CONS: return sk_equal(a->car, b->car) && sk_equal(a->cdr, b->cdr);
-        case LAMBDA: return sk_equal(a->args, b->args) && sk_equal(a->body, b->body);
+static hash_element *find_entry(SkEnv *env, SkObj *sym) {
+    hash_slot *s = find_slot(&env->table, sym, 0);
+    if(s)
+        return &env->table.elements[s->element - 1];
+    if(env->resize) {
+        TableResize *r = env->resize;
+        s = find_slot(&r->from, sym, r->next);
+        if(s)
+            return &r->from.elements[s->element - 1];
     }
-    return 1;
-}
-
-const char *sk_get_text(SkObj *e) {
-    if(!e) return "";
-    if(e->type == TRUE)
-        return "true";
-    else if(e->type == FALSE)
-        return "false";
-    return (e->type == VALUE || e->type == SYMBOL || e->type == ERROR) ? e->value : "";
+    return NULL;
 }
 
-SkObj *sk_car(SkObj *e) {
-    if(!e || e->type != CONS) return NULL;
-    return e->car;
+/* Inserts `item`, which must not be in the index yet */
+static void insert_slot(hash_slot *index, unsigned int mask, hash_slot item) {
+    hash_slot tmp;
+    unsigned int i = item.hash & mask, dist, d;
+    for(dist = 0;; dist++, i = (i + 1) & mask) {
+        hash_slot *s = &index[i];
+        if(!s->element) {
+            *s = item;
+            return;
+        }
+        d = PROBE_DISTANCE(mask, i, s->hash);
+        if(d < dist) {
+            tmp = *s;
+            *s = item;
+            item = tmp;
+            dist = d;
+        }
+    }
 }
 
-SkObj *sk_cdr(SkObj *e) {
-    if(!e || e->type != CONS) return NULL;
-    return e->cdr;
+/* Removes the slot `s` through backward shift deletion: The slots after
+it move back one place until one is found that is in its home position,
+so that no tombstones are needed */
+static void remove_slot(hash_slot *index, unsigned int mask, hash_slot *s) {
+    unsigned int i = s - index, j;
+    for(;;) {
+        j = (i + 1) & mask;
+        if(!index[j].element || PROBE_DISTANCE(mask, j, index[j].hash) == 0)
+            break;
+        index[i] = index[j];
+        i = j;
+    }
+    index[i].element = 0;
 }
 
-int sk_is_null(SkObj *e) {
-    return e == NULL;
+/* Adds an element for `sym` at the end of the table `t` */
+static hash_element *table_add(HashTable *t, SkObj *sym, SkObj *e) {
+    hash_element *f = &t->elements[t->used];
+    hash_slot item;
+    assert(t->used < TABLE_CAPACITY(t->mask + 1));
+    f->sym = sym;
+    f->ex = e;
+    f->hash = sym->hash;
+    item.element = ++t->used;
+    item.hash = sym->hash;
+    insert_slot(t->index, t->mask, item);
+    return f;
 }
 
-int sk_is_symbol(SkObj *e) {
-    return e && e->type == SYMBOL;
+/* Number of elements of the old table that are looked at on every
+change while a table is resized */
+#define RESIZE_STEP 8
+
+/* Starts to resize the table of `env`, which is 3/4 full. The new table is
+big enough for the elements that are still in use and for those that
+can be added before the old table fills up, with room to spare */
+static unsigned int resize_size(SkEnv *env) {
+    unsigned int size = DEFAULT_HASH_SIZE, need = env->count + env->table.used / 4;
+    while(TABLE_CAPACITY(size) / 2 < need)
+        size <<= 1;
+    return size;
 }
 
-int sk_is_cons(SkObj *e) {
-    return e && e->type == CONS;
+static void table_resize(SkEnv *env) {
+    unsigned int size = resize_size(env);
+    env->resize = malloc(sizeof *env->resize);
+    MEMCHECK(env->resize);
+    env->resize->from = env->table;
+    env->resize->next = 0;
+    env->resize->released = 0;
+    table_alloc(env, &env->table, size);
 }
 
-int sk_is_error(SkObj *e) {
-    return e && e->type == ERROR;
+/* Freeing a large old table in one go unmaps all of its pages at once, which
+takes milliseconds. On Linux the pages that the elements have been moved out
+of are given back to the system while the table is resized instead, so
+that most of them are gone by the time the rest of the table is freed */
+#if defined(__linux__)
+#  include <sys/mman.h>
+#  define RELEASE_GRANULE   (64 * 1024)
+
+static void release_moved(TableResize *r) {
+    uintptr_t end = (uintptr_t)&r->from.elements[r->next] / RELEASE_GRANULE * RELEASE_GRANULE;
+    if(!r->released)
+        r->released = ((uintptr_t)r->from.elements + RELEASE_GRANULE - 1) / RELEASE_GRANULE * RELEASE_GRANULE;
+    if(end > r->released) {
+        madvise((void *)r->released, end - r->released, MADV_DONTNEED);
+        r->released = end;
+    }
 }
+#else
+#  define release_moved(r)
+#endif
 
-int sk_is_boolean(SkObj *e) {
-    return e && (e->type == FALSE || e->type == TRUE);
+/* Moves up to `n` elements from the old table to the new one while the
+table of `env` is resized. Moving the elements takes at most one step
+for every RESIZE_STEP elements of the old table, so the old table is
+empty long before the elements added to it in the meantime can fill it */
+static void table_move(SkEnv *env, unsigned int n) {
+    TableResize *r = env->resize;
+    for(; n && r->next < r->from.used; n--, r->next++) {
+        hash_element *f = &r->from.elements[r->next];
+        if(f->sym)
+            table_add(&env->table, f->sym, f->ex);
+    }
+    if(r->next == r->from.used) {
+        table_free(env, &r->from);
+        free(r);
+        env->resize = NULL;
+    } else
+        release_moved(r);
+    env->version = next_version();
 }
 
-int sk_is_true(SkObj *e) {
-    return e && e->type != FALSE;
-}
+/* Like `sk_env_put()`, but with the variable name as a symbol.
+It retains `sym` if it is a new entry */
+static SkObj *env_put(SkEnv *env, SkObj *sym, SkObj *e) {
 
-int sk_is_procedure(SkObj *e) {
-    return e && (e->type == CFUN || e->type == LAMBDA);
-}
+    if(!env)
+        return NULL;
 
-int sk_is_value(SkObj *e) {
-    return e && e->type == VALUE;
-}
+    if(env->scope) {
+        SkObj **slot = frame_slot(env, sym, 0);
+        if(slot) {
+            rc_release(*slot);
+            return *slot = e;
+        }
+        if(!env->table.elements) {
+            table_alloc(env, &env->table, DEFAULT_HASH_SIZE);
+            if(env->parent)
+                env->global->chained++;
+        }
+    }
 
-int sk_is_number(SkObj *e) {
-    return e && e->type == VALUE && sk_check_numeric(e->value);
+    hash_element *f = find_entry(env, sym);
+    if(f) {
+        /* Replacing an existing entry */
+        rc_release(f->ex);
+        f->ex = e;
+    } else {
+        /* new entry */
+        HashTable *t = &env->table;
+        if(!env->resize && t->used >= TABLE_CAPACITY(t->mask + 1) * 3 / 4)
+            table_resize(env);
+        if(env->resize) {
+            table_move(env, RESIZE_STEP);
+            /* New elements go after the ones that haven't been moved yet */
+            if(env->resize)
+                t = &env->resize->from;
+        }
+        table_add(t, rc_retain(sym), e);
+        env->count++;
+    }
+    return e;
 }
 
-int sk_is_cdata(SkObj *e) {
-    return e && e->type == CDATA;
+/* Whether `sym` can be put into `env` without going over the memory
+limit, which a new variable can't if the table would have to grow */
+static int env_has_room(SkEnv *env, SkObj *sym) {
+    HashTable *t = &env->table;
+    if(env->resize || !t->elements || t->used < TABLE_CAPACITY(t->mask + 1) * 3 / 4)
+        return 1;
+    return find_entry(env, sym) || rc_can_charge(env, TABLE_BYTES(resize_size(env)));
 }
 
-int sk_is_list(SkObj *e) {
-    for(; e; e = e->cdr)
-        if(e->type != CONS)
+/* Removes the variable `sym` from the hash table of `env`.
+Returns 0 if there is no such variable in it. Variables in
+the slots of a frame can't be removed */
+static int env_remove(SkEnv *env, SkObj *sym) {
+    HashTable *t = &env->table;
+    hash_slot *s;
+    hash_element *f;
+    SkObj *ex;
+    if(!t->elements)
+        return 0;
+    if(env->resize)
+        table_move(env, RESIZE_STEP);
+    if(!(s = find_slot(t, sym, 0))) {
+        if(!env->resize || !(s = find_slot(t = &env->resize->from, sym, env->resize->next)))
             return 0;
+    }
+    f = &t->elements[s->element - 1];
+    ex = f->ex;
+    f->sym = NULL;
+    f->ex = NULL;
+    remove_slot(t->index, t->mask, s);
+    env->count--;
+    env->version = next_version();
+    rc_release(ex);
+    rc_release(sym);
     return 1;
 }
 
-int sk_length(SkObj *e) {
-    int count = 0;
-    for(; e && e->type == CONS; e = e->cdr) count++;
-    return count;
+/* The table of the interpreter of `env`. Hash tables don't
+belong to an interpreter, so theirs is that of the thread */
+static SymbolTable *symbols_of(SkEnv *env) {
+    return env->global->symbols ? env->global->symbols : current_symbols();
 }
 
-/* =============================================================
-  Parser
-============================================================= */
+static SkObj *intern(SymbolTable *t, const char *name);
 
-int sk_check_numeric(const char *c) {
-    int ds = 0, de = 0;
-    if(*c == '+' || *c == '-')
-        c++;
-    if(!*c || !isdigit(*c++))
-        return 0;
-    while(isdigit(*c) || (*c == '.' && !ds++) || ((*c == 'e' || *c == 'E') && !de++)) {
-        if((*c == 'e' || *c == 'E') && (c[1] == '-' || c[1] == '+'))
-            c++;
-        c++;
-    }
-    return !*c;
+SkObj *sk_env_put(SkEnv *env, const char *name, SkObj *e) {
+    SkObj *sym = intern(symbols_of(env), name);
+    env_put(env, sym, e);
+    rc_release(sym);
+    return e;
 }
 
-enum scan_result {
- SCAN_ERROR = -1,
- SCAN_END = 0,
- SCAN_SYMBOL = 1,
- SCAN_VALUE,
- SCAN_TRUE,
- SCAN_FALSE
-};
-
-static int scan(const char *in, char tok[], size_t n, const char **rem) {
-    size_t i = 0;
-    if(!in)
-        in = *rem;
-restart:
-    if(!in)
-        return SCAN_END;
-    while(isspace(*in))
-        in++;
-
-    if (*in == '\0') {
-        *rem = in;
-        return SCAN_END;
-    } else if(*in == ';') {
-        while(*in != '\n') {
-            if(*in == '\0') {
-                *rem = in;
-                return SCAN_END;
-            }
-            in++;
-        }
-        goto restart;
-    } else if (strchr("()[]'.", *in)) {
-        tok[0] = *in;
-        tok[1] ='\0';
-        *rem =  ++in;
-        return tok[0];
-    } else if (*in == '\"') {
-        ++in;
-        while(*in != '\"') {
-            if(!*in) {
-                snprintf(tok, n, "unterminated string constant");
-                return SCAN_ERROR;
-            } else if(i == n) {
-                snprintf(tok, n, "token too long");
-                return SCAN_ERROR;
-            }
-            if(*in == '\\') {
-                ++in;
-                if(isdigit(*in)) {
-                    int v = *in - '0';
-                    while(isdigit(*++in))
-                        v = v * 10 + (*in - '0');
-                    tok[i++] = v & 0x7F;
-                } else {
-                    switch(*in) {
-                        case '\0': snprintf(tok, n, "unterminated string constant"); return SCAN_ERROR;
-                        case 'n' : tok[i++] = '\n'; break;
-                        case 'r' : tok[i++] = '\r'; break;
-                        case 't' : tok[i++] = '\t'; break;
-                        case 'b' : tok[i++] = '\b'; break;
-                        case 'a' : tok[i++] = '\a'; break;
-                        default : tok[i++] = *in; break;
-                    }
-                    in++;
-                }
-            } else
-                tok[i++] = *(in++);
+/* Returns a pointer to where the value of the variable `sym` is stored */
+static SkObj **env_findg_r(SkEnv *env, SkObj *sym) {
+    for(; env; env = env->parent) {
+        if(env->table.elements) {
+            hash_element *f = find_entry(env, sym);
+            if(f)
+                return &f->ex;
         }
-        tok[i] = '\0';
-        *rem = ++in;
-        return SCAN_VALUE;
-    } else if(!isprint(*in)) {
-        snprintf(tok, n, "bad character in input stream (%d)", *in);
-        return SCAN_ERROR;
-    } else {
-        while(isgraph(*in) && !strchr("])", *in)) {
-            if(i == n) {
-                snprintf(tok, n, "token too long");
-                return SCAN_ERROR;
-            }
-            tok[i++] = *in++;
+        if(env->scope) {
+            SkObj **slot = frame_slot(env, sym, 1);
+            if(slot)
+                return slot;
         }
-        tok[i] = '\0';
-        *rem = in;
+    }
+    return NULL;
+}
 
-        if(sk_check_numeric(tok)) return SCAN_VALUE;
-        if(tok[0] == '#' && !tok[2]) {
-            if(tolower(tok[1]) == 't') return SCAN_TRUE;
-            if(tolower(tok[1]) == 'f') return SCAN_FALSE;
+/* Looks up a variable that `set!` hasn't assigned in `frame` (yet): The
+lambda may have captured it before the `set!` shadowed it */
+static SkObj **env_find_outer(SkEnv *frame, SkObj *sym) {
+    if(frame->fn) {
+        Scope *s = frame->fn->args->scope;
+        unsigned int i;
+        for(i = 0; i < s->ncaptured; i++) {
+            if(s->captures[i]->name == sym && *unbox(&frame->fn->captured[i]) != UNBOUND)
+                return unbox(&frame->fn->captured[i]);
         }
-        for(i = 0; tok[i]; i++)
-            tok[i] = tolower(tok[i]);
-        return SCAN_SYMBOL;
     }
+    return env_findg_r(frame->parent, sym);
 }
 
-#define TOKEN_SIZE 1024
-typedef struct {
-    int sym;
-    const char *text;
-    char tok[TOKEN_SIZE], next_tok[TOKEN_SIZE];
-} Parser;
+/* Looks up the variable of a CAPTURED reference `ref`. If it wasn't
+assigned when the lambda was created, it is looked up by name */
+static SkObj **env_find_captured(SkEnv *env, SkObj *ref) {
+    SkObj **v = unbox(&env->fn->captured[ref->slot]);
+    return *v != UNBOUND ? v : env_findg_r(env, ref->name);
+}
 
-static void nextsym(Parser *p) {
-    memcpy(p->tok, p->next_tok, sizeof p->tok);
-    p->sym = scan(NULL, p->next_tok, sizeof p->next_tok, &p->text);
+/* Looks up the variable of a GLOBAL reference `ref` */
+static SkObj **env_find_global(SkEnv *env, SkObj *ref) {
+    SkObj *sym = ref->name;
+    GlobalCache *c = ref->cache;
+    if(sym->locals || env->global->chained)
+        return env_findg_r(env, sym);
+    env = env->global;
+    if(c->env != env || c->version != env->version) {
+        hash_element *f = find_entry(env, sym);
+        if(!f)
+            return NULL;
+        c->env = env;
+        c->slot = f;
+        c->version = env->version;
+    }
+    return &c->slot->ex;
 }
 
-static int accept(Parser *p, int s) {
-    if(p->sym == s) {
-        nextsym(p);
-        return 1;
+/* Whether the LOCAL reference `ref`, a last use of a variable of the
+lambda's frame `env`, can take the value out of the frame: none of the
+functions that the rest of the body calls may look the variable up by
+name. Builtins with FLAG_PURE look nothing up, and a lambda with a
+parameter of the same name finds its own */
+static int can_move(SkEnv *env, SkObj *ref) {
+    SkObj *c, **f;
+    Scope *s;
+    unsigned int i;
+    for(c = env->scope->scope->guards[ref->slot]; c; c = c->cdr) {
+        f = env_find_global(env, c->car);
+        if(!f || !*f || IS_IMMEDIATE(*f))
+            return 0;
+        if((*f)->type == CFUN && ((*f)->flags & FLAG_PURE))
+            continue;
+        if((*f)->type != LAMBDA)
+            return 0;
+        s = (*f)->args->scope;
+        for(i = 0; i < s->nparams + s->rest && s->names[i] != ref->name; i++);
+        if(i == s->nparams + s->rest)
+            return 0;
     }
-    return 0;
+    return 1;
 }
 
-static SkObj *parse0(Parser *p) {
-    if(accept(p, SCAN_ERROR))
-        return sk_error(p->tok);
-    else if(accept(p, SCAN_END))
+/* Looks up a variable by its name. If there is no symbol
+with that name, then there is no such variable either */
+static SkObj **env_findg_str(SkEnv *env, const char *name) {
+    SkObj *sym = find_symbol(symbols_of(env), name);
+    if(!sym)
         return NULL;
-    else if(accept(p, SCAN_SYMBOL))
-        return sk_symbol(p->tok);
-    else if(accept(p, SCAN_VALUE))
-        return sk_value(p->tok);
-    else if(accept(p, SCAN_TRUE))
-        return sk_boolean(1);
-    else if(accept(p, SCAN_FALSE))
-        return sk_boolean(0);
-    else if(accept(p, '(') || accept(p, '[')) {
-        SkObj *list = NULL, *last = NULL;
-        char term = p->tok[0] == '(' ? ')' : ']';
-
-        while(!accept(p, term)) {
-            if(accept(p, SCAN_ERROR)) {
-                rc_release(list);
-                return sk_error(p->tok);
-            } else if(accept(p, SCAN_END)) {
-                rc_release(list);
-                return sk_errorf("expected '%c'", term);
-            } else if(accept(p, '.')) {
-                if(!last) {
-                    rc_release(list);
-                    return sk_errorf("unexpected '.'");
-                }
-                SkObj *e = parse0(p);
-                if(sk_is_error(e)) {
-                    rc_release(list);
-                    return e;
-                }
-                last->cdr = e;
-                if(!accept(p, term)) {
-                    rc_release(list);
-                    return sk_errorf("expected '%c'", term);
-                }
-
-                return list;
-            }
+    return env_findg_r(env, sym);
+}
 
-            SkObj *e = parse0(p);
-            if(sk_is_error(e)) {
-                rc_release(list);
-                return e;
-            }
+SkObj *sk_env_get(SkEnv *env, const char *name) {
+    SkObj **v = env_findg_str(env, name);
+    if(v)
+        return *v;
+    return sk_errorf("no such variable '%s'", name);
+}
 
-            list_append1(&list, e, &last);
-        }
-        return list;
-    } else if(accept(p, '\'')) {
-        SkObj *e = parse0(p);
-        if(sk_is_error(e))
-            return e;
-        return sk_cons(sk_symbol("quote"), sk_cons(e, NULL));
-    } else if(accept(p, ')') || accept(p, ']'))
-        return sk_errorf("mismatched '%c'", p->tok[0]);
+int sk_env_remove(SkEnv *env, const char *name) {
+    SkObj *sym = find_symbol(symbols_of(env), name);
+    return sym ? env_remove(env, sym) : 0;
+}
 
-    return sk_error("unhandled token type");
+/* This function is here because it can be used to iterate through the
+hash tables, but it is not generally useful because it won't be able to
+deal with a situation where a key is in a SkEnv and in that SkEnv's parent.
+That's why I don't expose it in the API.
+The keys are returned in the order they were added */
+static SkObj *sk_env_next(SkEnv *env, SkObj *sym) {
+    hash_element *f = NULL;
+    if(!env->table.elements)
+        return NULL;
+    if(sym && !(f = find_entry(env, sym)))
+        return NULL;
+    f = next_element(env, f);
+    return f ? f->sym : NULL;
+}
+
+/* =============================================================
+  Objects
+============================================================= */
+
+static void code_free(struct Code *code);
+static void node_free(struct Node *n);
+static void closure_remove(SkObj *f);
+static SkObj *memory_error(void);
+
+/* Charges the text of `e` to the memory account of `e`,
+or refunds it if `sign` is -1. Symbols are shared, so they aren't */
+static void charge_text(SkObj *e, int sign) {
+    if(e->value && rc_accounted(e))
+        rc_charge(e, sign * (ptrdiff_t)(strlen(e->value) + 1));
+}
+
+static void SkExpr_dtor(SkObj *e) {
+    switch(e->type) {
+        case SYMBOL: unintern_symbol(e); free(e->value); break;
+        case ERROR:
+        case NUMBER:
+        case INTEGER:
+        case VALUE: charge_text(e, -1); free(e->value); break;
+        case CONS: rc_release(e->car); rc_release(e->cdr); break;
+        case BOX: rc_release(e->car); break;
+        case LAMBDA: {
+            unsigned int i;
+            if(e->closure_index)
+                closure_remove(e);
+            for(i = 0; i < e->args->scope->ncaptured; i++)
+                rc_release(e->captured[i]);
+            rc_release(e->args);
+        } break;
+        case CDATA: if(e->cdtor) e->cdtor(e->cdata); break;
+        case VECTOR: {
+            unsigned int i;
+            for(i = 0; i < e->length; i++)
+                rc_release(e->items[i]);
+        } break;
+        case SCOPE: {
+            unsigned int i;
+            for(i = 0; i < e->scope->nslots; i++)
+                rc_release(e->scope->names[i]);
+            rc_release(e->scope->source);
+            rc_release(e->scope->body);
+            for(i = 0; i < e->scope->ncaptured; i++)
+                rc_release(e->scope->captures[i]);
+            free(e->scope->captures);
+            if(e->scope->guards) {
+                for(i = 0; i < e->scope->nslots; i++)
+                    rc_release(e->scope->guards[i]);
+                free(e->scope->guards);
+            }
+            code_free(e->scope->code);
+            node_free(e->scope->node);
+            free(e->scope);
+        } break;
+        case LOCAL:
+        case CAPTURED: rc_release(e->name); break;
+        case GLOBAL: rc_release(e->name); free(e->cache); break;
+        case COMPILED: rc_release(e->program); node_free(e->node); break;
+        default: break;
+    }
+}
+
+static SkObj *intern(SymbolTable *t, const char *sk_value) {
+    unsigned int h = hash(sk_value);
+    if(t->table) {
+        SkObj *e = lookup_symbol(t, sk_value, h);
+        if(e)
+            return rc_retain(e);
+    }
+    SkObj *e = rc_alloc(sizeof *e + sizeof t);
+    MEMCHECK(e);
+    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
+    e->type = SYMBOL;
+    e->value = strdup(sk_value);
+    e->hash = h;
+    e->form = special_form(sk_value);
+    e->locals = 0;
+    intern_symbol(t, e);
+    return e;
+}
+
+SkObj *sk_symbol(const char *sk_value) {
+    return intern(current_symbols(), sk_value);
+}
+
+SkObj *sk_value(const char *val) {
+    SkObj *e = rc_alloc(sizeof *e);
+    MEMCHECK(e);
+    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
+    e->type = VALUE;
+    e->value = strdup(val);
+    charge_text(e, 1);
+    return e;
+}
+
+SkObj *sk_value_o(char *val) {
+    SkObj *e = rc_alloc(sizeof *e);
+    MEMCHECK(e);
+    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
+    e->type = VALUE;
+    e->value = val;
+    charge_text(e, 1);
+    return e;
+}
+
+SkObj *sk_error(const char *val) {
+    SkObj *e = rc_alloc(sizeof *e);
+    MEMCHECK(e);
+    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
+    e->type = ERROR;
+    e->value = strdup(val);
+    charge_text(e, 1);
+    return e;
+}
+
+SkObj *sk_errorf(const char *fmt, ...) {
+    va_list arg;
+    char buffer[512];
+    va_start(arg, fmt);
+    vsnprintf (buffer, sizeof(buffer)-1, fmt, arg);
+    va_end(arg);
+    return sk_error(buffer);
+}
+
+SkObj *sk_boolean(int val) {
+    return val ? SK_TRUE : SK_FALSE;
+}
+
+SkObj *sk_number(double n) {
+    SkObj *e = rc_alloc(sizeof *e);
+    MEMCHECK(e);
+    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
+    e->type = NUMBER;
+    e->value = NULL;
+    e->number = n;
+    return e;
+}
+
+/* Only integers that don't fit in a fixnum are allocated */
+SkObj *sk_integer(long long n) {
+    if(n >= FIXNUM_MIN && n <= FIXNUM_MAX)
+        return MAKE_FIXNUM(n);
+    SkObj *e = rc_alloc(sizeof *e);
+    MEMCHECK(e);
+    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
+    e->type = INTEGER;
+    e->value = NULL;
+    e->integer = n;
+    return e;
+}
+
+/* Parses text like "42" or "-7" into an integer.
+Returns 0 if the text has a fraction or an exponent, or if it doesn't fit */
+static int parse_integer(const char *text, long long *n) {
+    char *end;
+    if(!sk_check_numeric(text) || strpbrk(text, ".eE"))
+        return 0;
+    errno = 0;
+    *n = strtoll(text, &end, 10);
+    return !errno && !*end;
+}
+
+/* Numeric literals keep the text they were written with,
+so that `(display 1.50)` still displays `1.50` */
+static SkObj *number_literal(const char *text) {
+    long long i;
+    SkObj *e = parse_integer(text, &i) ? sk_integer(i) : sk_number(atof(text));
+    if(!IS_IMMEDIATE(e)) {
+        e->value = strdup(text);
+        charge_text(e, 1);
+    }
+    return e;
+}
+
+double sk_get_number(SkObj *e) {
+    if(!e) return 0;
+    if(IS_FIXNUM(e))
+        return (double)FIXNUM_VALUE(e);
+    else if(IS_IMMEDIATE(e))
+        return 0;
+    else if(e->type == NUMBER)
+        return e->number;
+    else if(e->type == INTEGER)
+        return (double)e->integer;
+    return atof(sk_get_text(e));
+}
+
+/* Gets `e` as an exact integer, if it is one.
+Values with integer text, like "42", count as well. */
+static int exact_integer(SkObj *e, long long *n) {
+    if(!e) return 0;
+    if(IS_FIXNUM(e)) {
+        *n = FIXNUM_VALUE(e);
+        return 1;
+    } else if(IS_IMMEDIATE(e))
+        return 0;
+    else if(e->type == INTEGER) {
+        *n = e->integer;
+        return 1;
+    } else if(e->type == VALUE)
+        return parse_integer(e->value, n);
+    return 0;
+}
+
+long long sk_get_integer(SkObj *e) {
+    long long n;
+    if(exact_integer(e, &n))
+        return n;
+    return (long long)sk_get_number(e);
+}
+
+/*
+Uses the shortest of `%.15g`, `%.16g` and `%.17g` that converts back
+to the same double.
+https://randomascii.wordpress.com/2012/03/08/float-precisionfrom-zero-to-100-digits-2/
+*/
+#define RESULT_SIZE 128
+static const char *number_text(SkObj *e) {
+    if(!e->value) {
+        char result[RESULT_SIZE];
+        int p;
+        for(p = 15; p < 17; p++) {
+            snprintf(result, sizeof result - 1, "%.*g", p, e->number);
+            if(strtod(result, NULL) == e->number)
+                break;
+        }
+        if(p == 17)
+            snprintf(result, sizeof result - 1, "%.17g", e->number);
+        e->value = strdup(result);
+        MEMCHECK(e->value);
+        charge_text(e, 1);
+    }
+    return e->value;
+}
+
+/* Fixnums have nowhere to cache their text, so it is written to `buf`,
+which has room for `SK_TEXT_SIZE` characters. `sk_get_text()` uses a small
+ring of buffers instead, whose text is only valid until the ring wraps around */
+#define FIXNUM_TEXT_RING 8
+static THREAD_LOCAL char fixnum_text[FIXNUM_TEXT_RING][SK_TEXT_SIZE];
+static THREAD_LOCAL unsigned int fixnum_text_next;
+
+static const char *integer_text(SkObj *e, char *buf) {
+    if(IS_FIXNUM(e)) {
+        snprintf(buf, SK_TEXT_SIZE, "%lld", (long long)FIXNUM_VALUE(e));
+        return buf;
+    } else if(!e->value) {
+        char result[RESULT_SIZE];
+        snprintf(result, sizeof result - 1, "%lld", e->integer);
+        e->value = strdup(result);
+        MEMCHECK(e->value);
+        charge_text(e, 1);
+    }
+    return e->value;
+}
+
+SkObj *sk_cons(SkObj *car, SkObj *sk_cdr) {
+    SkObj *e = rc_alloc(sizeof *e);
+    MEMCHECK(e);
+    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
+    e->type = CONS;
+    e->flags = 0;
+    e->car = car;
+    e->cdr = sk_cdr;
+    return e;
+}
+
+struct Resolver;
+static SkObj *lambda_scope(struct Resolver *up, SkObj *params, SkObj *body);
+
+static int gc_traced(SkObj *e);
+static void closure_add(SkEnv *env, SkObj *f);
+
+/* Returns where the variable of a LOCAL or CAPTURED reference is stored */
+static SkObj **ref_slot(SkEnv *env, SkObj *ref) {
+    unsigned int d;
+    if(ref->type == CAPTURED)
+        return &env->fn->captured[ref->slot];
+    for(d = ref->depth; d; d--)
+        env = env->parent;
+    return &env->slots[ref->slot];
+}
+
+/* Creates a lambda that is evaluated in `env`. The body is kept in the
+SCOPE of the parameters, so `body` is only used the first time.
+
+The values of the variables that the lambda captured are copied from `env`
+into the lambda, so it doesn't keep `env` alive and can't form a cycle
+with it. A variable that wasn't assigned yet is looked up by name when
+it is used, like the other free variables */
+static SkObj *lambda_create(SkObj *args, SkObj *body, SkEnv *env) {
+    unsigned int i, n;
+    int traced = 0;
+    if(!args || type_of(args) != SCOPE) {
+        /* The interpreter passes the SCOPE of a lambda form it has already
+        resolved. Lambdas created through the API still need to be resolved */
+        SkObj *list = sk_cons(body, NULL), *scope = lambda_scope(NULL, args, list);
+        rc_release(args);
+        if(sk_is_error(scope)) {
+            rc_release(list);
+            return scope;
+        }
+        args = scope;
+        body = rc_retain(list->car);
+        rc_release(list);
+    }
+    if(!args->scope->body)
+        args->scope->body = body;
+    else
+        rc_release(body);
+    n = args->scope->ncaptured;
+    assert(env || !n);
+    SkObj *e = rc_alloc_fixed(sizeof *e + n * sizeof *e->captured + sizeof(struct Closures *));
+    MEMCHECK(e);
+    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
+    e->type = LAMBDA;
+    e->args = args;
+    e->captured = (SkObj **)(e + 1);
+    e->closure_index = 0;
+    for(i = 0; i < n; i++) {
+        SkObj *ref = args->scope->captures[i], **slot = ref_slot(env, ref);
+        if((ref->flags & FLAG_BOXED) && unbox(slot) == slot) {
+            /* The variable is assigned after it is captured, so the
+            frame and the lambda have to share it */
+            SkObj *box = rc_alloc(sizeof *box);
+            MEMCHECK(box);
+            rc_set_dtor(box, (ref_dtor_t)SkExpr_dtor);
+            box->type = BOX;
+            box->flags = 0;
+            box->car = *slot;
+            *slot = box;
+        }
+        e->captured[i] = rc_retain(*slot);
+        traced |= gc_traced(*slot);
+    }
+    /* Only lambdas that captured lists, vectors, hash tables or
+    other closures can be part of a cycle */
+    if(traced)
+        closure_add(env, e);
+    return e;
+}
+
+SkObj *sk_lambda(SkObj *args, SkObj *body) {
+    return lambda_create(args, body, NULL);
+}
+
+SkObj *sk_cfun(sk_cfun_t func) {
+    SkObj *e = rc_alloc(sizeof *e);
+    MEMCHECK(e);
+    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
+    e->type = CFUN;
+    e->flags = 0;
+    e->func = func;
+    return e;
+}
+
+/* A builtin that doesn't call back into the interpreter */
+static SkObj *pure_cfun(sk_cfun_t func) {
+    SkObj *e = sk_cfun(func);
+    e->flags |= FLAG_PURE;
+    return e;
+}
+
+SkObj *sk_cdata(void *cdata, ref_dtor_t dtor) {
+    SkObj *e = rc_alloc(sizeof *e);
+    MEMCHECK(e);
+    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
+    e->type = CDATA;
+    e->cdata = cdata;
+    e->cdtor = dtor;
+    return e;
+}
+
+/* Creates a vector of `n` items, which are all '().
+Returns NULL if it would go over the memory limit */
+static SkObj *vector_create(unsigned int n) {
+    SkObj *e = rc_alloc(sizeof *e + n * sizeof *e->items);
+    if(!e)
+        return NULL;
+    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
+    e->type = VECTOR;
+    e->flags = 0;
+    e->length = n;
+    e->items = (SkObj **)(e + 1);
+    memset(e->items, 0, n * sizeof *e->items);
+    return e;
+}
+
+SkObj *sk_vector(SkObj *list) {
+    SkObj *e = vector_create(sk_length(list));
+    unsigned int i;
+    if(!e)
+        return memory_error();
+    for(i = 0; i < e->length; i++, list = list->cdr)
+        e->items[i] = rc_retain(list->car);
+    return e;
+}
+
+int sk_is_vector(SkObj *e) {
+    return e && type_of(e) == VECTOR;
+}
+
+int sk_vector_length(SkObj *e) {
+    if(!e || type_of(e) != VECTOR) return 0;
+    return e->length;
+}
+
+SkObj *sk_vector_ref(SkObj *e, int i) {
+    if(!e || type_of(e) != VECTOR || i < 0 || (unsigned int)i >= e->length) return NULL;
+    return e->items[i];
+}
+
+void *sk_get_cdata(SkObj *e) {
+    if(!e || type_of(e) != CDATA) return NULL;
+    return e->cdata;
+}
+
+ref_dtor_t sk_get_cdtor(SkObj *e) {
+    if(!e || type_of(e) != CDATA) return NULL;
+    return e->cdtor;
+}
+
+/* O(1) way to append items to a list,
+but it needs a separate pointer to track the last item in the list.
+
+Also, be careful to only use it when constructing new lists as existing
+lists are supposed to be immutable.
+*/
+static void list_append1(SkObj **list, SkObj *a, SkObj **last) {
+    SkObj *item = sk_cons(NULL, NULL);
+    item->car = a;
+    if(!*last)
+        *list = item;
+    else
+        (*last)->cdr = item;
+    *last = item;
+}
+
+static long long integer_of(SkObj *e) {
+    return IS_FIXNUM(e) ? FIXNUM_VALUE(e) : e->integer;
+}
+
+int sk_equal(SkObj *a, SkObj *b) {
+    int ta, tb;
+    if(!a || !b)
+        return !a && !b;
+    ta = type_of(a);
+    tb = type_of(b);
+    if(ta != tb) {
+        /* A number is equal to a value with the same text, so that
+        `(equal? 4 "4")` still holds */
+        int an = ta == NUMBER || ta == INTEGER;
+        int bn = tb == NUMBER || tb == INTEGER;
+        if(an && bn)
+            return sk_get_number(a) == sk_get_number(b);
+        else if((an && tb == VALUE) || (ta == VALUE && bn)) {
+            char ba[SK_TEXT_SIZE], bb[SK_TEXT_SIZE];
+            return !strcmp(sk_get_text_buf(a, ba), sk_get_text_buf(b, bb));
+        }
+        return 0;
+    } else switch(ta) {
+        case CFUN: return a->func == b->func;
+        case CDATA: return a->cdata == b->cdata && a->cdtor == b->cdtor;
+        case ERROR: return 0;
+        case SYMBOL: return a == b; /* symbols are interned */
+        case VALUE: return !strcmp(a->value, b->value);
+        case NUMBER: return a->number == b->number;
+        case INTEGER: return integer_of(a) == integer_of(b);
+        case TRUE:
+        case FALSE: return 1;
+        case CONS: return sk_equal(a->car, b->car) && sk_equal(a->cdr, b->cdr);
+        case BOX: return sk_equal(a->car, b->car);
+        case VECTOR: {
+            unsigned int i;
+            if(a->length != b->length)
+                return 0;
+            for(i = 0; i < a->length; i++)
+                if(!sk_equal(a->items[i], b->items[i]))
+                    return 0;
+            return 1;
+        }
+        case LAMBDA: {
+            unsigned int i;
+            if(!sk_equal(a->args, b->args) || !sk_equal(a->args->scope->body, b->args->scope->body))
+                return 0;
+            for(i = 0; i < a->args->scope->ncaptured; i++)
+                if(!sk_equal(a->captured[i], b->captured[i]))
+                    return 0;
+            return 1;
+        }
+        case SCOPE: return sk_equal(a->scope->source, b->scope->source);
+        case LOCAL:
+        case CAPTURED: return a->name == b->name && a->depth == b->depth && a->slot == b->slot;
+        case GLOBAL: return a->name == b->name;
+        case COMPILED: return sk_equal(a->program, b->program);
+    }
+    return 1;
+}
+
+const char *sk_get_text_buf(SkObj *e, char *buf) {
+    if(!e) return "";
+    if(e == SK_TRUE)
+        return "true";
+    else if(e == SK_FALSE)
+        return "false";
+    else if(IS_FIXNUM(e))
+        return integer_text(e, buf);
+    else if(e->type == NUMBER)
+        return number_text(e);
+    else if(e->type == INTEGER)
+        return integer_text(e, buf);
+    return (e->type == VALUE || e->type == SYMBOL || e->type == ERROR) ? e->value : "";
+}
+
+const char *sk_get_text(SkObj *e) {
+    if(!IS_FIXNUM(e))
+        return sk_get_text_buf(e, NULL);
+    return sk_get_text_buf(e, fixnum_text[fixnum_text_next++ % FIXNUM_TEXT_RING]);
+}
+
+SkObj *sk_car(SkObj *e) {
+    if(!e || type_of(e) != CONS) return NULL;
+    return e->car;
+}
+
+SkObj *sk_cdr(SkObj *e) {
+    if(!e || type_of(e) != CONS) return NULL;
+    return e->cdr;
+}
+
+int sk_is_null(SkObj *e) {
+    return e == NULL;
+}
+
+int sk_is_symbol(SkObj *e) {
+    return e && type_of(e) == SYMBOL;
+}
+
+int sk_is_cons(SkObj *e) {
+    return e && type_of(e) == CONS;
+}
+
+int sk_is_error(SkObj *e) {
+    return e && type_of(e) == ERROR;
+}
+
+int sk_is_boolean(SkObj *e) {
+    return e == SK_FALSE || e == SK_TRUE;
+}
+
+int sk_is_true(SkObj *e) {
+    return e && e != SK_FALSE;
+}
+
+int sk_is_procedure(SkObj *e) {
+    return e && !IS_IMMEDIATE(e) && (e->type == CFUN || e->type == LAMBDA);
+}
+
+int sk_is_value(SkObj *e) {
+    if(!e) return 0;
+    if(IS_IMMEDIATE(e)) return IS_FIXNUM(e);
+    return e->type == VALUE || e->type == NUMBER || e->type == INTEGER;
+}
+
+int sk_is_number(SkObj *e) {
+    if(!e) return 0;
+    if(IS_IMMEDIATE(e)) return IS_FIXNUM(e);
+    return e->type == NUMBER || e->type == INTEGER || (e->type == VALUE && sk_check_numeric(e->value));
+}
+
+int sk_is_integer(SkObj *e) {
+    long long n;
+    return exact_integer(e, &n);
+}
+
+int sk_is_cdata(SkObj *e) {
+    return e && type_of(e) == CDATA;
+}
+
+int sk_is_list(SkObj *e) {
+    for(; e; e = e->cdr)
+        if(type_of(e) != CONS)
+            return 0;
+    return 1;
+}
+
+int sk_length(SkObj *e) {
+    int count = 0;
+    for(; e && type_of(e) == CONS; e = e->cdr) count++;
+    return count;
+}
+
+/* =============================================================
+  Parser
+============================================================= */
+
+int sk_check_numeric(const char *c) {
+    int ds = 0, de = 0;
+    if(*c == '+' || *c == '-')
+        c++;
+    if(!*c || !isdigit(*c++))
+        return 0;
+    while(isdigit(*c) || (*c == '.' && !ds++) || ((*c == 'e' || *c == 'E') && !de++)) {
+        if((*c == 'e' || *c == 'E') && (c[1] == '-' || c[1] == '+'))
+            c++;
+        c++;
+    }
+    return !*c;
+}
+
+enum scan_result {
+ SCAN_ERROR = -1,
+ SCAN_END = 0,
+ SCAN_SYMBOL = 1,
+ SCAN_VALUE,
+ SCAN_NUMBER,
+ SCAN_TRUE,
+ SCAN_FALSE,
+ SCAN_VECTOR
+};
+
+static int scan(const char *in, char tok[], size_t n, const char **rem) {
+    size_t i = 0;
+    if(!in)
+        in = *rem;
+restart:
+    if(!in)
+        return SCAN_END;
+    while(isspace(*in))
+        in++;
+
+    if (*in == '\0') {
+        *rem = in;
+        return SCAN_END;
+    } else if(*in == ';') {
+        while(*in != '\n') {
+            if(*in == '\0') {
+                *rem = in;
+                return SCAN_END;
+            }
+            in++;
+        }
+        goto restart;
+    } else if (*in == '#' && (in[1] == '(' || in[1] == '[')) {
+        tok[0] = *in++;
+        tok[1] = *in++;
+        tok[2] = '\0';
+        *rem = in;
+        return SCAN_VECTOR;
+    } else if (strchr("()[]'.", *in)) {
+        tok[0] = *in;
+        tok[1] ='\0';
+        *rem =  ++in;
+        return tok[0];
+    } else if (*in == '\"') {
+        ++in;
+        while(*in != '\"') {
+            if(!*in) {
+                snprintf(tok, n, "unterminated string constant");
+                return SCAN_ERROR;
+            } else if(i == n) {
+                snprintf(tok, n, "token too long");
+                return SCAN_ERROR;
+            }
+            if(*in == '\\') {
+                ++in;
+                if(isdigit(*in)) {
+                    int v = *in - '0';
+                    while(isdigit(*++in))
+                        v = v * 10 + (*in - '0');
+                    tok[i++] = v & 0x7F;
+                } else {
+                    switch(*in) {
+                        case '\0': snprintf(tok, n, "unterminated string constant"); return SCAN_ERROR;
+                        case 'n' : tok[i++] = '\n'; break;
+                        case 'r' : tok[i++] = '\r'; break;
+                        case 't' : tok[i++] = '\t'; break;
+                        case 'b' : tok[i++] = '\b'; break;
+                        case 'a' : tok[i++] = '\a'; break;
+                        default : tok[i++] = *in; break;
+                    }
+                    in++;
+                }
+            } else
+                tok[i++] = *(in++);
+        }
+        tok[i] = '\0';
+        *rem = ++in;
+        return SCAN_VALUE;
+    } else if(!isprint(*in)) {
+        snprintf(tok, n, "bad character in input stream (%d)", *in);
+        return SCAN_ERROR;
+    } else {
+        while(isgraph(*in) && !strchr("])", *in)) {
+            if(i == n) {
+                snprintf(tok, n, "token too long");
+                return SCAN_ERROR;
+            }
+            tok[i++] = *in++;
+        }
+        tok[i] = '\0';
+        *rem = in;
+
+        if(sk_check_numeric(tok)) return SCAN_NUMBER;
+        if(tok[0] == '#' && !tok[2]) {
+            if(tolower(tok[1]) == 't') return SCAN_TRUE;
+            if(tolower(tok[1]) == 'f') return SCAN_FALSE;
+        }
+        for(i = 0; tok[i]; i++)
+            tok[i] = tolower(tok[i]);
+        return SCAN_SYMBOL;
+    }
+}
+
+#define TOKEN_SIZE 1024
+typedef struct {
+    int sym;
+    const char *text;
+    char tok[TOKEN_SIZE], next_tok[TOKEN_SIZE];
+} Parser;
+
+static void nextsym(Parser *p) {
+    memcpy(p->tok, p->next_tok, sizeof p->tok);
+    p->sym = scan(NULL, p->next_tok, sizeof p->next_tok, &p->text);
+}
+
+static int accept(Parser *p, int s) {
+    if(p->sym == s) {
+        nextsym(p);
+        return 1;
+    }
+    return 0;
+}
+
+static SkObj *parse_list(Parser *p, char term, int dotted);
+
+static SkObj *parse0(Parser *p) {
+    if(accept(p, SCAN_ERROR))
+        return sk_error(p->tok);
+    else if(accept(p, SCAN_END))
+        return NULL;
+    else if(accept(p, SCAN_SYMBOL))
+        return sk_symbol(p->tok);
+    else if(accept(p, SCAN_VALUE))
+        return sk_value(p->tok);
+    else if(accept(p, SCAN_NUMBER))
+        return number_literal(p->tok);
+    else if(accept(p, SCAN_TRUE))
+        return sk_boolean(1);
+    else if(accept(p, SCAN_FALSE))
+        return sk_boolean(0);
+    else if(accept(p, '(') || accept(p, '['))
+        return parse_list(p, p->tok[0] == '(' ? ')' : ']', 1);
+    else if(accept(p, SCAN_VECTOR)) {
+        SkObj *list = parse_list(p, p->tok[1] == '(' ? ')' : ']', 0), *v;
+        if(sk_is_error(list))
+            return list;
+        v = sk_vector(list);
+        rc_release(list);
+        return v;
+    } else if(accept(p, '\'')) {
+        SkObj *e = parse0(p);
+        if(sk_is_error(e))
+            return e;
+        return sk_cons(sk_symbol("quote"), sk_cons(e, NULL));
+    } else if(accept(p, ')') || accept(p, ']'))
+        return sk_errorf("mismatched '%c'", p->tok[0]);
+
+    return sk_error("unhandled token type");
+}
+
+/* Parses the items of a list up to `term`, after its opening bracket.
+A dotted pair is only allowed if `dotted` is set */
+static SkObj *parse_list(Parser *p, char term, int dotted) {
+    SkObj *list = NULL, *last = NULL;
+
+    while(!accept(p, term)) {
+        if(accept(p, SCAN_ERROR)) {
+            rc_release(list);
+            return sk_error(p->tok);
+        } else if(accept(p, SCAN_END)) {
+            rc_release(list);
+            return sk_errorf("expected '%c'", term);
+        } else if(accept(p, '.')) {
+            if(!last || !dotted) {
+                rc_release(list);
+                return sk_errorf("unexpected '.'");
+            }
+            SkObj *e = parse0(p);
+            if(sk_is_error(e)) {
+                rc_release(list);
+                return e;
+            }
+            last->cdr = e;
+            if(!accept(p, term)) {
+                rc_release(list);
+                return sk_errorf("expected '%c'", term);
+            }
+
+            return list;
+        }
+
+        SkObj *e = parse0(p);
+        if(sk_is_error(e)) {
+            rc_release(list);
+            return e;
+        }
+
+        list_append1(&list, e, &last);
+    }
+    return list;
 }
 
 SkObj *sk_parse(const char *text) {
@@ -644,433 +1954,2941 @@ SkObj *sk_parse(const char *text) {
     return parse0(&p);
 }
 
-SkObj *parse_stmts(const char *text) {
-    Parser p;
-    SkObj *root = sk_cons(sk_symbol("begin"), NULL), *last = root;
+SkObj *parse_stmts(const char *text) {
+    Parser p;
+    SkObj *root = sk_cons(sk_symbol("begin"), NULL), *last = root;
+
+    p.text = text;
+    p.next_tok[0] = '\0';
+    nextsym(&p);
+
+    for(;;) {
+        if(accept(&p, SCAN_END)) break;
+        SkObj * e = parse0(&p);
+        if(sk_is_error(e)) {
+            rc_release(root);
+            return e;
+        }
+        list_append1(&root, e, &last);
+    }
+    return root;
+}
+
+static SkEnv *get_global(SkEnv *env) {
+    return env->global;
+}
+
+/* =============================================================
+  Serialization
+============================================================= */
+
+static char *buffer_appendn(char **buf, int *n, int *a, const char *s, int len) {
+    assert(buf && n && a && s);
+    int nlen;
+    if(!*buf) {
+        *a = 32;
+        while(*a < len + 1) *a <<= 1;
+        *buf = malloc(*a);
+        MEMCHECK(*buf);
+        strncpy(*buf, s, len);
+        (*buf)[len] = '\0';
+        *n = len;
+        return *buf;
+    }
+    nlen = *n + len;
+    if(*a < nlen + 1) {
+        while(*a < nlen + 1) *a <<= 1;
+        *buf = realloc(*buf, *a);
+        MEMCHECK(*buf);
+    }
+    strncpy(*buf + *n, s, len);
+    *n = nlen;
+    (*buf)[nlen] = '\0';
+    return *buf;
+}
+
+static char *buffer_append(char **buf, int *n, int *a, const char *s) {
+    return buffer_appendn(buf, n, a, s, strlen(s));
+}
+
+static char *buffer_appendf(char **buf, int *n, int *a, const char *fmt, ...) {
+    va_list arg;
+    char buffer[512];
+    va_start(arg, fmt);
+    vsnprintf (buffer, sizeof(buffer)-1, fmt, arg);
+    va_end(arg);
+    return buffer_append(buf, n, a, buffer);
+}
+
+static void serialize_r(char **buf, int *n, int *a, SkObj *e) {
+    if(!e)
+        buffer_append(buf, n, a, "'() ");
+    else switch(type_of(e)) {
+        case CFUN: buffer_appendf(buf, n, a, "#<cfun:%p> ", e->func); break;
+        case CDATA: buffer_appendf(buf, n, a, "#<cdata:%p;%p>", e->cdtor, e->cdata); break;
+        case ERROR: buffer_appendf(buf, n, a, "#<error:%s> ", e->value); break;
+        case SYMBOL: buffer_appendf(buf, n, a, "%s ", e->value); break;
+        case NUMBER: buffer_appendf(buf, n, a, "%s ", number_text(e)); break;
+        case INTEGER: {
+            char text[SK_TEXT_SIZE];
+            buffer_appendf(buf, n, a, "%s ", integer_text(e, text));
+        } break;
+        case TRUE: buffer_append(buf, n, a, "#t "); break;
+        case FALSE: buffer_append(buf, n, a, "#f "); break;
+        case VALUE: {
+            buffer_appendf(buf, n, a, "\"");
+            char *s = e->value;
+            int i = 0;
+            while(s[i]) {
+                if(s[i] < ' ') {
+                    buffer_appendn(buf, n, a, s, i);
+                    switch(s[i]) {
+                    case '\n': buffer_appendn(buf, n, a, "\\n", 2); break;
+                    case '\r': buffer_appendn(buf, n, a, "\\r", 2); break;
+                    case '\t': buffer_appendn(buf, n, a, "\\t", 2); break;
+                    case '\b': buffer_appendn(buf, n, a, "\\b", 2); break;
+                    case '\a': buffer_appendn(buf, n, a, "\\a", 2); break;
+                    default: buffer_appendf(buf, n, a, "\\%d", s[i]); break;
+                    }
+                    s += i + 1;
+                    i = 0;
+                } else if(strchr("\\\"", s[i])) {
+                    buffer_appendn(buf, n, a, s, i);
+                    buffer_appendf(buf, n, a, "\\%c", s[i]);
+                    s += i + 1;
+                    i = 0;
+                } else
+                    i++;
+            }
+            buffer_appendn(buf, n, a, s, i);
+            buffer_appendf(buf, n, a, "\" ");
+        } break;
+        case CONS:
+            buffer_append(buf, n, a, "( ");
+            for(;;) {
+                serialize_r(buf, n, a, e->car);
+                if(e->cdr) {
+                    if(type_of(e->cdr) == CONS)
+                        e = e->cdr;
+                    else {
+                        buffer_append(buf, n, a, ". ");
+                        serialize_r(buf, n, a, e->cdr);
+                        break;
+                    }
+                } else
+                    break;
+            }
+            buffer_appendf(buf, n, a, ") ");
+            break;
+        case VECTOR: {
+            unsigned int i;
+            buffer_append(buf, n, a, "#( ");
+            for(i = 0; i < e->length; i++)
+                serialize_r(buf, n, a, e->items[i]);
+            buffer_append(buf, n, a, ") ");
+        } break;
+        case SCOPE: serialize_r(buf, n, a, e->scope->source); break;
+        case BOX: serialize_r(buf, n, a, e->car); break;
+        case LOCAL:
+        case CAPTURED:
+        case GLOBAL: buffer_appendf(buf, n, a, "%s ", e->name->value); break;
+        case COMPILED: serialize_r(buf, n, a, e->program); break;
+        case LAMBDA:
+            buffer_append(buf, n, a, "(lambda ");
+            serialize_r(buf, n, a, e->args);
+            buffer_append(buf, n, a, " ");
+            serialize_r(buf, n, a, e->args->scope->body);
+            buffer_append(buf, n, a, ") ");
+            break;
+    }
+}
+
+char *sk_serialize(SkObj *e) {
+    int n = 0, a = 256;
+    char *buf = malloc(a);
+    MEMCHECK(buf);
+    serialize_r(&buf, &n, &a, e);
+    return buf;
+}
+
+void sk_write(SkObj *e, FILE *f) {
+    char *buf = sk_serialize(e);
+    fputs(buf, f);
+    free(buf);
+}
+
+/* =============================================================
+  Interpreter
+============================================================= */
+
+static SkObj *eval_tree(SkEnv *env, SkObj *e);
+static SkObj *eval_vm(SkEnv *env, SkObj *e);
+static SkObj *eval_closure(SkEnv *env, SkObj *e);
+static SkObj *exec_node(struct Node *n, SkEnv *env);
+
+static SkObj *bind_args(SkEnv *env, SkObj *e) {
+    assert(!e || e->type == CONS);
+    SkObj *args = NULL, *last = NULL;
+    for(; e; e = e->cdr) {
+        SkObj *arg = eval_tree(env, e->car);
+        if(sk_is_error(arg)) {
+            rc_release(args);
+            return arg;
+        }
+        list_append1(&args, arg, &last);
+    }
+    return args;
+}
+
+static int valid_params(SkObj *e) {
+    for(; e; e = e->cdr) {
+        if(sk_is_symbol(e))
+            break;
+        else if(type_of(e) != CONS || !sk_is_symbol(e->car))
+            return 0;
+    }
+    return 1;
+}
+
+/* Checks the structure of the form `e` the first time it is evaluated,
+and marks it with FLAG_CHECKED so that `sk_eval()` can trust it afterwards.
+Only the form itself is checked; its subforms are checked when (and if)
+they are evaluated.
+Returns NULL if the form is valid, otherwise an error.
+*/
+static SkObj *check_form(SkObj *e, int form) {
+    SkObj *a;
+    if(!sk_is_list(e)) {
+        const char *what = sk_get_text(e->car);
+        return sk_errorf("bad %s", what[0] ? what : "list");
+    }
+    switch(form) {
+    case SF_DEFINE:
+    case SF_SET:
+        if(sk_length(e) != 3)
+            return sk_errorf("%s needs 2 parameters", e->car->value);
+        a = e->cdr->car;
+        if(sk_is_cons(a)) {
+            if(!sk_is_symbol(a->car))
+                return sk_error("define lambda needs function name");
+            if(!valid_params(a->cdr))
+                return sk_error("invalid lambda define");
+        } else if(!sk_is_symbol(a))
+            return sk_error("bad define");
+        break;
+    case SF_LET:
+    case SF_LETSTAR:
+        if(sk_length(e) < 3 || !sk_is_list(e->cdr->car))
+            return sk_error("bad let");
+        for(a = e->cdr->car; a; a = a->cdr) {
+            if(!sk_is_list(a->car) || sk_length(a->car) != 2
+                || !sk_is_symbol(a->car->car))
+                return sk_errorf("bad clause in '%s'", e->car->value);
+        }
+        break;
+    case SF_LAMBDA:
+        if(sk_length(e) < 3)
+            return sk_error("bad lambda");
+        if(!valid_params(e->cdr->car))
+            return sk_error("invalid lambda");
+        break;
+    case SF_IF:
+        if(sk_length(e) != 4)
+            return sk_error("bad if");
+        break;
+    case SF_QUOTE:
+        if(!e->cdr)
+            return sk_error("bad quote");
+        break;
+    }
+    e->flags |= FLAG_CHECKED;
+    return NULL;
+}
+
+static int form_of(SkObj *e) {
+    return (e->car && type_of(e->car) == SYMBOL) ? e->car->form : SF_NONE;
+}
+
+/* The resolver replaces references to the variables of lambdas and `let`s
+with LOCAL objects that address the variable by its depth (the number of
+frames up from the current one) and its slot in that frame, so that
+`sk_eval()` doesn't need to look it up by name.
+
+The frame of a lambda's call has the frame it was called from as its
+parent, so LOCALs never reach past the lambda's own scopes. The variables
+of the scopes around a lambda are captured instead: The lambda copies
+their values when it is created (see `lambda_create()`), and its body refers
+to them with CAPTURED objects. A lambda captures the variables that the
+lambdas inside it capture from further out, so that it can pass them on.
+
+The remaining free variables are looked up by name from the environment
+the lambda is called from. They become GLOBAL objects, which cache where
+in the global environment they found the variable (see `env_find_global()`).
+
+`set!` assigns the variable in the scopes of the lambda (or the top level)
+that it is in. A `set!` of any other variable binds it in the innermost
+scope, by adding a slot for it. Until the slot is assigned, references to
+it look up the variable by name from the next frame up.
+
+A variable that is captured and also assigned with `set!` has to be shared
+by the frame and the lambdas, so the LOCAL references that lambdas capture
+it through are marked with FLAG_BOXED once its scope has been resolved.
+
+The last reference to a variable of a lambda's frame can take its value out
+of the frame, so that a list that is passed on through a variable, as in
+`(acc (append l (list n)) (- n 1))`, isn't also held by the frame, which
+the frame of the next call keeps alive as its parent. Functions called later
+could still look the variable up by name, so the value is only moved if
+nothing after it creates a lambda or assigns a variable, and every function
+it calls turns out to be a builtin that doesn't call back into the
+interpreter or a lambda with a parameter of the same name.
+*/
+typedef struct Resolver {
+    struct Resolver *up;
+    SkObj **names;
+    char *visible; /* so `let*` can hide the names that aren't bound yet */
+    char *assigned; /* the slots that `set!` assigns */
+    unsigned int count, size;
+    int lambda; /* set if it is the scope of a lambda rather than a `let` */
+    SkObj **captures; /* lambdas: where the captured variables come from */
+    unsigned int ncaptured, acaptured;
+    SkObj **shared; /* the LOCAL references into this scope that lambdas capture */
+    unsigned int nshared, ashared;
+} Resolver;
+
+static unsigned int resolver_add(Resolver *r, SkObj *sym, int visible) {
+    if(r->count == r->size) {
+        r->size = r->size ? r->size << 1 : 4;
+        r->names = realloc(r->names, r->size * sizeof *r->names);
+        MEMCHECK(r->names);
+        r->visible = realloc(r->visible, r->size);
+        MEMCHECK(r->visible);
+        r->assigned = realloc(r->assigned, r->size);
+        MEMCHECK(r->assigned);
+    }
+    r->names[r->count] = rc_retain(sym);
+    r->visible[r->count] = visible;
+    r->assigned[r->count] = 0;
+    return r->count++;
+}
+
+static int resolver_slot(Resolver *r, SkObj *sym, unsigned int *slot) {
+    unsigned int i = r->count;
+    while(i--) {
+        if(r->names[i] == sym && r->visible[i]) {
+            *slot = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Creates the SCOPE object from the names collected in `r` */
+static SkObj *make_scope(Resolver *r, SkObj *source, unsigned int nparams, int rest) {
+    unsigned int i;
+    SkObj *e = rc_alloc(sizeof *e);
+    MEMCHECK(e);
+    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
+    e->type = SCOPE;
+    e->scope = malloc(sizeof *e->scope + r->count * sizeof *e->scope->names);
+    MEMCHECK(e->scope);
+    e->scope->source = rc_retain(source);
+    e->scope->nslots = r->count;
+    e->scope->nparams = nparams;
+    e->scope->rest = rest;
+    e->scope->code = NULL;
+    e->scope->node = NULL;
+    e->scope->body = NULL;
+    /* The scope takes over the references to the names and captures */
+    e->scope->ncaptured = r->ncaptured;
+    e->scope->captures = r->captures;
+    e->scope->guards = NULL;
+    if(r->count)
+        memcpy(e->scope->names, r->names, r->count * sizeof *r->names);
+    for(i = 0; i < r->nshared; i++)
+        if(r->assigned[r->shared[i]->slot])
+            r->shared[i]->flags |= FLAG_BOXED;
+    free(r->names);
+    free(r->visible);
+    free(r->assigned);
+    free(r->shared);
+    return e;
+}
+
+/* Makes a LOCAL or CAPTURED reference */
+static SkObj *make_ref(int type, SkObj *name, unsigned int depth, unsigned int slot) {
+    SkObj *e = rc_alloc(sizeof *e);
+    MEMCHECK(e);
+    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
+    e->type = type;
+    e->flags = 0;
+    e->name = rc_retain(name);
+    e->depth = depth;
+    e->slot = slot;
+    return e;
+}
+
+static SkObj *resolver_capture(Resolver *r, SkObj *sym);
+
+/* Returns a reference to the variable `sym` as seen from the scope `r`,
+or NULL if it isn't a variable of `r` or the scopes around it.
+If it is a LOCAL reference, `owner` gets the scope of the variable */
+static SkObj *resolver_ref(Resolver *r, SkObj *sym, Resolver **owner) {
+    unsigned int depth, slot;
+    for(depth = 0; r; r = r->up, depth++) {
+        if(resolver_slot(r, sym, &slot)) {
+            *owner = r;
+            return make_ref(LOCAL, sym, depth, slot);
+        }
+        if(r->lambda)
+            return resolver_capture(r, sym);
+    }
+    return NULL;
+}
+
+/* Returns a CAPTURED reference to `sym` from within the lambda `r`,
+adding it to the variables that the lambda captures if necessary */
+static SkObj *resolver_capture(Resolver *r, SkObj *sym) {
+    SkObj *from;
+    Resolver *owner = NULL;
+    unsigned int i;
+    for(i = 0; i < r->ncaptured; i++) {
+        if(r->captures[i]->name == sym)
+            return make_ref(CAPTURED, sym, 0, i);
+    }
+    if(!(from = resolver_ref(r->up, sym, &owner)))
+        return NULL;
+    if(owner) {
+        if(owner->nshared == owner->ashared) {
+            owner->ashared = owner->ashared ? owner->ashared << 1 : 4;
+            owner->shared = realloc(owner->shared, owner->ashared * sizeof *owner->shared);
+            MEMCHECK(owner->shared);
+        }
+        owner->shared[owner->nshared++] = from;
+    }
+    if(r->ncaptured == r->acaptured) {
+        r->acaptured = r->acaptured ? r->acaptured << 1 : 4;
+        r->captures = realloc(r->captures, r->acaptured * sizeof *r->captures);
+        MEMCHECK(r->captures);
+    }
+    r->captures[r->ncaptured] = from;
+    return make_ref(CAPTURED, sym, 0, r->ncaptured++);
+}
+
+static SkObj *make_global(SkObj *name) {
+    SkObj *e = rc_alloc(sizeof *e);
+    MEMCHECK(e);
+    rc_set_dtor(e, (ref_dtor_t)SkExpr_dtor);
+    e->type = GLOBAL;
+    e->name = rc_retain(name);
+    e->cache = calloc(1, sizeof *e->cache);
+    MEMCHECK(e->cache);
+    return e;
+}
+
+static void resolve(Resolver *r, SkObj **pe);
+
+static void resolve_list(Resolver *r, SkObj *e) {
+    for(; e; e = e->cdr)
+        resolve(r, &e->car);
+}
+
+/* `last_uses()` walks an expression backwards, in the reverse of the order
+in which it is evaluated. `level` is the number of `let` frames between the
+point it has got to and the lambda's frame */
+typedef struct Uses {
+    char *live; /* the slots of the lambda's frame that are used after this point */
+    int blocked; /* something after this point may look up any variable by name */
+    SkObj *calls; /* the GLOBAL references to the functions called after this point */
+    SkObj **guards; /* for each slot, the `calls` of its last uses */
+} Uses;
+
+static void last_uses(Resolver *r, SkObj *e, Uses *u, unsigned int level);
+
+/* Adds the GLOBAL references in `refs` to the list `calls`,
+once for each name */
+static void add_calls(SkObj **calls, SkObj *refs) {
+    SkObj *c;
+    for(; refs; refs = refs->cdr) {
+        for(c = *calls; c && c->car->name != refs->car->name; c = c->cdr);
+        if(!c)
+            *calls = sk_cons(rc_retain(refs->car), *calls);
+    }
+}
+
+static void last_uses_list(Resolver *r, SkObj *e, Uses *u, unsigned int level) {
+    if(e && type_of(e) == CONS) {
+        last_uses_list(r, e->cdr, u, level);
+        last_uses(r, e->car, u, level);
+    }
+}
+
+/* The variables that a lambda captures are used where it is created */
+static void captures_used(SkObj *scope, char *live, unsigned int level) {
+    unsigned int i;
+    for(i = 0; i < scope->scope->ncaptured; i++) {
+        SkObj *from = scope->scope->captures[i];
+        if(from->type == LOCAL && from->depth == level)
+            live[from->slot] = 1;
+    }
+}
+
+/* The values of the bindings of a `let` */
+static void last_uses_values(Resolver *r, SkObj *b, Uses *u, unsigned int level) {
+    if(b) {
+        last_uses_values(r, b->cdr, u, level);
+        last_uses(r, b->car->cdr->car, u, level);
+    }
+}
+
+static void last_uses(Resolver *r, SkObj *e, Uses *u, unsigned int level) {
+    SkObj *c;
+    Uses other;
+    unsigned int i;
+    if(!e || IS_IMMEDIATE(e))
+        return;
+    if(e->type == LOCAL) {
+        if(e->depth != level)
+            return; /* a variable of a `let` */
+        if(!level && !u->live[e->slot] && !u->blocked && !r->assigned[e->slot]) {
+            e->flags |= FLAG_LAST;
+            add_calls(&u->guards[e->slot], u->calls);
+        }
+        u->live[e->slot] = 1;
+        return;
+    }
+    if(e->type != CONS)
+        return;
+    if(!(e->flags & FLAG_CHECKED)) {
+        /* A form that `sk_eval()` will report as an error, if it is ever
+        evaluated; nothing can be moved before it */
+        memset(u->live, 1, r->count);
+        u->blocked = 1;
+        return;
+    }
+    c = e->cdr;
+    switch(form_of(e)) {
+    case SF_QUOTE:
+        break;
+    case SF_IF:
+        /* Only one of the branches is evaluated */
+        other = *u;
+        other.live = malloc(r->count);
+        MEMCHECK(other.live);
+        memcpy(other.live, u->live, r->count);
+        other.calls = NULL;
+        add_calls(&other.calls, u->calls);
+        last_uses(r, c->cdr->cdr->car, &other, level);
+        last_uses(r, c->cdr->car, u, level);
+        for(i = 0; i < r->count; i++)
+            u->live[i] |= other.live[i];
+        u->blocked |= other.blocked;
+        add_calls(&u->calls, other.calls);
+        rc_release(other.calls);
+        free(other.live);
+        last_uses(r, c->car, u, level);
+        break;
+    case SF_DEFINE:
+    case SF_SET:
+        /* The variable may be the one a function called later is found by */
+        u->blocked = 1;
+        if(sk_is_cons(c->car)) {
+            captures_used(c->car->cdr, u->live, level);
+            break;
+        }
+        last_uses(r, c->car, u, level);
+        last_uses(r, c->cdr->car, u, level);
+        break;
+    case SF_LAMBDA:
+        u->blocked = 1;
+        captures_used(c->car, u->live, level);
+        break;
+    case SF_LET:
+    case SF_LETSTAR:
+        last_uses_list(r, c->cdr, u, level + 1);
+        /* The values of a `let` are evaluated outside its frame,
+        those of a `let*` inside it */
+        last_uses_values(r, c->car->scope->source, u, form_of(e) == SF_LETSTAR ? level + 1 : level);
+        break;
+    case SF_NONE:
+        /* The function is called after its arguments are evaluated. Only
+        functions named by free variables are known before the call */
+        if(e->car && !IS_IMMEDIATE(e->car) && e->car->type == GLOBAL) {
+            c = sk_cons(rc_retain(e->car), NULL);
+            add_calls(&u->calls, c);
+            rc_release(c);
+        } else
+            u->blocked = 1;
+        last_uses_list(r, e, u, level);
+        break;
+    default:
+        last_uses_list(r, c, u, level);
+        break;
+    }
+}
+
+/* Resolves the variables in the list of expressions `body` of a
+lambda within the scope `up`, and returns the lambda's SCOPE */
+static SkObj *lambda_scope(Resolver *up, SkObj *params, SkObj *body) {
+    Resolver r = {up, NULL, NULL, NULL, 0, 0, 1, NULL, 0, 0, NULL, 0, 0};
+    Uses u = {NULL, 0, NULL, NULL};
+    unsigned int nparams = 0;
+    int rest = 0;
+    SkObj *p, *scope;
+    if(!valid_params(params))
+        return sk_error("invalid lambda");
+    for(p = params; p; p = p->cdr) {
+        if(sk_is_symbol(p)) {
+            resolver_add(&r, p, 1);
+            rest = 1;
+            break;
+        }
+        resolver_add(&r, p->car, 1);
+        nparams++;
+    }
+    resolve_list(&r, body);
+    if(r.count) {
+        u.live = calloc(r.count, 1);
+        MEMCHECK(u.live);
+        u.guards = calloc(r.count, sizeof *u.guards);
+        MEMCHECK(u.guards);
+        last_uses_list(&r, body, &u, 0);
+        rc_release(u.calls);
+        free(u.live);
+    }
+    scope = make_scope(&r, params, nparams, rest);
+    scope->scope->guards = u.guards;
+    return scope;
+}
+
+static void resolve_let(Resolver *r, SkObj *e, int form) {
+    Resolver s = {r, NULL, NULL, NULL, 0, 0, 0, NULL, 0, 0, NULL, 0, 0};
+    SkObj *b, *bindings = e->cdr->car;
+    unsigned int i;
+    for(b = bindings; b; b = b->cdr) {
+        /* The values of a `let` are evaluated outside its frame,
+        those of a `let*` inside it */
+        resolve(form == SF_LETSTAR ? &s : r, &b->car->cdr->car);
+        resolver_add(&s, b->car->car, form == SF_LETSTAR);
+    }
+    for(i = 0; i < s.count; i++)
+        s.visible[i] = 1;
+    resolve_list(&s, e->cdr->cdr);
+    e->cdr->car = make_scope(&s, bindings, 0, 0);
+    rc_release(bindings);
+}
+
+/* Resolves the variables in a form that `check_form()` has accepted.
+The parameter list of a lambda (or the bindings of a `let`) is replaced
+with its SCOPE */
+static void resolve_form(Resolver *r, SkObj *e, int form) {
+    SkObj *c = e->cdr, *params;
+    unsigned int slot;
+    switch(form) {
+    case SF_QUOTE:
+        break;
+    case SF_DEFINE:
+    case SF_SET:
+        if(sk_is_cons(c->car)) {
+            /* `(define (f a b c) (body))` */
+            params = c->car->cdr;
+            c->car->cdr = lambda_scope(r, params, c->cdr);
+            rc_release(params);
+        } else {
+            resolve(r, &c->cdr->car);
+            if(form == SF_SET && r) {
+                SkObj *sym = c->car;
+                Resolver *s = r;
+                unsigned int depth = 0;
+                while(!resolver_slot(s, sym, &slot)) {
+                    if(s->lambda || !s->up) {
+                        s = r;
+                        depth = 0;
+                        slot = resolver_add(r, sym, 1);
+                        break;
+                    }
+                    s = s->up;
+                    depth++;
+                }
+                s->assigned[slot] = 1;
+                c->car = make_ref(LOCAL, sym, depth, slot);
+                rc_release(sym);
+            }
+        }
+        break;
+    case SF_LAMBDA:
+        params = c->car;
+        c->car = lambda_scope(r, params, c->cdr);
+        rc_release(params);
+        break;
+    case SF_LET:
+    case SF_LETSTAR:
+        resolve_let(r, e, form);
+        break;
+    case SF_NONE:
+        resolve_list(r, e);
+        break;
+    default:
+        resolve_list(r, c);
+        break;
+    }
+}
+
+static void resolve(Resolver *r, SkObj **pe) {
+    SkObj *e = *pe, *err;
+    if(!e || IS_IMMEDIATE(e))
+        return;
+    if(e->type == SYMBOL) {
+        Resolver *owner;
+        SkObj *ref = resolver_ref(r, e, &owner);
+        *pe = ref ? ref : make_global(e);
+        rc_release(e);
+    } else if(e->type == CONS && !(e->flags & FLAG_CHECKED)) {
+        int form = form_of(e);
+        if((err = check_form(e, form))) {
+            /* sk_eval() will report it, if the form is ever evaluated */
+            rc_release(err);
+            return;
+        }
+        resolve_form(r, e, form);
+    }
+}
+
+/* Returns where the value of the variable that `e` refers to is stored,
+or NULL if `e` isn't a variable or the variable can't be found.
+
+This lets the interpreter use the values of variables that it only needs
+for a moment, like the test of an `if`, without the `rc_retain()` and
+`rc_release()` of evaluating them. The caller must be done with the value
+before it evaluates anything else, which could assign the variable */
+static SkObj **var_slot(SkEnv *env, SkObj *e) {
+    SkEnv *frame = env;
+    unsigned int d;
+    if(!e || IS_IMMEDIATE(e))
+        return NULL;
+    switch(e->type) {
+        case SYMBOL: return env_findg_r(env, e);
+        case GLOBAL: return env_find_global(env, e);
+        case CAPTURED: return env_find_captured(env, e);
+        case LOCAL:
+            for(d = e->depth; d; d--)
+                frame = frame->parent;
+            if(*unbox(&frame->slots[e->slot]) == UNBOUND)
+                return env_find_outer(frame, e->name);
+            return unbox(&frame->slots[e->slot]);
+        default: return NULL;
+    }
+}
+
+static SkObj *eval_tree(SkEnv *env, SkObj *e);
+
+/* Evaluates the test of an `if`, `and` or `or` into `*truth`.
+Returns an error, or NULL */
+static SkObj *eval_test(SkEnv *env, SkObj *e, int *truth) {
+    SkObj **v = var_slot(env, e), *c;
+    if(v && !sk_is_error(*v)) {
+        *truth = sk_is_true(*v);
+        return NULL;
+    }
+    c = eval_tree(env, e);
+    if(sk_is_error(c))
+        return c;
+    *truth = sk_is_true(c);
+    rc_release(c);
+    return NULL;
+}
+
+/* The engines check the memory limit before each call, which is where
+loops and recursion allocate, and stop with this error */
+static SkObj *memory_error(void) {
+    return sk_error("memory limit exceeded");
+}
+
+/* The tree-walking interpreter */
+static SkObj *eval_tree(SkEnv *env, SkObj *e) {
+    SkObj *result = NULL, *args = NULL;
+    SkEnv *new_env = NULL;
+
+    assert(env);
+    for(;;) {
+        if(result) {
+            rc_release(result);
+            result = NULL;
+        }
+        if(!e)
+            goto end;
+        else if(type_of(e) == SYMBOL) {
+            SkObj **v = env_findg_r(env, e);
+            result = v ? rc_retain(*v) : sk_errorf("no such variable '%s'", e->value);
+        } else if(type_of(e) == GLOBAL) {
+            SkObj **v = env_find_global(env, e);
+            result = v ? rc_retain(*v) : sk_errorf("no such variable '%s'", e->name->value);
+        } else if(type_of(e) == CAPTURED) {
+            SkObj **v = env_find_captured(env, e);
+            result = v ? rc_retain(*v) : sk_errorf("no such variable '%s'", e->name->value);
+        } else if(type_of(e) == LOCAL) {
+            SkEnv *frame = env;
+            unsigned int d;
+            for(d = e->depth; d; d--)
+                frame = frame->parent;
+            SkObj **v = unbox(&frame->slots[e->slot]);
+            if(*v == UNBOUND) {
+                /* A variable that `set!` hasn't assigned in this frame (yet) */
+                v = env_find_outer(frame, e->name);
+                result = v ? rc_retain(*v) : sk_errorf("no such variable '%s'", e->name->value);
+            } else if((e->flags & FLAG_LAST) && can_move(frame, e)) {
+                result = *v;
+                *v = UNBOUND;
+            } else
+                result = rc_retain(*v);
+        } else if(type_of(e) == CONS) {
+            int form = form_of(e);
+            if(!(e->flags & FLAG_CHECKED)) {
+                if((result = check_form(e, form)))
+                    goto end;
+                /* Function calls aren't resolved at the top level, because
+                `sk_apply()` evaluates lists of arguments that are data */
+                if(form != SF_NONE)
+                    resolve_form(NULL, e, form);
+            }
+            switch(form) {
+            case SF_DEFINE:
+            case SF_SET: {
+                e = e->cdr;
+
+                SkObj *varname;
+                if(sk_is_cons(e->car)) {
+                    /* `(define (f a b c) (body))` or `(define (f . args) (body))` forms */
+                    SkObj *f = e->car;
+                    varname = f->car;
+
+                    SkObj *body = sk_cons(sk_symbol("begin"), rc_retain(e->cdr));
+                    body->flags |= FLAG_CHECKED; /* e is already known to be a list */
+                    result = lambda_create(rc_retain(f->cdr), body, env);
+                } else {
+                    /* `(define v expr)` form */
+                    varname = e->car;
+                    result = eval_tree(env, sk_cadr(e));
+                    if(sk_is_error(result))
+                        goto end;
+                }
+                if(type_of(varname) == LOCAL) {
+                    /* `set!` of a variable in the frames of the current lambda */
+                    SkEnv *frame = env;
+                    SkObj **v;
+                    unsigned int d;
+                    for(d = varname->depth; d; d--)
+                        frame = frame->parent;
+                    v = unbox(&frame->slots[varname->slot]);
+                    rc_release(*v);
+                    *v = rc_retain(result);
+                } else {
+                    SkEnv *tgt_env = env;
+                    if(form == SF_DEFINE)
+                        tgt_env = get_global(tgt_env);
+
+                    env_put(tgt_env, varname, rc_retain(result));
+                }
+
+            } break;
+            case SF_LET:
+            case SF_LETSTAR: {
+                SkObj *scope = e->cdr->car, *a, *b = e->cdr->cdr;
+                unsigned int i = 0;
+
+                SkEnv *o = new_env;
+                new_env = frame_create(scope, env, env->fn);
+                rc_release(o);
+
+                for(a = scope->scope->source; a; a = a->cdr, i++) {
+                    SkObj *v = eval_tree(form == SF_LETSTAR ? new_env : env, a->car->cdr->car);
+                    if(sk_is_error(v) && (result = v))
+                        goto end_let;
+                    new_env->slots[i] = v;
+                }
+                for(; b && b->cdr; b = b->cdr) {
+                    rc_release(result);
+                    result = eval_tree(new_env, b->car);
+                    if(sk_is_error(result))
+                        goto end_let;
+                }
+                if(b) {
+                    e = b->car;
+                    env = new_env;
+                    continue;
+                }
+end_let:
+                rc_release(new_env);
+                new_env = NULL;
+
+            } break;
+            case SF_LAMBDA: {
+                e = e->cdr;
+                SkObj *body = sk_cons(sk_symbol("begin"), rc_retain(e->cdr));
+                body->flags |= FLAG_CHECKED;
+                result = lambda_create(rc_retain(e->car), body, env);
+            } break;
+            case SF_IF: {
+                int cond;
+                e = e->cdr;
+                if((result = eval_test(env, e->car, &cond)))
+                    goto end;
+
+                if(cond)
+                    e = e->cdr;
+                else
+                    e = e->cdr->cdr;
+
+                e = e->car;
+                continue; /* TCO */
+            }
+            case SF_AND: {
+                int ans = 1;
+                for(e = e->cdr; ans && e; e = e->cdr) {
+                    if((result = eval_test(env, e->car, &ans)))
+                        goto end;
+                }
+                result = sk_boolean(ans);
+            } break;
+            case SF_OR: {
+                int ans = 0;
+                for(e = e->cdr; !ans && e; e = e->cdr) {
+                    if((result = eval_test(env, e->car, &ans)))
+                        goto end;
+                }
+                result = sk_boolean(ans);
+            } break;
+            case SF_QUOTE:
+                result = rc_retain(e->cdr->car);
+                break;
+            case SF_BEGIN:
+                for(e = e->cdr; e && e->cdr; e = e->cdr) {
+                    rc_release(result);
+                    result = eval_tree(env, e->car);
+                    if(sk_is_error(result)) goto end;
+                }
+                if(e) {
+                    e = e->car;
+                    continue; /* TCO */
+                }
+                break;
+            default: {
+                /* Function call. A function that is called through a variable
+                isn't retained: A CFUN's function pointer is copied out of it
+                before the arguments are evaluated, and the frame of a lambda
+                holds a reference to the lambda until its call is over */
+                SkObj **fv, *f, *owned = NULL, *a;
+                if(rc_over_limit()) {
+                    result = memory_error();
+                    goto end;
+                }
+                fv = var_slot(env, e->car);
+                if(fv)
+                    f = *fv;
+                else
+                    f = owned = eval_tree(env, e->car);
+                if(sk_is_error(f) && (result = rc_retain(f))) {
+                    rc_release(owned);
+                    goto end;
+                }
+
+                if(f && type_of(f) == CFUN) {
+                    sk_cfun_t func = f->func;
+                    assert(func);
+                    rc_release(args);
+                    args = bind_args(env, e->cdr);
+                    if(sk_is_error(args))
+                        result = rc_retain(args);
+                    else
+                        result = func(env, args);
+                    rc_release(owned);
+                } else if(f && type_of(f) == LAMBDA) {
+                    /* The arguments are evaluated straight into the slots of the new frame */
+                    Scope *scope = f->args->scope;
+                    SkObj *rest = NULL, *last = NULL;
+                    SkEnv *frame = frame_create(f->args, env, f);
+                    unsigned int i;
+
+                    rc_release(owned);
+
+                    for(a = e->cdr, i = 0; a; a = a->cdr, i++) {
+                        if(i >= scope->nparams && !scope->rest) {
+                            result = sk_error("too many arguments passed to lambda");
+                            break;
+                        }
+                        SkObj *v = eval_tree(env, a->car);
+                        if(sk_is_error(v) && (result = v))
+                            break;
+                        if(i < scope->nparams)
+                            frame->slots[i] = v;
+                        else
+                            list_append1(&rest, v, &last);
+                    }
+                    if(!result && i < scope->nparams)
+                        result = sk_error("too few arguments passed to lambda");
+                    if(result) {
+                        rc_release(rest);
+                        rc_release(frame);
+                        goto end;
+                    }
+                    if(scope->rest)
+                        frame->slots[scope->nparams] = rest;
+
+                    SkEnv *o = new_env;
+                    new_env = frame;
+                    rc_release(o);
+
+                    env = new_env;
+                    e = f->args->scope->body;
+                    continue; /* TCO */
+                } else {
+                    rc_release(owned);
+                    result = sk_errorf("attempt to call something that is not a function");
+                }
+            }
+            }
+        } else {
+            assert (IS_IMMEDIATE(e) || e->type == VALUE || e->type == NUMBER || e->type == INTEGER ||
+                    e->type == CFUN || e->type == CDATA || e->type == LAMBDA ||
+                    e->type == VECTOR || e->type == ERROR);
+            result = rc_retain(e);
+        }
+        break;
+    } /* for(;;) */
+end:
+
+    rc_release(args);
+    rc_release(new_env);
+
+    return result;
+}
+
+SkObj *sk_eval(SkEnv *env, SkObj *e) {
+    SkObj *result;
+    unsigned int account;
+    SymbolTable *was;
+    assert(env);
+    account = rc_account_use(env->global->account);
+    was = symbols_use(env->global->symbols);
+    if(rc_over_limit())
+        result = memory_error();
+    else if(e && type_of(e) == COMPILED)
+        result = exec_node(e->node, env);
+    else switch(env->global->engine) {
+        case SK_ENGINE_VM: result = eval_vm(env, e); break;
+        case SK_ENGINE_CLOSURE: result = eval_closure(env, e); break;
+        default: result = eval_tree(env, e); break;
+    }
+    symbols_restore(was);
+    rc_account_use(account);
+    return result;
+}
+
+void sk_set_engine(SkEnv *env, int engine) {
+    env->global->engine = engine;
+}
+
+void sk_set_memory_limit(SkEnv *env, size_t limit) {
+    Account *a = rc_account_get(env->global->account);
+    if(a)
+        a->limit = limit;
+}
+
+int sk_memory_stats(SkEnv *env, SkMemStats *stats) {
+    Account *a = rc_account_get(env->global->account);
+    if(!a)
+        return 0;
+    *stats = a->stats;
+    return 1;
+}
+
+/* The parse tree is allocated like any other object rather than from an
+arena that is freed in one go: the resolver rewrites its forms in place, and
+quoted data and lambda bodies keep parts of it alive after the evaluation,
+so they would have to be copied out of the arena first */
+SkObj *sk_eval_str(SkEnv *global, const char *text) {
+    SymbolTable *was = symbols_use(global->global->symbols);
+    SkObj *program = parse_stmts(text), *result;
+    if(sk_is_error(program))
+        result = program;
+    else {
+        result = sk_eval(global, program);
+        rc_release(program);
+    }
+    symbols_restore(was);
+    return result;
+}
+
+SkObj *sk_apply(SkEnv *env, SkObj *f, SkObj *a) {
+    SkObj *c = sk_cons(rc_retain(f), rc_retain(a));
+    SkObj *r = sk_eval(env, c);
+    rc_release(c);
+    return r;
+}
+
+/* =============================================================
+  Bytecode compiler and virtual machine
+============================================================= */
+
+/* The alternative to `eval_tree()` selected through `sk_set_engine()`.
+Expressions are compiled to bytecode for a stack machine, and the body of
+each lambda is compiled the first time it is called.
+Each instruction is an opcode, followed by its operand if it has one. */
+enum opcode {
+    OP_CONST,    /* k: push constant k */
+    OP_LOCAL,    /* k: push the variable of the LOCAL constant k */
+    OP_GLOBAL,   /* k: push the variable of the GLOBAL constant k */
+    OP_CAPTURED, /* k: push the variable of the CAPTURED constant k */
+    OP_SYMBOL,   /* k: push the variable named by the symbol constant k */
+    OP_SETLOCAL, /* k: set the LOCAL variable of constant k to the top of the stack */
+    OP_DEFINE,   /* k: set the global variable named by constant k to the top of the stack */
+    OP_PUT,      /* k: set the variable named by constant k in the current environment */
+    OP_LAMBDA,   /* k: push a lambda with the SCOPE constant k and the body constant k+1 */
+    OP_ENTER,    /* k: create a frame for the SCOPE constant k */
+    OP_STORE,    /* s: pop the top of the stack into slot s of the current frame */
+    OP_LEAVE,    /*    go back to the parent of the current frame */
+    OP_POP,      /*    discard the top of the stack */
+    OP_JUMP,     /* a: jump to address a */
+    OP_JUMPF,    /* a: pop the top of the stack and jump to a if it is false */
+    OP_JUMPT,    /* a: pop the top of the stack and jump to a if it is true */
+    OP_CALL,     /* n: call the function below the n arguments on the stack */
+    OP_TAILCALL, /* n: like OP_CALL, but the called lambda replaces the current one */
+    OP_RETURN,   /*    return the top of the stack to the caller */
+    OP_FAIL      /* k: stop with the error constant k */
+};
+
+typedef struct Code {
+    int *ops;
+    unsigned int nops, aops;
+    SkObj **consts;
+    unsigned int nconsts, aconsts;
+} Code;
+
+static void code_free(Code *code) {
+    unsigned int i;
+    if(!code)
+        return;
+    for(i = 0; i < code->nconsts; i++)
+        rc_release(code->consts[i]);
+    free(code->consts);
+    free(code->ops);
+    free(code);
+}
+
+static int emit(Code *code, int op) {
+    if(code->nops == code->aops) {
+        code->aops = code->aops ? code->aops << 1 : 16;
+        code->ops = realloc(code->ops, code->aops * sizeof *code->ops);
+        MEMCHECK(code->ops);
+    }
+    code->ops[code->nops] = op;
+    return code->nops++;
+}
+
+static void emit_op(Code *code, int op, int operand) {
+    emit(code, op);
+    emit(code, operand);
+}
+
+/* Adds `e` to the constants. The constants keep their own reference to it */
+static int constant(Code *code, SkObj *e) {
+    if(code->nconsts == code->aconsts) {
+        code->aconsts = code->aconsts ? code->aconsts << 1 : 8;
+        code->consts = realloc(code->consts, code->aconsts * sizeof *code->consts);
+        MEMCHECK(code->consts);
+    }
+    code->consts[code->nconsts] = rc_retain(e);
+    return code->nconsts++;
+}
+
+/* Emits a jump with an address that is filled in with `patch()` */
+static int emit_jump(Code *code, int op) {
+    emit(code, op);
+    return emit(code, 0);
+}
+
+static void patch(Code *code, int at) {
+    code->ops[at] = code->nops;
+}
+
+static void compile(Code *code, SkObj *e, int tail);
+
+static void compile_sequence(Code *code, SkObj *e, int tail) {
+    if(!e) {
+        emit_op(code, OP_CONST, constant(code, NULL));
+        return;
+    }
+    for(; e->cdr; e = e->cdr) {
+        compile(code, e->car, 0);
+        emit(code, OP_POP);
+    }
+    compile(code, e->car, tail);
+}
+
+static void compile_lambda(Code *code, SkObj *scope, SkObj *body) {
+    SkObj *b = sk_cons(sk_symbol("begin"), rc_retain(body));
+    b->flags |= FLAG_CHECKED;
+    emit_op(code, OP_LAMBDA, constant(code, scope));
+    constant(code, b);
+    rc_release(b);
+}
+
+static void compile_form(Code *code, SkObj *e, int tail) {
+    int form = form_of(e), n, at, end;
+    SkObj *a;
+
+    if(!(e->flags & FLAG_CHECKED)) {
+        /* Analysed like `eval_tree()` does, but the errors
+        are only reported if the form is reached */
+        SkObj *err = check_form(e, form);
+        if(err) {
+            emit_op(code, OP_FAIL, constant(code, err));
+            rc_release(err);
+            return;
+        }
+        if(form != SF_NONE)
+            resolve_form(NULL, e, form);
+    }
+
+    switch(form) {
+    case SF_QUOTE:
+        emit_op(code, OP_CONST, constant(code, e->cdr->car));
+        break;
+    case SF_DEFINE:
+    case SF_SET: {
+        SkObj *target = e->cdr->car, *varname = target;
+        if(sk_is_cons(target)) {
+            compile_lambda(code, target->cdr, e->cdr->cdr);
+            varname = target->car;
+        } else
+            compile(code, e->cdr->cdr->car, 0);
+        if(type_of(varname) == LOCAL)
+            emit_op(code, OP_SETLOCAL, constant(code, varname));
+        else
+            emit_op(code, form == SF_DEFINE ? OP_DEFINE : OP_PUT, constant(code, varname));
+    } break;
+    case SF_LAMBDA:
+        compile_lambda(code, e->cdr->car, e->cdr->cdr);
+        break;
+    case SF_LET:
+    case SF_LETSTAR: {
+        SkObj *scope = e->cdr->car;
+        if(form == SF_LET) {
+            /* The values are evaluated before the frame is created */
+            for(a = scope->scope->source, n = 0; a; a = a->cdr, n++)
+                compile(code, a->car->cdr->car, 0);
+            emit_op(code, OP_ENTER, constant(code, scope));
+            while(n--)
+                emit_op(code, OP_STORE, n);
+        } else {
+            emit_op(code, OP_ENTER, constant(code, scope));
+            for(a = scope->scope->source, n = 0; a; a = a->cdr, n++) {
+                compile(code, a->car->cdr->car, 0);
+                emit_op(code, OP_STORE, n);
+            }
+        }
+        compile_sequence(code, e->cdr->cdr, tail);
+        emit(code, OP_LEAVE);
+    } break;
+    case SF_IF:
+        e = e->cdr;
+        compile(code, e->car, 0);
+        at = emit_jump(code, OP_JUMPF);
+        compile(code, e->cdr->car, tail);
+        end = emit_jump(code, OP_JUMP);
+        patch(code, at);
+        compile(code, e->cdr->cdr->car, tail);
+        patch(code, end);
+        break;
+    case SF_AND:
+    case SF_OR: {
+        /* The result is #t or #f, like in `eval_tree()` */
+        int jumps[2], i = 0, op = form == SF_AND ? OP_JUMPF : OP_JUMPT;
+        SkObj *done = sk_boolean(form == SF_AND), *short_circuit = sk_boolean(form != SF_AND);
+        for(a = e->cdr; a; a = a->cdr) {
+            compile(code, a->car, 0);
+            emit_op(code, op, i);
+            i = code->nops - 1; /* chain the jumps to patch them later */
+        }
+        emit_op(code, OP_CONST, constant(code, done));
+        end = emit_jump(code, OP_JUMP);
+        for(jumps[0] = i; jumps[0]; jumps[0] = jumps[1]) {
+            jumps[1] = code->ops[jumps[0]];
+            patch(code, jumps[0]);
+        }
+        emit_op(code, OP_CONST, constant(code, short_circuit));
+        patch(code, end);
+    } break;
+    case SF_BEGIN:
+        compile_sequence(code, e->cdr, tail);
+        break;
+    default:
+        /* Function call */
+        for(a = e, n = -1; a; a = a->cdr, n++)
+            compile(code, a->car, 0);
+        emit_op(code, tail ? OP_TAILCALL : OP_CALL, n);
+        break;
+    }
+}
+
+static void compile(Code *code, SkObj *e, int tail) {
+    if(!e || IS_IMMEDIATE(e)) {
+        emit_op(code, OP_CONST, constant(code, e));
+        return;
+    }
+    switch(e->type) {
+        case SYMBOL: emit_op(code, OP_SYMBOL, constant(code, e)); break;
+        case LOCAL: emit_op(code, OP_LOCAL, constant(code, e)); break;
+        case GLOBAL: emit_op(code, OP_GLOBAL, constant(code, e)); break;
+        case CAPTURED: emit_op(code, OP_CAPTURED, constant(code, e)); break;
+        case ERROR: emit_op(code, OP_FAIL, constant(code, e)); break;
+        case CONS: compile_form(code, e, tail); break;
+        default: emit_op(code, OP_CONST, constant(code, e)); break;
+    }
+}
+
+static Code *code_create(SkObj *e, int tail) {
+    Code *code = calloc(1, sizeof *code);
+    MEMCHECK(code);
+    compile(code, e, tail);
+    emit(code, OP_RETURN);
+    return code;
+}
+
+static Code *lambda_code(SkObj *f) {
+    Scope *scope = f->args->scope;
+    if(!scope->code)
+        scope->code = code_create(scope->body, 1);
+    return scope->code;
+}
+
+/* The VM's record of a lambda call that hasn't returned yet */
+typedef struct Activation {
+    Code *code;
+    int pc;
+    SkEnv *env;
+    SkObj *fn;
+} Activation;
+
+static SkObj *run_vm(SkEnv *env, Code *code) {
+    SkObj **stack = NULL, *fn = NULL, *result = NULL, *a, *last, **v;
+    unsigned int sp = 0, ssize = 0, ncalls = 0, acalls = 0, i, n;
+    Activation *calls = NULL;
+    FramePool frames = {{NULL}};
+    SkObj *cells = NULL; /* the cells of argument lists that can be reused, linked through `cdr` */
+    int pc = 0, op;
+
+#define PUSH(x) do { \
+        if(sp == ssize) { \
+            ssize = ssize ? ssize << 1 : 64; \
+            stack = realloc(stack, ssize * sizeof *stack); \
+            MEMCHECK(stack); \
+        } \
+        stack[sp++] = (x); \
+    } while(0)
+#define FAIL(x) do { result = (x); goto error; } while(0)
+
+    rc_retain(env);
+    for(;;) {
+        op = code->ops[pc++];
+        switch(op) {
+        case OP_CONST:
+            PUSH(rc_retain(code->consts[code->ops[pc++]]));
+            break;
+        case OP_LOCAL: {
+            SkObj *ref = code->consts[code->ops[pc++]];
+            SkEnv *frame = env;
+            for(n = ref->depth; n; n--)
+                frame = frame->parent;
+            v = unbox(&frame->slots[ref->slot]);
+            if(*v == UNBOUND) {
+                v = env_find_outer(frame, ref->name);
+                if(!v)
+                    FAIL(sk_errorf("no such variable '%s'", ref->name->value));
+            } else if((ref->flags & FLAG_LAST) && can_move(frame, ref)) {
+                PUSH(*v);
+                *v = UNBOUND;
+                break;
+            }
+            PUSH(rc_retain(*v));
+        } break;
+        case OP_GLOBAL:
+            a = code->consts[code->ops[pc++]];
+            v = env_find_global(env, a);
+            if(!v)
+                FAIL(sk_errorf("no such variable '%s'", a->name->value));
+            PUSH(rc_retain(*v));
+            break;
+        case OP_CAPTURED:
+            a = code->consts[code->ops[pc++]];
+            v = env_find_captured(env, a);
+            if(!v)
+                FAIL(sk_errorf("no such variable '%s'", a->name->value));
+            PUSH(rc_retain(*v));
+            break;
+        case OP_SYMBOL:
+            a = code->consts[code->ops[pc++]];
+            v = env_findg_r(env, a);
+            if(!v)
+                FAIL(sk_errorf("no such variable '%s'", a->value));
+            PUSH(rc_retain(*v));
+            break;
+        case OP_SETLOCAL: {
+            SkObj *ref = code->consts[code->ops[pc++]];
+            SkEnv *frame = env;
+            for(n = ref->depth; n; n--)
+                frame = frame->parent;
+            v = unbox(&frame->slots[ref->slot]);
+            rc_release(*v);
+            *v = rc_retain(stack[sp - 1]);
+        } break;
+        case OP_DEFINE:
+            env_put(env->global, code->consts[code->ops[pc++]], rc_retain(stack[sp - 1]));
+            break;
+        case OP_PUT:
+            env_put(env, code->consts[code->ops[pc++]], rc_retain(stack[sp - 1]));
+            break;
+        case OP_LAMBDA:
+            i = code->ops[pc++];
+            PUSH(lambda_create(rc_retain(code->consts[i]), rc_retain(code->consts[i + 1]), env));
+            break;
+        case OP_ENTER: {
+            SkEnv *frame = frame_get(&frames, code->consts[code->ops[pc++]], env, env->fn);
+            rc_release(env);
+            env = frame;
+        } break;
+        case OP_STORE:
+            i = code->ops[pc++];
+            rc_release(env->slots[i]);
+            env->slots[i] = stack[--sp];
+            break;
+        case OP_LEAVE: {
+            SkEnv *parent = rc_retain(env->parent);
+            frame_put(&frames, env);
+            env = parent;
+        } break;
+        case OP_POP:
+            rc_release(stack[--sp]);
+            break;
+        case OP_JUMP:
+            pc = code->ops[pc];
+            break;
+        case OP_JUMPF:
+        case OP_JUMPT:
+            a = stack[--sp];
+            if(sk_is_true(a) == (op == OP_JUMPT))
+                pc = code->ops[pc];
+            else
+                pc++;
+            rc_release(a);
+            break;
+        case OP_CALL:
+        case OP_TAILCALL: {
+            SkObj *f;
+            n = code->ops[pc++];
+            if(rc_over_limit())
+                FAIL(memory_error());
+            f = stack[sp - n - 1];
+            if(f && type_of(f) == CFUN) {
+                /* The arguments move from the stack into the list, which
+                is built from the cells of earlier argument lists */
+                for(a = last = NULL, i = sp - n; i < sp; i++) {
+                    if(!cells) {
+                        list_append1(&a, stack[i], &last);
+                        continue;
+                    }
+                    if(last)
+                        last->cdr = cells;
+                    else
+                        a = cells;
+                    last = cells;
+                    cells = cells->cdr;
+                    last->car = stack[i];
+                    last->cdr = NULL;
+                    last->flags = 0;
+                }
+                sp -= n + 1;
+                result = f->func(env, a);
+                /* The cells that the function didn't keep can be used again */
+                while(a && rc_unique(a)) {
+                    last = a->cdr;
+                    rc_release(a->car);
+                    a->car = NULL;
+                    a->cdr = cells;
+                    cells = a;
+                    a = last;
+                }
+                rc_release(a);
+                rc_release(f);
+                if(sk_is_error(result))
+                    goto error;
+                PUSH(result);
+                result = NULL;
+            } else if(f && type_of(f) == LAMBDA) {
+                Scope *scope = f->args->scope;
+                SkEnv *frame;
+                if(n < scope->nparams)
+                    FAIL(sk_error("too few arguments passed to lambda"));
+                if(n > scope->nparams && !scope->rest)
+                    FAIL(sk_error("too many arguments passed to lambda"));
+
+                frame = frame_get(&frames, f->args, env, f);
+                for(i = 0; i < scope->nparams; i++)
+                    frame->slots[i] = stack[sp - n + i];
+                if(scope->rest) {
+                    for(a = last = NULL, i = sp - n + scope->nparams; i < sp; i++)
+                        list_append1(&a, stack[i], &last);
+                    frame->slots[scope->nparams] = a;
+                }
+                sp -= n + 1;
+
+                if(op == OP_CALL) {
+                    if(ncalls == acalls) {
+                        acalls = acalls ? acalls << 1 : 16;
+                        calls = realloc(calls, acalls * sizeof *calls);
+                        MEMCHECK(calls);
+                    }
+                    calls[ncalls].code = code;
+                    calls[ncalls].pc = pc;
+                    calls[ncalls].env = env;
+                    calls[ncalls].fn = fn;
+                    ncalls++;
+                } else {
+                    rc_release(env);
+                    rc_release(fn);
+                }
+                env = frame;
+                fn = f;
+                code = lambda_code(f);
+                pc = 0;
+            } else
+                FAIL(sk_errorf("attempt to call something that is not a function"));
+        } break;
+        case OP_RETURN:
+            if(!ncalls) {
+                result = stack[--sp];
+                goto done;
+            }
+            frame_put(&frames, env);
+            rc_release(fn);
+            ncalls--;
+            code = calls[ncalls].code;
+            pc = calls[ncalls].pc;
+            env = calls[ncalls].env;
+            fn = calls[ncalls].fn;
+            break;
+        case OP_FAIL:
+            FAIL(rc_retain(code->consts[code->ops[pc++]]));
+        default:
+            assert(0);
+        }
+    }
+#undef PUSH
+#undef FAIL
+
+error:
+    while(sp)
+        rc_release(stack[--sp]);
+    while(ncalls--) {
+        rc_release(calls[ncalls].env);
+        rc_release(calls[ncalls].fn);
+    }
+done:
+    assert(!sp);
+    rc_release(env);
+    rc_release(fn);
+    rc_release(cells);
+    frame_pool_free(&frames);
+    free(stack);
+    free(calls);
+    return result;
+}
+
+static SkObj *eval_vm(SkEnv *env, SkObj *e) {
+    Code *code = code_create(e, 1);
+    SkObj *result = run_vm(env, code);
+    code_free(code);
+    return result;
+}
+
+/* =============================================================
+  Closure compiler
+============================================================= */
+
+/* The engine selected through `SK_ENGINE_CLOSURE` and used by `sk_compile()`.
+An expression is analysed once into a tree of nodes, each of which has a
+pointer to the function that executes it, so there is no dispatch on the
+type of the expression or on the special form at runtime. As with the VM,
+the body of each lambda is compiled the first time it is called. */
+typedef struct Node {
+    SkObj *(*run)(struct Node *n, SkEnv *env);
+    SkObj *value; /* constants, references, scopes, variable names, errors */
+    SkObj *body;  /* lambdas: the `(begin . body)` of the lambda */
+    unsigned int count; /* the number of kids */
+    unsigned int inits; /* lets: the kids that initialise the bindings */
+    struct Node *kids[];
+} Node;
+
+/* Returned by a call in tail position to ask `exec_node()` to call the
+lambda in `tail_call` in the place of the current one */
+#define TAIL_CALL           ((SkObj *)14)
+
+static THREAD_LOCAL struct {
+    SkObj *fn;
+    SkEnv *env;
+} tail_call;
+
+static void node_free(Node *n) {
+    unsigned int i;
+    if(!n)
+        return;
+    for(i = 0; i < n->count; i++)
+        node_free(n->kids[i]);
+    rc_release(n->value);
+    rc_release(n->body);
+    free(n);
+}
+
+static Node *node_create(SkObj *(*run)(Node *, SkEnv *), SkObj *value, unsigned int count) {
+    Node *n = calloc(1, sizeof *n + count * sizeof *n->kids);
+    MEMCHECK(n);
+    n->run = run;
+    n->value = rc_retain(value);
+    n->count = count;
+    return n;
+}
+
+static Node *compile_node(SkObj *e, int tail);
+
+static Node *lambda_node(SkObj *f) {
+    Scope *scope = f->args->scope;
+    if(!scope->node)
+        scope->node = compile_node(scope->body, 1);
+    return scope->node;
+}
+
+/* Runs `n` and any tail calls it makes */
+static SkObj *exec_node(Node *n, SkEnv *env) {
+    SkObj *result = n->run(n, env), *fn = NULL;
+    SkEnv *frame = NULL;
+    while(result == TAIL_CALL) {
+        rc_release(frame);
+        rc_release(fn);
+        frame = tail_call.env;
+        fn = tail_call.fn;
+        n = lambda_node(fn);
+        result = n->run(n, frame);
+    }
+    rc_release(frame);
+    rc_release(fn);
+    return result;
+}
+
+static SkObj *run_const(Node *n, SkEnv *env) {
+    return rc_retain(n->value);
+}
+
+static SkObj *run_fail(Node *n, SkEnv *env) {
+    return rc_retain(n->value);
+}
+
+static SkObj *lookup_unbound(SkEnv *frame, SkObj *ref) {
+    /* A variable that `set!` hasn't assigned in this frame (yet) */
+    SkObj **v = env_find_outer(frame, ref->name);
+    return v ? rc_retain(*v) : sk_errorf("no such variable '%s'", ref->name->value);
+}
+
+static SkObj *run_local0(Node *n, SkEnv *env) {
+    SkObj *v = *unbox(&env->slots[n->value->slot]);
+    return v == UNBOUND ? lookup_unbound(env, n->value) : rc_retain(v);
+}
+
+/* A last use of a variable of the frame; see FLAG_LAST */
+static SkObj *run_move0(Node *n, SkEnv *env) {
+    SkObj **v = &env->slots[n->value->slot], *e = *v;
+    if(e == UNBOUND)
+        return lookup_unbound(env, n->value);
+    if(!can_move(env, n->value))
+        return rc_retain(e);
+    *v = UNBOUND;
+    return e;
+}
+
+static SkObj *run_local(Node *n, SkEnv *env) {
+    unsigned int d;
+    for(d = n->value->depth; d; d--)
+        env = env->parent;
+    return run_local0(n, env);
+}
+
+static SkObj *run_global(Node *n, SkEnv *env) {
+    SkObj **v = env_find_global(env, n->value);
+    return v ? rc_retain(*v) : sk_errorf("no such variable '%s'", n->value->name->value);
+}
+
+static SkObj *run_captured(Node *n, SkEnv *env) {
+    SkObj **v = env_find_captured(env, n->value);
+    return v ? rc_retain(*v) : sk_errorf("no such variable '%s'", n->value->name->value);
+}
+
+static SkObj *run_symbol(Node *n, SkEnv *env) {
+    SkObj **v = env_findg_r(env, n->value);
+    return v ? rc_retain(*v) : sk_errorf("no such variable '%s'", n->value->value);
+}
+
+static SkObj *run_setlocal(Node *n, SkEnv *env) {
+    SkObj *v = n->kids[0]->run(n->kids[0], env), **slot;
+    unsigned int d;
+    if(!sk_is_error(v)) {
+        for(d = n->value->depth; d; d--)
+            env = env->parent;
+        slot = unbox(&env->slots[n->value->slot]);
+        rc_release(*slot);
+        *slot = rc_retain(v);
+    }
+    return v;
+}
+
+static SkObj *run_define(Node *n, SkEnv *env) {
+    SkObj *v = n->kids[0]->run(n->kids[0], env);
+    if(!sk_is_error(v))
+        env_put(get_global(env), n->value, rc_retain(v));
+    return v;
+}
+
+static SkObj *run_put(Node *n, SkEnv *env) {
+    SkObj *v = n->kids[0]->run(n->kids[0], env);
+    if(!sk_is_error(v))
+        env_put(env, n->value, rc_retain(v));
+    return v;
+}
+
+static SkObj *run_lambda(Node *n, SkEnv *env) {
+    return lambda_create(rc_retain(n->value), rc_retain(n->body), env);
+}
+
+static SkObj *run_let(Node *n, SkEnv *env) {
+    SkEnv *frame = frame_create(n->value, env, env->fn);
+    SkObj *result = NULL;
+    unsigned int i;
+    for(i = 0; i < n->count; i++) {
+        /* The values of a `let` are evaluated in the outer environment */
+        result = n->kids[i]->run(n->kids[i], i < n->inits ? env : frame);
+        if(sk_is_error(result) || i == n->count - 1)
+            break;
+        if(i < n->inits)
+            frame->slots[i] = result;
+        else
+            rc_release(result);
+    }
+    rc_release(frame);
+    return result;
+}
+
+static SkObj *run_letstar(Node *n, SkEnv *env) {
+    SkEnv *frame = frame_create(n->value, env, env->fn);
+    SkObj *result = NULL;
+    unsigned int i;
+    for(i = 0; i < n->count; i++) {
+        result = n->kids[i]->run(n->kids[i], frame);
+        if(sk_is_error(result) || i == n->count - 1)
+            break;
+        if(i < n->inits)
+            frame->slots[i] = result;
+        else
+            rc_release(result);
+    }
+    rc_release(frame);
+    return result;
+}
+
+static SkObj *run_if(Node *n, SkEnv *env) {
+    SkObj *cond = n->kids[0]->run(n->kids[0], env);
+    Node *branch;
+    if(sk_is_error(cond))
+        return cond;
+    branch = sk_is_true(cond) ? n->kids[1] : n->kids[2];
+    rc_release(cond);
+    return branch->run(branch, env);
+}
+
+static SkObj *run_and(Node *n, SkEnv *env) {
+    unsigned int i;
+    for(i = 0; i < n->count; i++) {
+        SkObj *a = n->kids[i]->run(n->kids[i], env);
+        if(sk_is_error(a))
+            return a;
+        if(!sk_is_true(a)) {
+            rc_release(a);
+            return SK_FALSE;
+        }
+        rc_release(a);
+    }
+    return SK_TRUE;
+}
+
+static SkObj *run_or(Node *n, SkEnv *env) {
+    unsigned int i;
+    for(i = 0; i < n->count; i++) {
+        SkObj *a = n->kids[i]->run(n->kids[i], env);
+        if(sk_is_error(a))
+            return a;
+        if(sk_is_true(a)) {
+            rc_release(a);
+            return SK_TRUE;
+        }
+        rc_release(a);
+    }
+    return SK_FALSE;
+}
 
-    p.text = text;
-    p.next_tok[0] = '\0';
-    nextsym(&p);
+static SkObj *run_begin(Node *n, SkEnv *env) {
+    unsigned int i;
+    for(i = 0; i < n->count - 1; i++) {
+        SkObj *a = n->kids[i]->run(n->kids[i], env);
+        if(sk_is_error(a))
+            return a;
+        rc_release(a);
+    }
+    return n->kids[i]->run(n->kids[i], env);
+}
 
-    for(;;) {
-        if(accept(&p, SCAN_END)) break;
-        SkObj * e = parse0(&p);
-        if(sk_is_error(e)) {
-            rc_release(root);
-            return e;
+/* Evaluates the arguments of the call `n` to the lambda `f` into a new frame */
+static SkObj *bind_frame(Node *n, SkEnv *env, SkObj *f, SkEnv **frame) {
+    Scope *scope = f->args->scope;
+    SkObj *rest = NULL, *last = NULL;
+    unsigned int i, nargs = n->count - 1;
+
+    if(nargs > scope->nparams && !scope->rest)
+        return sk_error("too many arguments passed to lambda");
+    if(nargs < scope->nparams)
+        return sk_error("too few arguments passed to lambda");
+    if(rc_over_limit())
+        return memory_error();
+
+    *frame = frame_create(f->args, env, f);
+    for(i = 0; i < nargs; i++) {
+        SkObj *v = n->kids[i + 1]->run(n->kids[i + 1], env);
+        if(sk_is_error(v)) {
+            rc_release(rest);
+            rc_release(*frame);
+            return v;
         }
-        list_append1(&root, e, &last);
+        if(i < scope->nparams)
+            (*frame)->slots[i] = v;
+        else
+            list_append1(&rest, v, &last);
     }
-    return root;
+    if(scope->rest)
+        (*frame)->slots[scope->nparams] = rest;
+    return NULL;
 }
 
-static SkEnv *get_global(SkEnv *env) {
-    while(env->parent)
-        env = env->parent;
-    return env;
+static SkObj *call_cfun(Node *n, SkEnv *env, SkObj *f) {
+    SkObj *args = NULL, *last = NULL, *result;
+    unsigned int i;
+    if(rc_over_limit())
+        return memory_error();
+    for(i = 1; i < n->count; i++) {
+        SkObj *v = n->kids[i]->run(n->kids[i], env);
+        if(sk_is_error(v)) {
+            rc_release(args);
+            return v;
+        }
+        list_append1(&args, v, &last);
+    }
+    result = f->func(env, args);
+    rc_release(args);
+    return result;
+}
+
+static SkObj *run_call(Node *n, SkEnv *env) {
+    SkObj *f = n->kids[0]->run(n->kids[0], env), *result;
+    SkEnv *frame;
+    if(sk_is_error(f))
+        return f;
+    if(f && type_of(f) == CFUN)
+        result = call_cfun(n, env, f);
+    else if(f && type_of(f) == LAMBDA) {
+        if(!(result = bind_frame(n, env, f, &frame))) {
+            result = exec_node(lambda_node(f), frame);
+            rc_release(frame);
+        }
+    } else
+        result = sk_errorf("attempt to call something that is not a function");
+    rc_release(f);
+    return result;
+}
+
+static SkObj *run_tailcall(Node *n, SkEnv *env) {
+    SkObj *f = n->kids[0]->run(n->kids[0], env), *result;
+    SkEnv *frame;
+    if(sk_is_error(f))
+        return f;
+    if(f && type_of(f) == CFUN)
+        result = call_cfun(n, env, f);
+    else if(f && type_of(f) == LAMBDA) {
+        if(!(result = bind_frame(n, env, f, &frame))) {
+            /* `exec_node()` takes over the references */
+            tail_call.fn = f;
+            tail_call.env = frame;
+            return TAIL_CALL;
+        }
+    } else
+        result = sk_errorf("attempt to call something that is not a function");
+    rc_release(f);
+    return result;
+}
+
+static Node *compile_list(SkObj *(*run)(Node *, SkEnv *), SkObj *e, int tail) {
+    Node *n = node_create(run, NULL, sk_length(e));
+    unsigned int i;
+    for(i = 0; e; e = e->cdr, i++)
+        n->kids[i] = compile_node(e->car, tail && !e->cdr);
+    return n;
+}
+
+static Node *compile_lambda_node(SkObj *scope, SkObj *body) {
+    Node *n = node_create(run_lambda, scope, 0);
+    n->body = sk_cons(sk_symbol("begin"), rc_retain(body));
+    n->body->flags |= FLAG_CHECKED;
+    return n;
+}
+
+static Node *compile_form_node(SkObj *e, int tail) {
+    int form = form_of(e);
+    Node *n;
+    SkObj *a;
+    unsigned int i;
+
+    if(!(e->flags & FLAG_CHECKED)) {
+        /* Errors are only reported if the form is reached, like in `eval_tree()` */
+        SkObj *err = check_form(e, form);
+        if(err) {
+            n = node_create(run_fail, err, 0);
+            rc_release(err);
+            return n;
+        }
+        if(form != SF_NONE)
+            resolve_form(NULL, e, form);
+    }
+
+    switch(form) {
+    case SF_QUOTE:
+        return node_create(run_const, e->cdr->car, 0);
+    case SF_DEFINE:
+    case SF_SET: {
+        SkObj *target = e->cdr->car, *varname = target;
+        Node *value;
+        if(sk_is_cons(target)) {
+            value = compile_lambda_node(target->cdr, e->cdr->cdr);
+            varname = target->car;
+        } else
+            value = compile_node(e->cdr->cdr->car, 0);
+        if(type_of(varname) == LOCAL)
+            n = node_create(run_setlocal, varname, 1);
+        else
+            n = node_create(form == SF_DEFINE ? run_define : run_put, varname, 1);
+        n->kids[0] = value;
+        return n;
+    }
+    case SF_LAMBDA:
+        return compile_lambda_node(e->cdr->car, e->cdr->cdr);
+    case SF_LET:
+    case SF_LETSTAR: {
+        SkObj *scope = e->cdr->car, *body = e->cdr->cdr;
+        unsigned int inits = sk_length(scope->scope->source);
+        n = node_create(form == SF_LET ? run_let : run_letstar, scope, inits + sk_length(body));
+        n->inits = inits;
+        for(a = scope->scope->source, i = 0; a; a = a->cdr, i++)
+            n->kids[i] = compile_node(a->car->cdr->car, 0);
+        for(; body; body = body->cdr, i++)
+            n->kids[i] = compile_node(body->car, tail && !body->cdr);
+        return n;
+    }
+    case SF_IF:
+        n = node_create(run_if, NULL, 3);
+        e = e->cdr;
+        n->kids[0] = compile_node(e->car, 0);
+        n->kids[1] = compile_node(e->cdr->car, tail);
+        n->kids[2] = compile_node(e->cdr->cdr->car, tail);
+        return n;
+    case SF_AND:
+        return compile_list(run_and, e->cdr, 0);
+    case SF_OR:
+        return compile_list(run_or, e->cdr, 0);
+    case SF_BEGIN:
+        if(!e->cdr)
+            return node_create(run_const, NULL, 0);
+        return compile_list(run_begin, e->cdr, tail);
+    default:
+        /* Function call: the function is kids[0], followed by the arguments */
+        n = compile_list(tail ? run_tailcall : run_call, e, 0);
+        return n;
+    }
+}
+
+static Node *compile_node(SkObj *e, int tail) {
+    if(!e || IS_IMMEDIATE(e))
+        return node_create(run_const, e, 0);
+    switch(e->type) {
+        case SYMBOL: return node_create(run_symbol, e, 0);
+        case LOCAL: return node_create(e->depth ? run_local :
+                        (e->flags & FLAG_LAST) ? run_move0 : run_local0, e, 0);
+        case GLOBAL: return node_create(run_global, e, 0);
+        case CAPTURED: return node_create(run_captured, e, 0);
+        case ERROR: return node_create(run_fail, e, 0);
+        case CONS: return compile_form_node(e, tail);
+        default: return node_create(run_const, e, 0);
+    }
+}
+
+SkObj *sk_compile(SkObj *e) {
+    SkObj *c = rc_alloc(sizeof *c);
+    MEMCHECK(c);
+    c->type = COMPILED;
+    c->flags = 0;
+    c->program = rc_retain(e);
+    c->node = compile_node(e, 1);
+    rc_set_dtor(c, (ref_dtor_t)SkExpr_dtor);
+    return c;
+}
+
+static SkObj *eval_closure(SkEnv *env, SkObj *e) {
+    Node *n = compile_node(e, 1);
+    SkObj *result = exec_node(n, env);
+    node_free(n);
+    return result;
 }
 
 /* =============================================================
-  Serialization
+  Immutable hash tables
 ============================================================= */
 
-static char *buffer_appendn(char **buf, int *n, int *a, const char *s, int len) {
-    assert(buf && n && a && s);
-    int nlen;
-    if(!*buf) {
-        *a = 32;
-        while(*a < len + 1) *a <<= 1;
-        *buf = malloc(*a);
-        MEMCHECK(*buf);
-        strncpy(*buf, s, len);
-        (*buf)[len] = '\0';
-        *n = len;
-        return *buf;
-    }
-    nlen = *n + len;
-    if(*a < nlen + 1) {
-        while(*a < nlen + 1) *a <<= 1;
-        *buf = realloc(*buf, *a);
-        MEMCHECK(*buf);
+/* Immutable hash tables are hash array mapped tries (HAMTs): Each level of
+the trie uses the next 5 bits of the hash of a key to choose one of 32
+entries, and a bitmap records which of them a node has, so that the node only
+has room for the entries that it uses.
+
+Nodes are never changed once they've been created. Setting or removing a key
+copies the nodes on the path from the root to the key and shares all the
+others with the old table, so an update takes O(log32 n) time and space.
+
+The nodes are reference counted like everything else, and their keys are
+interned symbols, like the keys of environments */
+
+#define MAP_BITS    5
+#define MAP_MASK    ((1u << MAP_BITS) - 1)
+
+typedef struct MapEntry {
+    SkObj *key; /* NULL if `value` is a subnode */
+    void *value;
+} MapEntry;
+
+typedef struct MapNode {
+    unsigned int bitmap; /* Which of the 32 entries of its level the node has */
+    unsigned int n; /* Number of entries */
+    unsigned int size; /* Number of keys in the node and its subnodes */
+    /* All the bits of the hashes have been used: The keys in a collision
+    node have the same hash, and they are searched one by one */
+    int collision;
+    MapEntry entries[];
+} MapNode;
+
+static unsigned int popcount(unsigned int x) {
+#if defined(__GNUC__)
+    return __builtin_popcount(x);
+#else
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    return (((x + (x >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+#endif
+}
+
+static void map_node_dtor(MapNode *m) {
+    unsigned int i;
+    for(i = 0; i < m->n; i++) {
+        rc_release(m->entries[i].key);
+        rc_release(m->entries[i].value);
     }
-    strncpy(*buf + *n, s, len);
-    *n = nlen;
-    (*buf)[nlen] = '\0';
-    return *buf;
 }
 
-static char *buffer_append(char **buf, int *n, int *a, const char *s) {
-    return buffer_appendn(buf, n, a, s, strlen(s));
+static MapNode *map_node(unsigned int n) {
+    MapNode *m = rc_alloc_fixed(sizeof *m + n * sizeof *m->entries);
+    MEMCHECK(m);
+    m->bitmap = 0;
+    m->n = n;
+    m->size = 0;
+    m->collision = 0;
+    rc_set_dtor(m, (ref_dtor_t)map_node_dtor);
+    return m;
 }
 
-static char *buffer_appendf(char **buf, int *n, int *a, const char *fmt, ...) {
-    va_list arg;
-    char buffer[512];
-    va_start(arg, fmt);
-    vsnprintf (buffer, sizeof(buffer)-1, fmt, arg);
-    va_end(arg);
-    return buffer_append(buf, n, a, buffer);
+/* Copies `m`, leaving out the `del` entries from position `i`
+and leaving room for `ins` entries there that the caller fills in */
+static MapNode *map_splice(MapNode *m, unsigned int i, unsigned int del, unsigned int ins) {
+    MapNode *c = map_node(m->n - del + ins);
+    unsigned int j;
+    c->bitmap = m->bitmap;
+    c->size = m->size;
+    c->collision = m->collision;
+    for(j = 0; j < m->n; j++) {
+        MapEntry *e;
+        if(j < i)
+            e = &c->entries[j];
+        else if(j >= i + del)
+            e = &c->entries[j - del + ins];
+        else
+            continue;
+        e->key = rc_retain(m->entries[j].key);
+        e->value = rc_retain(m->entries[j].value);
+    }
+    return c;
 }
 
-static void serialize_r(char **buf, int *n, int *a, SkObj *e) {
-    if(!e)
-        buffer_append(buf, n, a, "'() ");
-    else switch(e->type) {
-        case CFUN: buffer_appendf(buf, n, a, "#<cfun:%p> ", e->func); break;
-        case CDATA: buffer_appendf(buf, n, a, "#<cdata:%p;%p>", e->cdtor, e->cdata); break;
-        case ERROR: buffer_appendf(buf, n, a, "#<error:%s> ", e->value); break;
-        case SYMBOL: buffer_appendf(buf, n, a, "%s ", e->value); break;
-        case TRUE: buffer_append(buf, n, a, "#t "); break;
-        case FALSE: buffer_append(buf, n, a, "#f "); break;
-        case VALUE: {
-            buffer_appendf(buf, n, a, "\"");
-            char *s = e->value;
-            int i = 0;
-            while(s[i]) {
-                if(s[i] < ' ') {
-                    buffer_appendn(buf, n, a, s, i);
-                    switch(s[i]) {
-                    case '\n': buffer_appendn(buf, n, a, "\\n", 2); break;
-                    case '\r': buffer_appendn(buf, n, a, "\\r", 2); break;
-                    case '\t': buffer_appendn(buf, n, a, "\\t", 2); break;
-                    case '\b': buffer_appendn(buf, n, a, "\\b", 2); break;
-                    case '\a': buffer_appendn(buf, n, a, "\\a", 2); break;
-                    default: buffer_appendf(buf, n, a, "\\%d", s[i]); break;
-                    }
-                    s += i + 1;
-                    i = 0;
-                } else if(strchr("\\\"", s[i])) {
-                    buffer_appendn(buf, n, a, s, i);
-                    buffer_appendf(buf, n, a, "\\%c", s[i]);
-                    s += i + 1;
-                    i = 0;
-                } else
-                    i++;
+/* Position of the entry of `hash` in `m`, if `m` has it */
+#define MAP_BIT(hash, shift)    (1u << (((hash) >> (shift)) & MAP_MASK))
+#define MAP_INDEX(m, bit)       popcount((m)->bitmap & ((bit) - 1))
+
+static MapEntry *map_find(MapNode *m, SkObj *key) {
+    unsigned int shift, i;
+    for(shift = 0;; shift += MAP_BITS) {
+        MapEntry *e;
+        if(m->collision) {
+            for(i = 0; i < m->n; i++) {
+                if(m->entries[i].key == key)
+                    return &m->entries[i];
             }
-            buffer_appendn(buf, n, a, s, i);
-            buffer_appendf(buf, n, a, "\" ");
-        } break;
-        case CONS:
-            buffer_append(buf, n, a, "( ");
-            for(;;) {
-                serialize_r(buf, n, a, e->car);
-                if(e->cdr) {
-                    if(e->cdr->type == CONS)
-                        e = e->cdr;
-                    else {
-                        buffer_append(buf, n, a, ". ");
-                        serialize_r(buf, n, a, e->cdr);
-                        break;
-                    }
-                } else
-                    break;
+            return NULL;
+        }
+        unsigned int bit = MAP_BIT(key->hash, shift);
+        if(!(m->bitmap & bit))
+            return NULL;
+        e = &m->entries[MAP_INDEX(m, bit)];
+        if(e->key)
+            return e->key == key ? e : NULL;
+        m = e->value;
+    }
+}
+
+/* Creates a node at level `shift` with two keys whose hashes are
+the same up to that level. It takes over the references */
+static MapNode *map_pair(SkObj *k1, void *v1, SkObj *k2, void *v2, unsigned int shift) {
+    MapNode *m;
+    unsigned int b1, b2;
+    if(shift >= 32) {
+        m = map_node(2);
+        m->collision = 1;
+        b1 = 0;
+        b2 = 1;
+    } else {
+        b1 = (k1->hash >> shift) & MAP_MASK;
+        b2 = (k2->hash >> shift) & MAP_MASK;
+        if(b1 == b2) {
+            m = map_node(1);
+            m->bitmap = 1u << b1;
+            m->size = 2;
+            m->entries[0].key = NULL;
+            m->entries[0].value = map_pair(k1, v1, k2, v2, shift + MAP_BITS);
+            return m;
+        }
+        m = map_node(2);
+        m->bitmap = (1u << b1) | (1u << b2);
+    }
+    m->size = 2;
+    m->entries[b1 > b2].key = k1;
+    m->entries[b1 > b2].value = v1;
+    m->entries[b1 < b2].key = k2;
+    m->entries[b1 < b2].value = v2;
+    return m;
+}
+
+/* Returns a copy of the node `m` at level `shift` in which `key` is set to
+`value`. It takes over the references to `key` and `value` */
+static MapNode *map_set(MapNode *m, SkObj *key, SkObj *value, unsigned int shift) {
+    MapNode *c;
+    MapEntry *e;
+    unsigned int i, bit;
+    if(m->collision) {
+        for(i = 0; i < m->n && m->entries[i].key != key; i++);
+        if(i < m->n)
+            c = map_splice(m, i, 1, 1);
+        else {
+            c = map_splice(m, i, 0, 1);
+            c->size++;
+        }
+        c->entries[i].key = key;
+        c->entries[i].value = value;
+        return c;
+    }
+    bit = MAP_BIT(key->hash, shift);
+    i = MAP_INDEX(m, bit);
+    if(!(m->bitmap & bit)) {
+        c = map_splice(m, i, 0, 1);
+        c->bitmap |= bit;
+        c->size++;
+        c->entries[i].key = key;
+        c->entries[i].value = value;
+        return c;
+    }
+    e = &m->entries[i];
+    c = map_splice(m, i, 1, 1);
+    if(!e->key) {
+        MapNode *sub = map_set(e->value, key, value, shift + MAP_BITS);
+        c->size += sub->size - ((MapNode *)e->value)->size;
+        c->entries[i].key = NULL;
+        c->entries[i].value = sub;
+    } else if(e->key == key) {
+        c->entries[i].key = key;
+        c->entries[i].value = value;
+    } else {
+        c->entries[i].key = NULL;
+        c->entries[i].value = map_pair(rc_retain(e->key), rc_retain(e->value), key, value, shift + MAP_BITS);
+        c->size++;
+    }
+    return c;
+}
+
+/* Returns a copy of the node `m` at level `shift` without `key`: `m` itself
+if it doesn't have `key`, or NULL if the copy would have no entries */
+static MapNode *map_remove(MapNode *m, SkObj *key, unsigned int shift) {
+    MapNode *c, *sub = NULL;
+    MapEntry *e;
+    unsigned int i, bit = 0;
+    if(m->collision) {
+        for(i = 0; i < m->n && m->entries[i].key != key; i++);
+        if(i == m->n)
+            return rc_retain(m);
+    } else {
+        bit = MAP_BIT(key->hash, shift);
+        if(!(m->bitmap & bit))
+            return rc_retain(m);
+        i = MAP_INDEX(m, bit);
+        e = &m->entries[i];
+        if(!e->key) {
+            sub = map_remove(e->value, key, shift + MAP_BITS);
+            if(sub == e->value) {
+                rc_release(sub);
+                return rc_retain(m);
             }
-            buffer_appendf(buf, n, a, ") ");
-            break;
-        case LAMBDA:
-            buffer_append(buf, n, a, "(lambda ");
-            serialize_r(buf, n, a, e->args);
-            buffer_append(buf, n, a, " ");
-            serialize_r(buf, n, a, e->body);
-            buffer_append(buf, n, a, ") ");
-            break;
+        } else if(e->key != key)
+            return rc_retain(m);
+    }
+    if(sub) {
+        c = map_splice(m, i, 1, 1);
+        if(sub->n == 1 && sub->entries[0].key) {
+            /* A subnode with a single key is replaced by the key */
+            c->entries[i].key = rc_retain(sub->entries[0].key);
+            c->entries[i].value = rc_retain(sub->entries[0].value);
+            rc_release(sub);
+        } else {
+            c->entries[i].key = NULL;
+            c->entries[i].value = sub;
+        }
+    } else {
+        if(m->n == 1)
+            return NULL;
+        c = map_splice(m, i, 1, 0);
+        c->bitmap &= ~bit;
+    }
+    c->size--;
+    return c;
+}
+
+/* The first key in the node `m` or its subnodes */
+static SkObj *map_first(MapNode *m) {
+    while(m->n) {
+        if(m->entries[0].key)
+            return m->entries[0].key;
+        m = m->entries[0].value;
+    }
+    return NULL;
+}
+
+/* The key after `key`, which must be in the node `m` at level `shift`,
+in the order of the trie */
+static SkObj *map_next(MapNode *m, SkObj *key, unsigned int shift) {
+    unsigned int i;
+    SkObj *next;
+    if(m->collision) {
+        for(i = 0; m->entries[i].key != key; i++);
+    } else {
+        i = MAP_INDEX(m, MAP_BIT(key->hash, shift));
+        if(!m->entries[i].key && (next = map_next(m->entries[i].value, key, shift + MAP_BITS)))
+            return next;
     }
+    if(++i == m->n)
+        return NULL;
+    return m->entries[i].key ? m->entries[i].key : map_first(m->entries[i].value);
+}
+
+/* =============================================================
+  Sorted maps
+============================================================= */
+
+/* Sorted maps are B+ trees: The keys and values are kept in order in the
+leaves, which are linked so that ranges of keys can be visited without
+going back up the tree, and the internal nodes hold the keys that separate
+their children. A node has room for a few dozen keys, which are compared in
+contiguous arrays rather than by chasing a pointer for every comparison.
+
+Numbers are ordered numerically before other keys, which are ordered by
+their text. The value of a number is kept next to its key, so that the
+comparisons don't need to parse it. Integers are kept and compared as
+integers, because doubles can't tell large ones apart */
+
+#define SMAP_MAX    32  /* Most keys in a node */
+#define SMAP_MIN    (SMAP_MAX / 2) /* Fewest keys in a node other than the root */
+
+typedef struct SMapKey {
+    SkObj *obj;
+    union {
+        double num;
+        long long integer; /* if `exact` */
+    };
+    unsigned char numeric, exact;
+} SMapKey;
+
+/* Nodes have room for one key (and child) more than they may keep, so
+that a key can be inserted before a node that is full is split */
+typedef struct SMapNode {
+    unsigned int n; /* Number of keys */
+    int leaf;
+    SMapKey keys[SMAP_MAX + 1];
+    union {
+        SkObj *values[SMAP_MAX + 1]; /* Leaves */
+        struct SMapNode *children[SMAP_MAX + 2]; /* Internal nodes */
+    };
+    struct SMapNode *next; /* Leaves: the leaf with the keys that follow */
+} SMapNode;
+
+typedef struct SortedMap {
+    SMapNode *root;
+    unsigned int count;
+    /* Changes whenever a key is added or removed, so that
+    iterations that call back into Skeem can tell */
+    unsigned int version;
+} SortedMap;
+
+static SMapKey smap_key(SkObj *obj) {
+    SMapKey k;
+    k.obj = obj;
+    k.numeric = sk_is_number(obj);
+    k.exact = k.numeric && exact_integer(obj, &k.integer);
+    if(!k.exact)
+        k.num = k.numeric ? sk_get_number(obj) : 0;
+    return k;
+}
+
+/* Compares the integer `i` with the double `d` without rounding `i`,
+so that the order stays consistent with that of the integers */
+static int smap_compare_mixed(long long i, double d) {
+    long long t;
+    double frac;
+    if(d != d)
+        return -1; /* NaN goes after the other numbers */
+    if(d >= 9223372036854775808.0)
+        return -1;
+    if(d < -9223372036854775808.0)
+        return 1;
+    t = (long long)d;
+    if(i != t)
+        return (i > t) - (i < t);
+    frac = d - (double)t;
+    return (frac < 0) - (frac > 0);
+}
+
+static int smap_compare(const SMapKey *a, const SMapKey *b) {
+    if(a->numeric && b->numeric) {
+        if(a->exact && b->exact)
+            return (a->integer > b->integer) - (a->integer < b->integer);
+        if(a->exact)
+            return smap_compare_mixed(a->integer, b->num);
+        if(b->exact)
+            return -smap_compare_mixed(b->integer, a->num);
+        return (a->num > b->num) - (a->num < b->num);
+    }
+    if(a->numeric != b->numeric)
+        return a->numeric ? -1 : 1;
+    char ba[SK_TEXT_SIZE], bb[SK_TEXT_SIZE];
+    return strcmp(sk_get_text_buf(a->obj, ba), sk_get_text_buf(b->obj, bb));
+}
+
+/* Position of the first key in `node` that is not less than `key`,
+or greater than `key` if `after` is set */
+static unsigned int smap_search(SMapNode *node, const SMapKey *key, int after) {
+    unsigned int lo = 0, hi = node->n;
+    while(lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        int c = smap_compare(&node->keys[mid], key);
+        if(c < 0 || (after && c == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static SMapNode *smap_node(SortedMap *m, int leaf) {
+    SMapNode *node = malloc(sizeof *node);
+    MEMCHECK(node);
+    node->n = 0;
+    node->leaf = leaf;
+    node->next = NULL;
+    rc_charge(m, sizeof *node);
+    return node;
+}
+
+static void smap_node_free(SortedMap *m, SMapNode *node) {
+    rc_charge(m, -(ptrdiff_t)sizeof *node);
+    free(node);
+}
+
+static void smap_free(SortedMap *m, SMapNode *node) {
+    unsigned int i;
+    for(i = 0; i < node->n; i++) {
+        rc_release(node->keys[i].obj);
+        if(node->leaf)
+            rc_release(node->values[i]);
+    }
+    if(!node->leaf) {
+        for(i = 0; i <= node->n; i++)
+            smap_free(m, node->children[i]);
+    }
+    smap_node_free(m, node);
+}
+
+static void sorted_map_dtor(SortedMap *m) {
+    smap_free(m, m->root);
+}
+
+static SortedMap *sorted_map_create(void) {
+    SortedMap *m = rc_alloc(sizeof *m);
+    MEMCHECK(m);
+    rc_set_dtor(m, (ref_dtor_t)sorted_map_dtor);
+    m->count = 0;
+    m->version = 0;
+    m->root = smap_node(m, 1);
+    return m;
+}
+
+/* Finds the leaf with the first key that is not less than `key` (or greater,
+if `after` is set) and its position in it. Returns NULL if there is none.
+If `key` is NULL, it finds the first key */
+static SMapNode *smap_seek(SortedMap *m, const SMapKey *key, int after, unsigned int *pos) {
+    SMapNode *node = m->root;
+    while(!node->leaf)
+        node = node->children[key ? smap_search(node, key, 1) : 0];
+    *pos = key ? smap_search(node, key, after) : 0;
+    while(node && *pos == node->n) {
+        node = node->next;
+        *pos = 0;
+    }
+    return node;
+}
+
+static SkObj **smap_find(SortedMap *m, SkObj *obj) {
+    SMapKey key = smap_key(obj);
+    unsigned int i;
+    SMapNode *leaf = smap_seek(m, &key, 0, &i);
+    if(leaf && !smap_compare(&leaf->keys[i], &key))
+        return &leaf->values[i];
+    return NULL;
+}
+
+/* Splits the node `node`, which has one key too many, and returns the new
+node with the upper half of the keys. `sep` gets the key that separates them */
+static SMapNode *smap_split(SortedMap *m, SMapNode *node, SMapKey *sep) {
+    SMapNode *right = smap_node(m, node->leaf);
+    unsigned int h = node->n / 2;
+    if(node->leaf) {
+        right->n = node->n - h;
+        memcpy(right->keys, node->keys + h, right->n * sizeof *node->keys);
+        memcpy(right->values, node->values + h, right->n * sizeof *node->values);
+        right->next = node->next;
+        node->next = right;
+        *sep = right->keys[0];
+        rc_retain(sep->obj);
+    } else {
+        /* The middle key moves up to the parent */
+        right->n = node->n - h - 1;
+        memcpy(right->keys, node->keys + h + 1, right->n * sizeof *node->keys);
+        memcpy(right->children, node->children + h + 1, (right->n + 1) * sizeof *node->children);
+        *sep = node->keys[h];
+    }
+    node->n = h;
+    return right;
+}
+
+/* Sets `key` to `value` in the subtree of `node`, taking over the references
+to them. Returns the new right sibling if `node` had to be split */
+static SMapNode *smap_insert(SortedMap *m, SMapNode *node, SMapKey *key, SkObj *value, SMapKey *sep) {
+    unsigned int i;
+    if(node->leaf) {
+        i = smap_search(node, key, 0);
+        if(i < node->n && !smap_compare(&node->keys[i], key)) {
+            rc_release(key->obj);
+            rc_release(node->values[i]);
+            node->values[i] = value;
+            return NULL;
+        }
+        memmove(node->keys + i + 1, node->keys + i, (node->n - i) * sizeof *node->keys);
+        memmove(node->values + i + 1, node->values + i, (node->n - i) * sizeof *node->values);
+        node->keys[i] = *key;
+        node->values[i] = value;
+        node->n++;
+        m->count++;
+        m->version++;
+    } else {
+        SMapKey s;
+        SMapNode *right;
+        i = smap_search(node, key, 1);
+        right = smap_insert(m, node->children[i], key, value, &s);
+        if(!right)
+            return NULL;
+        memmove(node->keys + i + 1, node->keys + i, (node->n - i) * sizeof *node->keys);
+        memmove(node->children + i + 2, node->children + i + 1, (node->n - i) * sizeof *node->children);
+        node->keys[i] = s;
+        node->children[i + 1] = right;
+        node->n++;
+    }
+    return node->n > SMAP_MAX ? smap_split(m, node, sep) : NULL;
+}
+
+static void smap_set(SortedMap *m, SkObj *key, SkObj *value) {
+    SMapKey k = smap_key(key), sep;
+    SMapNode *right = smap_insert(m, m->root, &k, value, &sep);
+    if(right) {
+        SMapNode *root = smap_node(m, 0);
+        root->n = 1;
+        root->keys[0] = sep;
+        root->children[0] = m->root;
+        root->children[1] = right;
+        m->root = root;
+    }
+}
+
+/* Merges the child `i + 1` of `parent` into the child `i` */
+static void smap_merge(SortedMap *m, SMapNode *parent, unsigned int i) {
+    SMapNode *left = parent->children[i], *right = parent->children[i + 1];
+    if(left->leaf) {
+        memcpy(left->values + left->n, right->values, right->n * sizeof *right->values);
+        left->next = right->next;
+        rc_release(parent->keys[i].obj);
+    } else {
+        left->keys[left->n++] = parent->keys[i];
+        memcpy(left->children + left->n, right->children, (right->n + 1) * sizeof *right->children);
+    }
+    memcpy(left->keys + left->n, right->keys, right->n * sizeof *right->keys);
+    left->n += right->n;
+    smap_node_free(m, right);
+    memmove(parent->keys + i, parent->keys + i + 1, (parent->n - i - 1) * sizeof *parent->keys);
+    memmove(parent->children + i + 1, parent->children + i + 2, (parent->n - i - 1) * sizeof *parent->children);
+    parent->n--;
+}
+
+/* Refills the child `i` of `parent`, which has too few keys, from one of
+its siblings, or merges it with a sibling if they have no keys to spare */
+static void smap_rebalance(SortedMap *m, SMapNode *parent, unsigned int i) {
+    SMapNode *child = parent->children[i], *sib;
+    if(i > 0 && (sib = parent->children[i - 1])->n > SMAP_MIN) {
+        /* Take the last key of the left sibling */
+        memmove(child->keys + 1, child->keys, child->n * sizeof *child->keys);
+        if(child->leaf) {
+            memmove(child->values + 1, child->values, child->n * sizeof *child->values);
+            child->keys[0] = sib->keys[sib->n - 1];
+            child->values[0] = sib->values[sib->n - 1];
+            rc_release(parent->keys[i - 1].obj);
+            parent->keys[i - 1] = child->keys[0];
+            rc_retain(child->keys[0].obj);
+        } else {
+            memmove(child->children + 1, child->children, (child->n + 1) * sizeof *child->children);
+            child->keys[0] = parent->keys[i - 1];
+            child->children[0] = sib->children[sib->n];
+            parent->keys[i - 1] = sib->keys[sib->n - 1];
+        }
+        child->n++;
+        sib->n--;
+    } else if(i < parent->n && (sib = parent->children[i + 1])->n > SMAP_MIN) {
+        /* Take the first key of the right sibling */
+        if(child->leaf) {
+            child->keys[child->n] = sib->keys[0];
+            child->values[child->n] = sib->values[0];
+            memmove(sib->values, sib->values + 1, (sib->n - 1) * sizeof *sib->values);
+        } else {
+            child->keys[child->n] = parent->keys[i];
+            child->children[child->n + 1] = sib->children[0];
+            parent->keys[i] = sib->keys[0];
+            memmove(sib->children, sib->children + 1, sib->n * sizeof *sib->children);
+        }
+        memmove(sib->keys, sib->keys + 1, (sib->n - 1) * sizeof *sib->keys);
+        child->n++;
+        sib->n--;
+        if(child->leaf) {
+            rc_release(parent->keys[i].obj);
+            parent->keys[i] = sib->keys[0];
+            rc_retain(sib->keys[0].obj);
+        }
+    } else if(i > 0)
+        smap_merge(m, parent, i - 1);
+    else
+        smap_merge(m, parent, i);
 }
 
-char *sk_serialize(SkObj *e) {
-    int n = 0, a = 256;
-    char *buf = malloc(a);
-    MEMCHECK(buf);
-    serialize_r(&buf, &n, &a, e);
-    return buf;
+/* Removes `key` from the subtree of `node`. Returns 0 if it isn't there */
+static int smap_delete(SortedMap *m, SMapNode *node, const SMapKey *key) {
+    unsigned int i;
+    if(node->leaf) {
+        i = smap_search(node, key, 0);
+        if(i == node->n || smap_compare(&node->keys[i], key))
+            return 0;
+        rc_release(node->keys[i].obj);
+        rc_release(node->values[i]);
+        memmove(node->keys + i, node->keys + i + 1, (node->n - i - 1) * sizeof *node->keys);
+        memmove(node->values + i, node->values + i + 1, (node->n - i - 1) * sizeof *node->values);
+        node->n--;
+        m->count--;
+        m->version++;
+        return 1;
+    }
+    i = smap_search(node, key, 1);
+    if(!smap_delete(m, node->children[i], key))
+        return 0;
+    if(node->children[i]->n < SMAP_MIN)
+        smap_rebalance(m, node, i);
+    return 1;
 }
 
-void sk_write(SkObj *e, FILE *f) {
-    char *buf = sk_serialize(e);
-    fputs(buf, f);
-    free(buf);
+static int smap_remove(SortedMap *m, SkObj *key) {
+    SMapKey k = smap_key(key);
+    if(!smap_delete(m, m->root, &k))
+        return 0;
+    if(!m->root->leaf && m->root->n == 0) {
+        SMapNode *root = m->root;
+        m->root = root->children[0];
+        smap_node_free(m, root);
+    }
+    return 1;
 }
 
 /* =============================================================
-  Interpreter
+  Cycle collector
 ============================================================= */
 
-static SkObj *bind_args(SkEnv *env, SkObj *e) {
-    assert(e->type == CONS);
-    SkObj *args = NULL, *last = NULL;
-    for(; e; e = e->cdr) {
-        SkObj *arg = sk_eval(env, e->car);
-        if(sk_is_error(arg)) {
-            rc_release(args);
-            return arg;
-        }
-        list_append1(&args, arg, &last);
-    }
-    return args;
+/* Lambdas copy the values of the variables they capture, so they never
+refer to an environment and can't form a cycle with the one they were
+created in. A lambda that captured a hash table can still end up in it
+through `hash-set` though, and that forms a cycle that reference counting
+alone never frees.
+
+Lists can only refer to objects that existed before them, so every such
+cycle goes through a hash table and a lambda that captured a list, a hash
+table or another such lambda. Those lambdas are kept in `closures`, and are
+the candidate roots of a synchronous trial deletion collector in the style
+of Bacon and Rajan:
+
+1. Everything that can be part of a cycle that can be reached from the
+   candidates (cons cells, closures and hash tables) gets a trial count,
+   which starts at its reference count and is decremented for every
+   reference from another object in the graph.
+2. Objects with trial counts above zero are referenced from outside the
+   graph (from the interpreter's stack, or variables in the global
+   environment) so they, and everything reachable from them, are live.
+3. The rest is garbage: Each object's references to the others are cleared,
+   and then they are released and freed normally.
+
+The reference counts themselves are not modified, so objects can't be freed
+while the graph is examined. */
+
+static void hash_table_dtor(void *p);
+static void map_dtor(void *p);
+static void sorted_map_cdtor(void *p);
+
+enum {GC_OBJ, GC_ENV, GC_MAP, GC_SORTED};
+
+typedef struct GcNode {
+    void *p;
+    unsigned char kind;
+    unsigned char live;
+    unsigned int count;
+} GcNode;
+
+/* The number of closures after which the collector runs automatically
+is doubled if it doesn't find enough garbage */
+#define GC_MIN_LIMIT    1024
+
+/* Each interpreter keeps its closures, so that they go with it when it is
+handed to another thread. A closure points to the list it is in after its
+captured variables (see `CLOSURES_OF()`). When an interpreter is released
+with closures still left, its list is kept with the thread that released it,
+for `sk_collect()`. The `closures` of the thread itself hold the closures
+made in environments that aren't part of an interpreter */
+typedef struct Closures {
+    SkObj **items;
+    unsigned int count, size;
+    unsigned int limit;
+    struct Closures *next; /* In `released` */
+} Closures;
+
+#define CLOSURES_OF(f)  (*(Closures **)&(f)->captured[(f)->args->scope->ncaptured])
+
+static THREAD_LOCAL Closures closures;
+static THREAD_LOCAL Closures *released;
+
+static THREAD_LOCAL struct {
+    GcNode *nodes;
+    unsigned int count, size;
+    unsigned int *table; /* Indexes + 1 of `nodes`, hashed on their pointers */
+    unsigned int mask;
+    unsigned int *stack;
+    unsigned int sp;
+} gc;
+
+typedef void (*gc_visit_t)(void **ref, int kind);
+
+static int gc_traced(SkObj *e) {
+    if(!e || IS_IMMEDIATE(e))
+        return 0;
+    return e->type == CONS || e->type == VECTOR || e->type == BOX || (e->type == LAMBDA && e->closure_index) ||
+        (e->type == CDATA && (e->cdtor == hash_table_dtor || e->cdtor == map_dtor ||
+            e->cdtor == sorted_map_cdtor));
 }
 
-static int valid_lambda(SkObj *l) {
-    if(l->type != LAMBDA) return 0;
-    if(!sk_is_null(l->args)) {
-        SkObj *e;
-        for(e = l->args; e; e = e->cdr) {
-            if(sk_is_symbol(e))
+/* Calls `visit` for each of the references that the object `p` holds
+to objects that can be part of a cycle */
+static void gc_edges(void *p, int kind, gc_visit_t visit) {
+    unsigned int i;
+    if(kind == GC_ENV) {
+        /* The environment of a hash table */
+        SkEnv *env = p;
+        hash_element *f;
+        for(f = next_element(env, NULL); f; f = next_element(env, f))
+            if(gc_traced(f->ex))
+                visit((void **)&f->ex, GC_OBJ);
+    } else if(kind == GC_SORTED) {
+        /* A sorted map: its values are all in its leaves */
+        SMapNode *leaf = ((SortedMap *)p)->root;
+        while(!leaf->leaf)
+            leaf = leaf->children[0];
+        for(; leaf; leaf = leaf->next) {
+            for(i = 0; i < leaf->n; i++)
+                if(gc_traced(leaf->values[i]))
+                    visit((void **)&leaf->values[i], GC_OBJ);
+        }
+    } else if(kind == GC_MAP) {
+        /* A node of an immutable hash table */
+        MapNode *m = p;
+        for(i = 0; i < m->n; i++) {
+            if(!m->entries[i].key)
+                visit(&m->entries[i].value, GC_MAP);
+            else if(gc_traced(m->entries[i].value))
+                visit(&m->entries[i].value, GC_OBJ);
+        }
+    } else {
+        SkObj *e = p;
+        switch(e->type) {
+            case CONS:
+                if(gc_traced(e->car))
+                    visit((void **)&e->car, GC_OBJ);
+                if(gc_traced(e->cdr))
+                    visit((void **)&e->cdr, GC_OBJ);
+                break;
+            case BOX:
+                if(gc_traced(e->car))
+                    visit((void **)&e->car, GC_OBJ);
+                break;
+            case VECTOR:
+                for(i = 0; i < e->length; i++)
+                    if(gc_traced(e->items[i]))
+                        visit((void **)&e->items[i], GC_OBJ);
+                break;
+            case LAMBDA:
+                for(i = 0; i < e->args->scope->ncaptured; i++)
+                    if(gc_traced(e->captured[i]))
+                        visit((void **)&e->captured[i], GC_OBJ);
+                break;
+            case CDATA:
+                if(e->cdata)
+                    visit(&e->cdata, e->cdtor == map_dtor ? GC_MAP :
+                        e->cdtor == sorted_map_cdtor ? GC_SORTED : GC_ENV);
                 break;
-            else if(e->type != CONS)
-                return 0;
         }
     }
-    return sk_is_list(l->body);
 }
 
-SkObj *sk_eval(SkEnv *env, SkObj *e) {
-    SkObj *result = NULL, *args = NULL;
-    SkEnv *new_env = NULL;
-
-    assert(env);
-    for(;;) {
-        if(result) {
-            rc_release(result);
-            result = NULL;
-        }
-        if(!e)
-            goto end;
-        else if(e->type == SYMBOL) {
-            SkObj *r = sk_env_get(env, sk_get_text(e));
-            result = sk_is_error(r) ? r : rc_retain(r); /* don't retain errors */
-        } else if(e->type == CONS) {
-            const char *what = sk_get_text(e->car);
-            if(!sk_is_list(e)) {
-                result = sk_errorf("bad %s", what[0] ? what : "list");
-                goto end;
-            }
-            if(!strcmp(what, "define") || !strcmp(what, "set!")) {
-                if(sk_length(e) != 3) {
-                    result = sk_errorf("%s needs 2 parameters", what);
-                    goto end;
-                }
-                e = e->cdr;
-
-                const char *varname;
-                if(sk_is_cons(e->car)) {
-                    /* `(define (f a b c) (body))` or `(define (f . args) (body))` forms */
-                    SkObj *f = e->car;
-                    if(!sk_is_symbol(f->car)) {
-                        result = sk_error("define lambda needs function name");
-                        goto end;
-                    }
-                    varname = sk_get_text(f->car);
-
-                    SkObj *body = sk_cons(sk_symbol("begin"), rc_retain(e->cdr));
-                    result = sk_lambda(rc_retain(f->cdr), body);
-                    if(!valid_lambda(result)) {
-                        rc_release(result);
-                        result = sk_error("invalid lambda define");
-                        goto end;
-                    }
-                } else if(sk_is_symbol(e->car)) {
-                    /* `(define v expr)` form */
-                    varname = sk_get_text(e->car);
-                    result = sk_eval(env, sk_cadr(e));
-                    if(sk_is_error(result))
-                        goto end;
-                } else {
-                    result = sk_error("bad define");
-                    goto end;
-                }
-                SkEnv *tgt_env = env;
-                if(!strcmp(what, "define"))
-                    tgt_env = get_global(tgt_env);
-
-                sk_env_put(tgt_env, varname, rc_retain(result));
+static unsigned int gc_hash(void *p) {
+    uintptr_t h = (uintptr_t)p >> 4;
+    return (unsigned int)(h ^ (h >> 15)) * 0x9E3779B1u;
+}
 
-            } else if(!strcmp(what, "let") || !strcmp(what, "let*")) {
-                if(sk_length(e) < 3 || !sk_is_list(e->cdr->car)) {
-                    result = sk_error("bad let");
-                    goto end;
-                }
-                SkObj *a = e->cdr->car, *b = e->cdr->cdr;
+/* Returns the slot in `gc.table` for the pointer `p` */
+static unsigned int *gc_slot(void *p) {
+    unsigned int h = gc_hash(p) & gc.mask;
+    while(gc.table[h] && gc.nodes[gc.table[h] - 1].p != p)
+        h = (h + 1) & gc.mask;
+    return &gc.table[h];
+}
 
-                SkEnv *o = new_env;
-                new_env = sk_env_create(env);
-                rc_release(o);
+/* Every node is pushed at most once in each phase, so the
+stack is as large as the array of nodes */
+static void gc_push(unsigned int i) {
+    gc.stack[gc.sp++] = i;
+}
 
-                for(; a; a = a->cdr) {
-                    if(!sk_is_list(a->car) || sk_length(a->car) != 2
-                        || !sk_is_symbol(a->car->car)) {
-                        result = sk_errorf("bad clause in '%s'", what);
-                        goto end_let;
-                    }
-                    const char *name = sk_get_text(a->car->car);
-                    SkObj *v = sk_eval(new_env->parent, a->car->cdr->car);
-                    if(sk_is_error(v) && (result = v))
-                        goto end_let;
-                    sk_env_put(new_env, name, v);
+/* Finds the node of `p`, adding it to the graph if it isn't there yet */
+static GcNode *gc_node(void *p, int kind) {
+    unsigned int *slot;
+    if(gc.count == gc.size || !gc.table) {
+        unsigned int i, mask = gc.mask ? (gc.mask << 1) | 1 : 63;
+        gc.size = (mask + 1) / 2;
+        gc.nodes = realloc(gc.nodes, gc.size * sizeof *gc.nodes);
+        MEMCHECK(gc.nodes);
+        gc.stack = realloc(gc.stack, gc.size * sizeof *gc.stack);
+        MEMCHECK(gc.stack);
+        free(gc.table);
+        gc.table = calloc(mask + 1, sizeof *gc.table);
+        MEMCHECK(gc.table);
+        gc.mask = mask;
+        for(i = 0; i < gc.count; i++)
+            *gc_slot(gc.nodes[i].p) = i + 1;
+    }
+    slot = gc_slot(p);
+    if(!*slot) {
+        GcNode *n = &gc.nodes[gc.count];
+        n->p = p;
+        n->kind = kind;
+        n->live = 0;
+        n->count = rc_count(p);
+        *slot = ++gc.count;
+        gc_push(gc.count - 1);
+    }
+    return &gc.nodes[*slot - 1];
+}
 
-                    if(what[3] == '*') {
-                        new_env = sk_env_create(new_env);
-                        rc_release(new_env->parent);
-                    }
-                }
-                for(; b && b->cdr; b = b->cdr) {
-                    rc_release(result);
-                    result = sk_eval(new_env, b->car);
-                    if(sk_is_error(result))
-                        goto end_let;
-                }
-                if(b) {
-                    e = b->car;
-                    env = new_env;
-                    continue;
-                }
-end_let:
-                rc_release(new_env);
-                new_env = NULL;
+static void gc_trial(void **ref, int kind) {
+    gc_node(*ref, kind)->count--;
+}
 
-            } else if(!strcmp(what, "lambda")) {
-                if(sk_length(e) < 3) {
-                    result = sk_error("bad lambda");
-                    goto end;
-                }
-                e = e->cdr;
-                SkObj *body = sk_cons(sk_symbol("begin"), rc_retain(e->cdr));
+static void gc_mark(void **ref, int kind) {
+    unsigned int i = *gc_slot(*ref) - 1;
+    if(!gc.nodes[i].live) {
+        gc.nodes[i].live = 1;
+        gc_push(i);
+    }
+}
 
-                result = sk_lambda(rc_retain(e->car), body);
-                if(!valid_lambda(result)) {
-                    rc_release(result);
-                    result = sk_error("invalid lambda");
-                    goto end;
-                }
-            } else if(!strcmp(what, "if")) {
-                if(sk_length(e) != 4) {
-                    result = sk_error("bad if");
-                    goto end;
-                }
-                e = e->cdr;
-                SkObj *cond = sk_eval(env, e->car);
-                if(sk_is_error(cond) && (result = cond))
-                    goto end;
+static void gc_clear(void **ref, int kind) {
+    rc_release(*ref);
+    *ref = NULL;
+}
 
-                if(sk_is_true(cond))
-                    e = e->cdr;
-                else
-                    e = e->cdr->cdr;
+/* Runs `visit` on the edges of the nodes on the stack until it is empty */
+static void gc_drain(gc_visit_t visit) {
+    while(gc.sp) {
+        GcNode *n = &gc.nodes[gc.stack[--gc.sp]];
+        gc_edges(n->p, n->kind, visit);
+    }
+}
 
-                rc_release(cond);
-                e = e->car;
-                continue; /* TCO */
+static size_t collect(Closures *c) {
+    unsigned int i;
+    size_t freed = 0;
 
-            } else if(!strcmp(what, "and")) {
-                int ans = 1;
-                for(e = e->cdr; ans && e; e = e->cdr) {
-                    SkObj *a = sk_eval(env, e->car);
-                    if(sk_is_error(a) && (result = a))
-                        goto end;
-                    else if(!sk_is_true(a))
-                        ans = 0;
-                    rc_release(a);
-                }
-                result = sk_boolean(ans);
-            } else if(!strcmp(what, "or")) {
-                int ans = 0;
-                for(e = e->cdr; !ans && e; e = e->cdr) {
-                    SkObj *a = sk_eval(env, e->car);
-                    if(sk_is_error(a) && (result = a))
-                        goto end;
-                    else if(sk_is_true(a))
-                        ans = 1;
-                    rc_release(a);
-                }
-                result = sk_boolean(ans);
-            } else if(!strcmp(what, "quote")) {
-                if(!e->cdr)
-                    result = sk_error("bad quote");
-                else
-                    result = rc_retain(e->cdr->car);
-            } else if(!strcmp(what, "begin")) {
-                for(e = e->cdr; e && e->cdr; e = e->cdr) {
-                    rc_release(result);
-                    result = sk_eval(env, e->car);
-                    if(sk_is_error(result)) goto end;
-                }
-                if(e) {
-                    e = e->car;
-                    continue; /* TCO */
-                }
-            } else {
-                /* Function call */
-                rc_release(args);
-                args = bind_args(env, e);
-                assert(args);
-                if(sk_is_error(args)) {
-                    result = rc_retain(args);
-                    goto end;
-                }
+    for(i = 0; i < c->count; i++) {
+        gc_node(c->items[i], GC_OBJ);
+        gc_drain(gc_trial);
+    }
 
-                SkObj *f = args->car, *a = args->cdr, *p;
-                if(f && f->type == CFUN) {
-                    assert(f->func);
-                    result = f->func(env, a);
-                } else if(f && f->type == LAMBDA) {
+    for(i = 0; i < gc.count; i++) {
+        if(gc.nodes[i].count && !gc.nodes[i].live) {
+            gc.nodes[i].live = 1;
+            gc_push(i);
+            gc_drain(gc_mark);
+        }
+    }
 
-                    assert(!f->args || sk_is_cons(f->args) || sk_is_symbol(f->args));
+    /* The garbage is retained while its references to each other are
+    cleared, so that none of it is freed before all of it is cleared */
+    for(i = 0; i < gc.count; i++)
+        if(!gc.nodes[i].live)
+            rc_retain(gc.nodes[i].p);
+    for(i = 0; i < gc.count; i++)
+        if(!gc.nodes[i].live)
+            gc_edges(gc.nodes[i].p, gc.nodes[i].kind, gc_clear);
+    for(i = 0; i < gc.count; i++) {
+        if(!gc.nodes[i].live) {
+            rc_release(gc.nodes[i].p);
+            freed++;
+        }
+    }
 
-                    SkEnv *o = new_env;
-                    new_env = sk_env_create(env);
-                    rc_release(o);
+    free(gc.nodes);
+    free(gc.table);
+    free(gc.stack);
+    memset(&gc, 0, sizeof gc);
 
-                    for(p = f->args; p ; p = p->cdr, a = a->cdr) {
-                        if(sk_is_symbol(p)) { /* varargs */
-                            sk_env_put(new_env, sk_get_text(p), rc_retain(a));
-                            break;
-                        }
-                        if(!a) {
-                            result = sk_error("too few arguments passed to lambda");
-                            goto end;
-                        }
-                        sk_env_put(new_env, sk_get_text(p->car), rc_retain(a->car));
-                    }
-                    if(!p && a) {
-                        result = sk_error("too many arguments passed to lambda");
-                        goto end;
-                    }
+    c->limit = c->count * 2;
+    if(c->limit < GC_MIN_LIMIT)
+        c->limit = GC_MIN_LIMIT;
+    return freed;
+}
 
-                    env = new_env;
-                    e = f->body;
-                    continue; /* TCO */
-                } else
-                    result = sk_errorf("attempt to call something that is not a function");
-            }
-        } else {
-            assert (e->type == VALUE || e->type == TRUE || e->type == FALSE ||
-                    e->type == CFUN || e->type == CDATA || e->type == LAMBDA ||
-                    e->type == ERROR);
-            result = rc_retain(e);
-        }
-        break;
-    } /* for(;;) */
-end:
+size_t sk_collect(void) {
+    size_t freed = collect(&closures);
+    Closures **c;
+    for(c = &released; *c;) {
+        freed += collect(*c);
+        if(!(*c)->count) {
+            Closures *empty = *c;
+            *c = empty->next;
+            free(empty);
+        } else
+            c = &(*c)->next;
+    }
+    return freed;
+}
 
-    rc_release(args);
-    rc_release(new_env);
+static void closure_add(SkEnv *env, SkObj *f) {
+    Closures *c = env->global->closures ? env->global->closures : &closures;
+    if(c->count >= c->limit)
+        collect(c);
+    if(c->count == c->size) {
+        c->size = c->size ? c->size << 1 : 64;
+        c->items = realloc(c->items, c->size * sizeof *c->items);
+        MEMCHECK(c->items);
+    }
+    c->items[c->count++] = f;
+    f->closure_index = c->count;
+    CLOSURES_OF(f) = c;
+}
 
-    return result;
+static void closure_remove(SkObj *f) {
+    Closures *c = CLOSURES_OF(f);
+    SkObj *last = c->items[--c->count];
+    c->items[f->closure_index - 1] = last;
+    last->closure_index = f->closure_index;
+    f->closure_index = 0;
+    if(!c->count) {
+        free(c->items);
+        c->items = NULL;
+        c->size = 0;
+    }
 }
 
-SkObj *sk_eval_str(SkEnv *global, const char *text) {
-    SkObj *program = parse_stmts(text), *result;
-    if(sk_is_error(program))
-        return program;
-    result = sk_eval(global, program);
-    rc_release(program);
-    return result;
+static Closures *closures_create(void) {
+    Closures *c = calloc(1, sizeof *c);
+    MEMCHECK(c);
+    return c;
 }
 
-SkObj *sk_apply(SkEnv *env, SkObj *f, SkObj *a) {
-    SkObj *c = sk_cons(rc_retain(f), rc_retain(a));
-    SkObj *r = sk_eval(env, c);
-    rc_release(c);
-    return r;
+/* Called when the global environment of an interpreter is destroyed */
+static void closures_drop(Closures *c) {
+    if(!c->count) {
+        free(c);
+        return;
+    }
+    c->next = released;
+    released = c;
 }
 
 /* =============================================================
@@ -1078,46 +4896,486 @@ SkObj *sk_apply(SkEnv *env, SkObj *f, SkObj *a) {
 ============================================================= */
 
 #ifndef SK_USE_EXTERNAL_REF_COUNTER
+/* The header in front of every object is a single word. Rather than a
+pointer to its destructor, each object has the index of its destructor in
+`rc_dtors`, so that all the objects of a type (`SkObj`s, `SkEnv`s) share
+an entry. The table is shared by all threads, so that an index means the
+same destructor on every thread. Skeem's own destructors are in it from
+the start, so setting them can't fail; other destructors are added the
+first time `rc_set_dtor()` sees them. Adding one is rare, so it takes a
+spin lock, and an entry is only counted once it is written, so lookups
+don't need the lock. */
 typedef struct refobj {
     unsigned int refcnt;
-    ref_dtor_t dtor;
+    unsigned char dtor; /* 0 if the object has no destructor */
+    unsigned char pool; /* where the object was allocated; see below */
+    unsigned short account; /* the memory account it is charged to, or 0 */
 } RefObj;
 
-void *rc_alloc(size_t size) {
-    void *data;
-    RefObj *r = malloc((sizeof *r) + size);
-    data = (char*)r + sizeof *r;
+enum {POOL_SLAB, POOL_MALLOC};
+
+#define RC_MAX_DTORS    256
+
+static struct {
+    ref_dtor_t dtors[RC_MAX_DTORS];
+    AtomicCount count;
+    AtomicPtr lock; /* held while a destructor is added */
+} rc_dtors = {{NULL, (ref_dtor_t)SkExpr_dtor, (ref_dtor_t)env_dtor,
+    (ref_dtor_t)map_node_dtor, (ref_dtor_t)sorted_map_dtor}, 5, NULL};
+
+/* Small objects are allocated from slabs: pages of `SLAB_SIZE` bytes, aligned
+to their size, that are divided into blocks of a single size class. Each size
+class has a list of free blocks, so allocating and freeing an object is
+usually just a matter of taking it from or putting it back on the list.
+
+The size classes are multiples of `SLAB_GRANULE` up to `SLAB_MAX` bytes,
+including the `RefObj`. Anything larger goes directly to `malloc()`, with
+its size in front of the header for the memory accounting.
+
+The lists are per thread. An object that is released on another thread
+than the one that allocated it, because its interpreter was handed over,
+goes on the list of the thread that released it, so a slab can only be
+returned to the system by the thread that owns it, once all its blocks are
+back on that thread's list. */
+#define SLAB_SIZE       65536
+#define SLAB_GRANULE    16
+#define SLAB_MAX        256
+#define SLAB_CLASSES    (SLAB_MAX / SLAB_GRANULE)
+
+typedef struct Slab {
+    struct Slab *next;
+    void *owner; /* the `pools` of the thread that created it */
+    unsigned int free; /* `rc_trim()`: its blocks on the owner's free list */
+    unsigned int size_class;
+} Slab;
+
+/* The blocks of a slab start after its header, aligned to `SLAB_GRANULE` */
+#define SLAB_HEADER     ((sizeof(Slab) + SLAB_GRANULE - 1) / SLAB_GRANULE * SLAB_GRANULE)
+#define SLAB_OF(r)      ((Slab *)((uintptr_t)(r) & ~(uintptr_t)(SLAB_SIZE - 1)))
+
+typedef struct FreeBlock {
+    struct FreeBlock *next;
+} FreeBlock;
+
+typedef struct LargeObj {
+    size_t size;
+    RefObj header;
+} LargeObj;
+
+#define LARGE_OF(r)     ((LargeObj *)((char *)(r) - offsetof(LargeObj, header)))
+
+static THREAD_LOCAL struct {
+    Slab *slabs;
+    FreeBlock *free;
+} pools[SLAB_CLASSES + 1];
+
+#if defined(_MSC_VER)
+#  include <malloc.h>
+#  define slab_memory()     _aligned_malloc(SLAB_SIZE, SLAB_SIZE)
+#  define slab_release(s)   _aligned_free(s)
+#else
+#  define slab_memory()     aligned_alloc(SLAB_SIZE, SLAB_SIZE)
+#  define slab_release(s)   free(s)
+#endif
+
+/* Allocates a new slab for size class `c` and puts all its blocks on the free list */
+static int slab_create(unsigned int c) {
+    size_t size = c * SLAB_GRANULE, offset;
+    Slab *s = slab_memory();
+    if(!s)
+        return 0;
+    s->owner = pools;
+    s->size_class = c;
+    s->next = pools[c].slabs;
+    pools[c].slabs = s;
+    for(offset = SLAB_HEADER; offset + size <= SLAB_SIZE; offset += size) {
+        FreeBlock *b = (FreeBlock *)((char *)s + offset);
+        b->next = pools[c].free;
+        pools[c].free = b;
+    }
+    return 1;
+}
+
+/* Memory accounting. Each interpreter that `sk_global_env()` creates has an
+account, and while `sk_eval()` evaluates something in it, the objects that
+are allocated are charged to it, so the account of every object is in its
+header. `ACCOUNT(id)` is the account with the given id.
+
+The accounts are shared by all the threads, so that an interpreter can be
+handed to another thread: They are kept in chunks that are only ever added,
+and an interpreter claims a free slot in them by swapping its account in. */
+#define RC_MAX_ACCOUNTS USHRT_MAX
+#define ACCOUNT_CHUNK   256
+
+static AtomicPtr account_chunks[(RC_MAX_ACCOUNTS + ACCOUNT_CHUNK - 1) / ACCOUNT_CHUNK];
+
+#define ACCOUNT(id)     ((Account *)((AtomicPtr *)account_chunks[((id) - 1) / ACCOUNT_CHUNK])[((id) - 1) % ACCOUNT_CHUNK])
+
+static THREAD_LOCAL struct {
+    unsigned int current; /* the id of the account objects are charged to */
+} accounts;
+
+/* The slot of the account with index `i`, adding its chunk if needed */
+static AtomicPtr *account_slot(unsigned int i) {
+    AtomicPtr *chunk = account_chunks[i / ACCOUNT_CHUNK];
+    if(!chunk) {
+        chunk = calloc(ACCOUNT_CHUNK, sizeof *chunk);
+        MEMCHECK(chunk);
+        if(!ATOMIC_CAS(&account_chunks[i / ACCOUNT_CHUNK], NULL, chunk)) {
+            free(chunk);
+            chunk = account_chunks[i / ACCOUNT_CHUNK];
+        }
+    }
+    return &chunk[i % ACCOUNT_CHUNK];
+}
+
+static unsigned int rc_account_create(void) {
+    Account *a = calloc(1, sizeof *a);
+    unsigned int i;
+    MEMCHECK(a);
+    for(i = 0; i < RC_MAX_ACCOUNTS; i++) {
+        AtomicPtr *slot = account_slot(i);
+        if(!*slot && ATOMIC_CAS(slot, NULL, a))
+            return i + 1;
+    }
+    free(a);
+    return 0; /* The interpreter simply isn't accounted */
+}
+
+static void account_free(unsigned int id) {
+    free(ACCOUNT(id));
+    *account_slot(id - 1) = NULL;
+    if(accounts.current == id)
+        accounts.current = 0;
+}
+
+/* Called when the global environment of the account is destroyed. Objects
+that are still charged to it keep it until they are freed */
+static void rc_account_drop(unsigned int id) {
+    Account *a = ACCOUNT(id);
+    a->orphaned = 1;
+    if(!a->stats.live)
+        account_free(id);
+}
+
+static unsigned int rc_account_use(unsigned int id) {
+    unsigned int was = accounts.current;
+    accounts.current = id;
+    return was;
+}
+
+static Account *rc_account_get(unsigned int id) {
+    return id ? ACCOUNT(id) : NULL;
+}
+
+static int rc_over_limit(void) {
+    Account *a = rc_account_get(accounts.current);
+    return a && a->limit && a->stats.live > a->limit;
+}
+
+/* Whether `size` more bytes can be charged to the account of `p`,
+or to the current account if `p` isn't an object, within its limit */
+static int rc_can_charge(void *p, size_t size) {
+    unsigned int id = accounts.current;
+    Account *a;
+    if(p && !IS_IMMEDIATE(p))
+        id = ((RefObj *)((char *)p - sizeof(RefObj)))->account;
+    a = rc_account_get(id);
+    return !a || !a->limit || (a->stats.live <= a->limit && size <= a->limit - a->stats.live);
+}
+
+static void account_charge(unsigned int id, size_t size) {
+    Account *a = ACCOUNT(id);
+    a->stats.live += size;
+    if(a->stats.live > a->stats.peak)
+        a->stats.peak = a->stats.live;
+}
+
+static void account_refund(unsigned int id, size_t size) {
+    Account *a = ACCOUNT(id);
+    a->stats.live -= size;
+    if(a->orphaned && !a->stats.live)
+        account_free(id);
+}
+
+static int rc_accounted(void *p) {
+    return p && !IS_IMMEDIATE(p) && ((RefObj *)((char *)p - sizeof(RefObj)))->account;
+}
+
+/* Charges `size` more (or less, if it is negative) bytes to the
+account of the object `p`, for memory that `p` owns */
+static void rc_charge(void *p, ptrdiff_t size) {
+    RefObj *r;
+    if(!p || IS_IMMEDIATE(p))
+        return;
+    r = (RefObj *)((char *)p - sizeof *r);
+    if(!r->account)
+        return;
+    if(size >= 0)
+        account_charge(r->account, size);
+    else
+        account_refund(r->account, -size);
+}
+
+/* The number of bytes an object takes up, as far as the accounting is concerned */
+static size_t rc_block_size(RefObj *r) {
+    if(r->pool == POOL_SLAB)
+        return SLAB_OF(r)->size_class * SLAB_GRANULE;
+    return LARGE_OF(r)->size;
+}
+
+static void *alloc_object(size_t size, int limited) {
+    RefObj *r;
+    size_t total = (sizeof *r) + size;
+    if(total <= SLAB_MAX) {
+        unsigned int c = (unsigned int)((total + SLAB_GRANULE - 1) / SLAB_GRANULE);
+        if(!pools[c].free && !slab_create(c))
+            return NULL;
+        r = (RefObj *)pools[c].free;
+        pools[c].free = pools[c].free->next;
+        r->pool = POOL_SLAB;
+    } else {
+        LargeObj *l;
+        /* Small objects are let through: the engines catch up with them
+        before the next call. Large ones are refused before they exist */
+        if(limited && !rc_can_charge(NULL, sizeof *l + size))
+            return NULL;
+        l = malloc(sizeof *l + size);
+        if(!l)
+            return NULL;
+        l->size = sizeof *l + size;
+        r = &l->header;
+        r->pool = POOL_MALLOC;
+    }
     r->refcnt = 1;
-    r->dtor = NULL;
-    return data;
+    r->dtor = 0;
+    r->account = 0;
+    if(accounts.current) {
+        r->account = accounts.current;
+        account_charge(r->account, rc_block_size(r));
+        ACCOUNT(r->account)->stats.allocs++;
+    }
+    return (char*)r + sizeof *r;
+}
+
+void *rc_alloc(size_t size) {
+    return alloc_object(size, 1);
+}
+
+static void *rc_alloc_fixed(size_t size) {
+    return alloc_object(size, 0);
+}
+
+/* Releasing an object can release the objects it refers to, and so on, so
+`rc_release()` works through a stack of dead objects rather than recursing
+into the destructors, so that it uses constant C stack space no matter how
+long a list is or how deeply it is nested. The header is too small to link
+the objects whose destructors haven't been called yet, so they are kept in
+an array. Once an object is destroyed its body is no longer needed, so it is
+linked through that onto a list that is handed back to the allocator in
+batches. */
+#define RC_BATCH        256
+
+typedef struct DeadObj {
+    RefObj header;
+    struct DeadObj *next;
+} DeadObj;
+
+static THREAD_LOCAL struct {
+    RefObj **dying; /* objects whose destructors still have to be called */
+    unsigned int ndying, adying;
+    DeadObj *dead; /* destroyed objects waiting to be freed */
+    unsigned int ndead;
+} rc_work;
+
+static void rc_free_batch(void) {
+    while(rc_work.dead) {
+        DeadObj *d = rc_work.dead;
+        RefObj *r = &d->header;
+        rc_work.dead = d->next;
+        if(r->account)
+            account_refund(r->account, rc_block_size(r));
+        if(r->pool == POOL_SLAB) {
+            Slab *s = SLAB_OF(r);
+            FreeBlock *b = (FreeBlock *)r;
+            b->next = pools[s->size_class].free;
+            pools[s->size_class].free = b;
+        } else
+            free(LARGE_OF(r));
+    }
+    rc_work.ndead = 0;
+}
+
+size_t rc_trim(void) {
+    unsigned int c;
+    size_t released = 0;
+    for(c = 1; c <= SLAB_CLASSES; c++) {
+        unsigned int blocks = (SLAB_SIZE - SLAB_HEADER) / (c * SLAB_GRANULE);
+        Slab **s, *empty;
+        FreeBlock **b;
+        /* Count the free blocks of each slab. The list can also have blocks
+        of other threads' slabs, which are left alone */
+        for(empty = pools[c].slabs; empty; empty = empty->next)
+            empty->free = 0;
+        for(b = &pools[c].free; *b; b = &(*b)->next) {
+            if(SLAB_OF(*b)->owner == pools)
+                SLAB_OF(*b)->free++;
+        }
+        /* Take the blocks of the empty slabs off the free list before the slabs are freed */
+        for(b = &pools[c].free; *b;) {
+            if(SLAB_OF(*b)->owner == pools && SLAB_OF(*b)->free == blocks)
+                *b = (*b)->next;
+            else
+                b = &(*b)->next;
+        }
+        for(s = &pools[c].slabs; *s;) {
+            if((*s)->free == blocks) {
+                empty = *s;
+                *s = empty->next;
+                slab_release(empty);
+                released += SLAB_SIZE;
+            } else
+                s = &(*s)->next;
+        }
+    }
+    if(!rc_work.ndying) {
+        free(rc_work.dying);
+        rc_work.dying = NULL;
+        rc_work.adying = 0;
+    }
+    return released;
 }
 
 void *rc_retain(void *p) {
     RefObj *r;
-    if(!p)
-        return NULL;
+    if(!p || IS_IMMEDIATE(p))
+        return p;
     r = (RefObj *)((char *)p - sizeof *r);
     r->refcnt++;
     return p;
 }
 
+int rc_unique(void *p) {
+    RefObj *r;
+    if(!p || IS_IMMEDIATE(p))
+        return 0;
+    r = (RefObj *)((char *)p - sizeof *r);
+    return r->refcnt == 1;
+}
+
+unsigned int rc_count(void *p) {
+    if(!p || IS_IMMEDIATE(p))
+        return 0;
+    return ((RefObj *)((char *)p - sizeof(RefObj)))->refcnt;
+}
+
 void rc_release(void *p) {
     RefObj *r;
-    if(!p)
+    if(!p || IS_IMMEDIATE(p))
         return;
     r = (RefObj *)((char *)p - sizeof *r);
-    if(--r->refcnt == 0) {
-        if(r->dtor != NULL)
-            r->dtor(p);
-        free(r);
+    if(--r->refcnt)
+        return;
+    if(!r->dtor) {
+        /* Nothing else can be released through it */
+        DeadObj *d = (DeadObj *)r;
+        d->next = rc_work.dead;
+        rc_work.dead = d;
+        if(++rc_work.ndead == RC_BATCH || !rc_work.ndying)
+            rc_free_batch();
+        return;
     }
+    if(rc_work.ndying == rc_work.adying) {
+        rc_work.adying = rc_work.adying ? rc_work.adying << 1 : 64;
+        rc_work.dying = realloc(rc_work.dying, rc_work.adying * sizeof *rc_work.dying);
+        MEMCHECK(rc_work.dying);
+    }
+    rc_work.dying[rc_work.ndying++] = r;
+    if(rc_work.ndying > 1)
+        return; /* An outer `rc_release()` will get to it */
+    while(rc_work.ndying) {
+        /* The object stays on the stack while its destructor runs, so
+        that the objects it releases are left for this loop */
+        DeadObj *d;
+        r = rc_work.dying[rc_work.ndying - 1];
+        if(r->dtor) {
+            unsigned char dtor = r->dtor;
+            r->dtor = 0;
+            rc_dtors.dtors[dtor]((char *)r + sizeof *r);
+            continue;
+        }
+        rc_work.ndying--;
+        d = (DeadObj *)r;
+        d->next = rc_work.dead;
+        rc_work.dead = d;
+        if(++rc_work.ndead == RC_BATCH)
+            rc_free_batch();
+    }
+    rc_free_batch();
+}
+
+/* The index of `dtor` in the table, or 0 if it isn't in it */
+static unsigned int find_dtor(ref_dtor_t dtor) {
+    unsigned int i, n = (unsigned int)ATOMIC_LOAD(&rc_dtors.count);
+    for(i = 1; i < n && rc_dtors.dtors[i] != dtor; i++);
+    return i < n ? i : 0;
 }
 
-void rc_set_dtor(void *p, ref_dtor_t dtor) {
+int rc_set_dtor(void *p, ref_dtor_t dtor) {
     RefObj *r;
-    if(!p) return;
+    unsigned int i;
+    if(!p || IS_IMMEDIATE(p)) return 1;
     r = (RefObj *)((char *)p - sizeof *r);
-    r->dtor = dtor;
+    if(!dtor) {
+        r->dtor = 0;
+        return 1;
+    }
+    if(!(i = find_dtor(dtor))) {
+        while(!ATOMIC_CAS(&rc_dtors.lock, NULL, &rc_dtors))
+            ;
+        /* Another thread may have added it in the meantime */
+        if(!(i = find_dtor(dtor)) && rc_dtors.count < RC_MAX_DTORS) {
+            i = (unsigned int)rc_dtors.count;
+            rc_dtors.dtors[i] = dtor;
+            ATOMIC_ADD(&rc_dtors.count, 1);
+        }
+        ATOMIC_CAS(&rc_dtors.lock, &rc_dtors, NULL);
+        if(!i)
+            return 0;
+    }
+    r->dtor = i;
+    return 1;
+}
+#else
+size_t rc_trim(void) {
+    /* The external reference counter allocates everything with `malloc()` */
+    return 0;
+}
+/* Nor does it have room for the accounting in the header */
+static unsigned int rc_account_create(void) {
+    return 0;
+}
+static void rc_account_drop(unsigned int id) {
+}
+static unsigned int rc_account_use(unsigned int id) {
+    return 0;
+}
+static Account *rc_account_get(unsigned int id) {
+    return NULL;
+}
+static int rc_over_limit(void) {
+    return 0;
+}
+static int rc_can_charge(void *p, size_t size) {
+    return 1;
+}
+static void *rc_alloc_fixed(size_t size) {
+    return rc_alloc(size);
+}
+static int rc_accounted(void *p) {
+    return 0;
+}
+static void rc_charge(void *p, ptrdiff_t size) {
 }
 #endif
 
@@ -1150,6 +5408,14 @@ static SkObj *bif_apply(SkEnv *env, SkObj *e) {
 static SkObj *bif_cons(SkEnv *env, SkObj *e) {
     if(sk_length(e) != 2)
         return sk_error("'cons' expects 2 arguments");
+    if(rc_unique(e) && rc_unique(e->cdr)) {
+        /* Nothing but the caller refers to the list of arguments, and the
+        caller is about to release it, so its first cell becomes the pair */
+        SkObj *rest = e->cdr;
+        e->cdr = rc_retain(rest->car);
+        rc_release(rest);
+        return rc_retain(e);
+    }
     return sk_cons(rc_retain(sk_car(e)), rc_retain(sk_cadr(e)));
 }
 
@@ -1173,7 +5439,7 @@ static SkObj *bif_list(SkEnv *env, SkObj *e) {
 #define TYPE_FUNCTION(cname, name, returns) static SkObj *cname(SkEnv *env, SkObj *e){return (e)?(returns):sk_error("'" name "' expects a parameter");}
 
 TYPE_FUNCTION(bif_is_list, "list?", sk_boolean(sk_is_list(e->car)))
-TYPE_FUNCTION(bif_length, "length?", sk_number(sk_length(e->car)))
+TYPE_FUNCTION(bif_length, "length?", sk_integer(sk_length(e->car)))
 TYPE_FUNCTION(bif_is_null, "null?", sk_boolean(sk_is_null(e->car)))
 TYPE_FUNCTION(bif_is_symbol, "symbol?", sk_boolean(sk_is_symbol(e->car)))
 TYPE_FUNCTION(bif_is_pair, "pair?", sk_boolean(sk_is_cons(e->car)))
@@ -1181,6 +5447,7 @@ TYPE_FUNCTION(bif_is_procedure, "procedure?", sk_boolean(sk_is_procedure(e->car)
 TYPE_FUNCTION(bif_is_cdata, "cdata?", sk_boolean(sk_is_cdata(e->car)))
 TYPE_FUNCTION(bif_is_value, "value?", sk_boolean(sk_is_value(e->car)))
 TYPE_FUNCTION(bif_is_number, "number?", sk_boolean(sk_is_number(e->car)))
+TYPE_FUNCTION(bif_is_integer, "integer?", sk_boolean(sk_is_integer(e->car)))
 TYPE_FUNCTION(bif_is_boolean, "boolean?", sk_boolean(sk_is_boolean(e->car)))
 TYPE_FUNCTION(bif_not, "not", sk_boolean(!sk_is_true(e->car)))
 
@@ -1196,38 +5463,99 @@ static SkObj *bif_eq(SkEnv *env, SkObj *e) {
     return sk_boolean(e->car == e->cdr->car);
 }
 
-#define ARITH_FUNCTION(cname, operator)          \
-static SkObj *cname(SkEnv *env, SkObj *e) {      \
-    if(!e) return sk_number(0);                  \
-    double res = atof(sk_get_text(e->car));      \
-    for(e = e->cdr; e; e = e->cdr)               \
-        res operator atof(sk_get_text(e->car));  \
-    return sk_number(res);                       \
-}
-ARITH_FUNCTION(bif_add, +=)
-ARITH_FUNCTION(bif_sub, -=)
-ARITH_FUNCTION(bif_mul, *=)
-
-static SkObj *bif_div(SkEnv *env, SkObj *e) {
-    double res = 0;
-    if(!e) return sk_number(0);
-    res = atof(sk_get_text(e->car));
+/* Integer arithmetic that checks for overflow.
+Returns 0 (and leaves `*r` alone) if the result doesn't fit in a `long long` */
+static int integer_arith(char op, long long a, long long b, long long *r) {
+    switch(op) {
+        case '+':
+            if((b > 0 && a > LLONG_MAX - b) || (b < 0 && a < LLONG_MIN - b))
+                return 0;
+            *r = a + b;
+            return 1;
+        case '-':
+            if((b < 0 && a > LLONG_MAX + b) || (b > 0 && a < LLONG_MIN + b))
+                return 0;
+            *r = a - b;
+            return 1;
+        case '*':
+            if(a > 0 ? (b > 0 ? a > LLONG_MAX / b : b < LLONG_MIN / a)
+                     : (b > 0 ? a < LLONG_MIN / b : (a && b < LLONG_MAX / a)))
+                return 0;
+            *r = a * b;
+            return 1;
+        case '/':
+            if(!b || (a == LLONG_MIN && b == -1) || a % b)
+                return 0;
+            *r = a / b;
+            return 1;
+    }
+    return 0;
+}
+
+/* The result stays an exact integer while all the operands are integers,
+and is promoted to a double on the first overflow or non-integer operand */
+static SkObj *arith(SkObj *e, char op) {
+    long long ires = 0, ib;
+    double res = 0, b;
+    int exact;
+    if(!e) return sk_integer(0);
+    exact = exact_integer(e->car, &ires);
+    if(!exact)
+        res = sk_get_number(e->car);
     for(e = e->cdr; e; e = e->cdr) {
-        double b = atof(sk_get_text(e->car));
-        if(!b) return sk_error("divide by 0");
-        res /= b;
+        if(exact) {
+            if(exact_integer(e->car, &ib)) {
+                if(op == '/' && !ib)
+                    return sk_error("divide by 0");
+                if(integer_arith(op, ires, ib, &ires))
+                    continue;
+            }
+            exact = 0;
+            res = (double)ires;
+        }
+        b = sk_get_number(e->car);
+        switch(op) {
+            case '+': res += b; break;
+            case '-': res -= b; break;
+            case '*': res *= b; break;
+            case '/':
+                if(!b) return sk_error("divide by 0");
+                res /= b;
+                break;
+        }
     }
-    return sk_number(res);
+    return exact ? sk_integer(ires) : sk_number(res);
+}
+
+#define ARITH_FUNCTION(cname, operator)          \
+static SkObj *cname(SkEnv *env, SkObj *e) {      \
+    return arith(e, operator);                   \
 }
+ARITH_FUNCTION(bif_add, '+')
+ARITH_FUNCTION(bif_sub, '-')
+ARITH_FUNCTION(bif_mul, '*')
+ARITH_FUNCTION(bif_div, '/')
 
 static SkObj *bif_mod(SkEnv *env, SkObj *e) {
-    int res = 0;
-    if(!e) return sk_number(0);
-    res = atoi(sk_get_text(e->car));
-    for(e = e->cdr; e; e = e->cdr) {
-        int b = atoi(sk_get_text(e->car));
+    long long ires = 0, ib;
+    double res, b;
+    if(!e) return sk_integer(0);
+    if(exact_integer(e->car, &ires)) {
+        for(e = e->cdr; e && exact_integer(e->car, &ib); e = e->cdr) {
+            if(!ib) return sk_error("divide by 0");
+            ires = (ib == -1) ? 0 : ires % ib;
+        }
+        if(!e)
+            return sk_integer(ires);
+        res = (double)ires;
+    } else {
+        res = sk_get_number(e->car);
+        e = e->cdr;
+    }
+    for(; e; e = e->cdr) {
+        b = sk_get_number(e->car);
         if(!b) return sk_error("divide by 0");
-        res %= b;
+        res = fmod(res, b);
     }
     return sk_number(res);
 }
@@ -1236,15 +5564,28 @@ static SkObj *bif_mod(SkEnv *env, SkObj *e) {
 static SkObj *cname(SkEnv *env, SkObj *e) {                    \
     if(sk_length(e) < 2)                                       \
         return sk_error("'" name "' expects two arguments");   \
-    const char *a = sk_get_text(e->car);                       \
-    const char *b = sk_get_text(e->cdr->car);                  \
+    char ba[SK_TEXT_SIZE], bb[SK_TEXT_SIZE];                   \
+    const char *a = sk_get_text_buf(e->car, ba);               \
+    const char *b = sk_get_text_buf(e->cdr->car, bb);          \
     return sk_boolean(operator);                               \
 }
-COMPARE_FUNCTION(bif_number_eq, "=", atof(a) == atof(b))
-COMPARE_FUNCTION(bif_gt, ">", atof(a) > atof(b))
-COMPARE_FUNCTION(bif_ge, ">=", atof(a) >= atof(b))
-COMPARE_FUNCTION(bif_lt, "<", atof(a) < atof(b))
-COMPARE_FUNCTION(bif_le, "<=", atof(a) <= atof(b))
+
+#define NUMBER_COMPARE_FUNCTION(cname, name, operator)         \
+static SkObj *cname(SkEnv *env, SkObj *e) {                    \
+    long long ia, ib;                                          \
+    if(sk_length(e) < 2)                                       \
+        return sk_error("'" name "' expects two arguments");   \
+    if(exact_integer(e->car, &ia) && exact_integer(e->cdr->car, &ib)) \
+        return sk_boolean(ia operator ib);                     \
+    double a = sk_get_number(e->car);                          \
+    double b = sk_get_number(e->cdr->car);                     \
+    return sk_boolean(a operator b);                           \
+}
+NUMBER_COMPARE_FUNCTION(bif_number_eq, "=", ==)
+NUMBER_COMPARE_FUNCTION(bif_gt, ">", >)
+NUMBER_COMPARE_FUNCTION(bif_ge, ">=", >=)
+NUMBER_COMPARE_FUNCTION(bif_lt, "<", <)
+NUMBER_COMPARE_FUNCTION(bif_le, "<=", <=)
 
 static SkObj *bif_map(SkEnv *env, SkObj *e) {
     if(!sk_is_procedure(sk_car(e)) || !sk_is_list(sk_cadr(e)))
@@ -1287,6 +5628,15 @@ static SkObj *bif_append(SkEnv *env, SkObj *e) {
     SkObj *x, *result = NULL, *last = NULL;
     if(!sk_car(e)) /* First list is empty */
         return rc_retain(sk_cadr(e));
+    if(rc_unique(sk_car(e))) {
+        /* If nothing else refers to any of the cells of the first list
+        (it is a temporary), the second list is attached to it in place */
+        for(x = sk_car(e); x->cdr && rc_unique(x->cdr); x = x->cdr);
+        if(!x->cdr) {
+            x->cdr = rc_retain(sk_cadr(e));
+            return rc_retain(sk_car(e));
+        }
+    }
     /* Need to shallow copy the first list, but not the second */
     for(x = sk_car(e); x; x = sk_cdr(x))
         list_append1(&result, rc_retain(sk_car(x)), &last);
@@ -1295,12 +5645,30 @@ static SkObj *bif_append(SkEnv *env, SkObj *e) {
 }
 
 static SkObj *bif_string_length(SkEnv *env, SkObj *e) {
-    return sk_number(strlen(sk_get_text(sk_car(e))));
+    return sk_integer(strlen(sk_get_text(sk_car(e))));
 }
 
 static SkObj *bif_string_append(SkEnv *env, SkObj *e) {
     char *buf = NULL;
     int n, a;
+    SkObj *first = sk_car(e), *x;
+    size_t len = 0;
+    for(x = e; x; x = sk_cdr(x))
+        len += strlen(sk_get_text(sk_car(x)));
+    if(!rc_can_charge(NULL, len + 1))
+        return memory_error();
+    if(first && type_of(first) == VALUE && rc_unique(first)) {
+        /* Nothing else refers to the first string, so it is extended in place */
+        charge_text(first, -1);
+        buf = first->value;
+        n = strlen(buf);
+        a = n + 1;
+        for(e = sk_cdr(e); e; e = sk_cdr(e))
+            buffer_append(&buf, &n, &a, sk_get_text(sk_car(e)));
+        first->value = buf;
+        charge_text(first, 1);
+        return rc_retain(first);
+    }
     for(; e; e = sk_cdr(e))
         buffer_append(&buf, &n, &a, sk_get_text(sk_car(e)));
     if(!buf) return sk_value("");
@@ -1308,7 +5676,8 @@ static SkObj *bif_string_append(SkEnv *env, SkObj *e) {
 }
 
 static SkObj *bif_string_split(SkEnv *env, SkObj *e) {
-    const char *str = sk_get_text(sk_car(e)), *sep = sk_get_text(sk_cadr(e));
+    char bstr[SK_TEXT_SIZE], bsep[SK_TEXT_SIZE];
+    const char *str = sk_get_text_buf(sk_car(e), bstr), *sep = sk_get_text_buf(sk_cadr(e), bsep);
     SkObj *result = NULL, *last = NULL;
 
     if(!sep[0])
@@ -1334,12 +5703,12 @@ static SkObj *bif_string_split(SkEnv *env, SkObj *e) {
 static SkObj *bif_substring(SkEnv *env, SkObj *e) {
     const char *str = sk_get_text(sk_car(e));
     SkObj *eo = sk_car(sk_cddr(e));
-    int start = atoi(sk_get_text(sk_cadr(e))), end;
+    int start = (int)sk_get_integer(sk_cadr(e)), end;
 
     size_t len = strlen(str);
 
     if(!sk_is_null(eo)) {
-        end = atoi(sk_get_text(eo));
+        end = (int)sk_get_integer(eo);
         if(end > len)
             end = len;
     } else
@@ -1374,11 +5743,11 @@ static SkObj *bif_string_downcase(SkEnv *env, SkObj *e) {
 
 static SkObj *bif_string_ascii(SkEnv *env, SkObj *e) {
     const char *s = sk_get_text(sk_car(e));
-    return sk_number(s[0]);
+    return sk_integer(s[0]);
 }
 
 static SkObj *bif_string_char(SkEnv *env, SkObj *e) {
-    int s = atoi(sk_get_text(sk_car(e))) & 0x7F;
+    int s = (int)sk_get_integer(sk_car(e)) & 0x7F;
     char *buf = malloc(2);
     MEMCHECK(buf);
     buf[0] = s; buf[1] = '\0';
@@ -1397,8 +5766,9 @@ static SkObj *bif_string_trim(SkEnv *env, SkObj *e) {
 }
 
 static SkObj *bif_string_find(SkEnv *env, SkObj *e) {
-    const char *haystack = sk_get_text(sk_car(e));
-    const char *needle = sk_get_text(sk_cadr(e));
+    char bh[SK_TEXT_SIZE], bn[SK_TEXT_SIZE];
+    const char *haystack = sk_get_text_buf(sk_car(e), bh);
+    const char *needle = sk_get_text_buf(sk_cadr(e), bn);
     if(haystack[0] == '\0')
         return NULL;
     if(needle[0] == '\0')
@@ -1406,17 +5776,18 @@ static SkObj *bif_string_find(SkEnv *env, SkObj *e) {
     char *found = strstr(haystack, needle);
     if(!found)
         return NULL;
-    return sk_number(found - haystack);
+    return sk_integer(found - haystack);
 }
 
 static SkObj *bif_string_replace(SkEnv *env, SkObj *e) {
     const char *str, *srch, *rep;
     char *buf = NULL, *find;
+    char bstr[SK_TEXT_SIZE], bsrch[SK_TEXT_SIZE], brep[SK_TEXT_SIZE];
     int n, a, sl;
 
-    str = sk_get_text(sk_car(e));
-    srch = sk_get_text(sk_cadr(e));
-    rep = sk_get_text(sk_car(sk_cddr(e)));
+    str = sk_get_text_buf(sk_car(e), bstr);
+    srch = sk_get_text_buf(sk_cadr(e), bsrch);
+    rep = sk_get_text_buf(sk_car(sk_cddr(e)), brep);
 
     sl = strlen(srch);
     if(!sl) return rc_retain(sk_car(e));
@@ -1433,7 +5804,7 @@ static SkObj *bif_string_replace(SkEnv *env, SkObj *e) {
 COMPARE_FUNCTION(bif_string_eq, "string=?", !strcmp(a, b))
 COMPARE_FUNCTION(bif_string_lt, "string<?", strcmp(a, b) < 0)
 
-#define MATH_FUN(f) static SkObj *bif_ ## f(SkEnv *env, SkObj *e) { return sk_number(f(atof(sk_get_text(sk_car(e))))); }
+#define MATH_FUN(f) static SkObj *bif_ ## f(SkEnv *env, SkObj *e) { return sk_number(f(sk_get_number(sk_car(e)))); }
 
 MATH_FUN(sin)
 MATH_FUN(cos)
@@ -1445,30 +5816,52 @@ MATH_FUN(exp)
 MATH_FUN(sqrt)
 MATH_FUN(ceil)
 MATH_FUN(floor)
-MATH_FUN(fabs)
+
+static SkObj *bif_abs(SkEnv *env, SkObj *e) {
+    long long i;
+    if(exact_integer(sk_car(e), &i) && i != LLONG_MIN)
+        return sk_integer(i < 0 ? -i : i);
+    return sk_number(fabs(sk_get_number(sk_car(e))));
+}
 
 static SkObj *bif_atan(SkEnv *env, SkObj *e) {
     double p, q;
-    p = atof(sk_get_text(sk_car(e)));
+    p = sk_get_number(sk_car(e));
     if(sk_is_null(sk_cadr(e)))
         return sk_number(atan(p));
-    q = atof(sk_get_text(sk_cadr(e)));
+    q = sk_get_number(sk_cadr(e));
     return sk_number(atan2(p, q));
 }
 
 static SkObj *bif_pow(SkEnv *env, SkObj *e) {
     double x, y;
-    x = atof(sk_get_text(sk_car(e)));
-    y = atof(sk_get_text(sk_cadr(e)));
+    x = sk_get_number(sk_car(e));
+    y = sk_get_number(sk_cadr(e));
     return sk_number(pow(x, y));
 }
 
-/* Skeem's hash tables are just CData objects of the SkEnv type... */
+/* Skeem's hash tables are just CData objects of the SkEnv type...
+...and its immutable hash tables are CData objects of the root MapNode */
 
 static void hash_table_dtor(void *p) {
     SkEnv *e = p;
     rc_release(e);
 }
+
+static void map_dtor(void *p) {
+    rc_release(p);
+}
+
+/* Returns the root of `h` if it is an immutable hash table, NULL otherwise */
+static MapNode *map_of(SkObj *h) {
+    return sk_get_cdtor(h) == (ref_dtor_t)map_dtor ? sk_get_cdata(h) : NULL;
+}
+
+static int is_hash(SkObj *h) {
+    ref_dtor_t dtor = sk_get_cdtor(h);
+    return dtor == (ref_dtor_t)hash_table_dtor || dtor == (ref_dtor_t)map_dtor;
+}
+
 static SkObj *bif_make_hash(SkEnv *env, SkObj *e) {
     SkEnv *hash = sk_env_create(NULL);
     SkObj *list = sk_car(e);
@@ -1476,48 +5869,94 @@ static SkObj *bif_make_hash(SkEnv *env, SkObj *e) {
         return sk_error("make-hash expects a list of key-value pairs");
     /*  (make-hash '[(1 . 2) (3 . 4) (5 . 6)]) */
     for(; list; list = sk_cdr(list)) {
-        SkObj *pair = sk_car(list);
+        SkObj *pair = sk_car(list), *sym;
         if(!sk_is_cons(pair)) {
             rc_release(hash);
             return sk_error("make-hash expects a pair in the list");
         }
-        const char *key = sk_get_text(sk_car(pair));
-        SkObj *value = sk_cdr(pair);
-        sk_env_put(hash, key, rc_retain(value));
+        sym = sk_symbol(sk_get_text(sk_car(pair)));
+        if(!env_has_room(hash, sym)) {
+            rc_release(sym);
+            rc_release(hash);
+            return memory_error();
+        }
+        env_put(hash, sym, rc_retain(sk_cdr(pair)));
+        rc_release(sym);
     }
 
     return sk_cdata(hash, hash_table_dtor);
 }
 
+static SkObj *bif_make_immutable_hash(SkEnv *env, SkObj *e) {
+    MapNode *m = map_node(0), *n;
+    SkObj *list = sk_car(e);
+    if(!sk_is_list(list))
+        return sk_error("make-immutable-hash expects a list of key-value pairs");
+    for(; list; list = sk_cdr(list)) {
+        SkObj *pair = sk_car(list);
+        if(!sk_is_cons(pair)) {
+            rc_release(m);
+            return sk_error("make-immutable-hash expects a pair in the list");
+        }
+        n = map_set(m, sk_symbol(sk_get_text(sk_car(pair))), rc_retain(sk_cdr(pair)), 0);
+        rc_release(m);
+        m = n;
+    }
+    return sk_cdata(m, map_dtor);
+}
+
 static SkObj *bif_is_hash(SkEnv *env, SkObj *e) {
-    SkObj *hash = sk_car(e);
-    return sk_boolean(sk_get_cdtor(hash) == (ref_dtor_t)hash_table_dtor);
+    return sk_boolean(is_hash(sk_car(e)));
+}
+
+static SkObj *bif_is_immutable(SkEnv *env, SkObj *e) {
+    return sk_boolean(!!map_of(sk_car(e)));
 }
 
 static SkObj *bif_hash_set(SkEnv *env, SkObj *e) {
     SkObj *hash = sk_car(e);
-    if(sk_get_cdtor(hash) != (ref_dtor_t)hash_table_dtor)
+    if(!is_hash(hash))
         return sk_error("'hash-set' expects a hash table");
-    SkEnv *ht = sk_get_cdata(hash);
     const char *key = sk_get_text(sk_cadr(e));
     if(!key)
         return sk_error("'hash-set' expects a key");
     SkObj *value = sk_caddr(e);
 
-    sk_env_put(ht, key, rc_retain(value));
+    MapNode *m = map_of(hash);
+    if(m) {
+        /* Immutable hash tables return an updated copy */
+        return sk_cdata(map_set(m, sk_symbol(key), rc_retain(value), 0), map_dtor);
+    }
+    SkObj *sym = sk_symbol(key);
+    if(!env_has_room(sk_get_cdata(hash), sym)) {
+        rc_release(sym);
+        return memory_error();
+    }
+    env_put(sk_get_cdata(hash), sym, rc_retain(value));
+    rc_release(sym);
     return rc_retain(hash);
 }
 
+/* Finds the value of `key` in the hash table `h` */
+static SkObj **hash_find(SkObj *h, const char *key) {
+    MapNode *m = map_of(h);
+    if(m) {
+        SkObj *sym = find_symbol(symbols, key);
+        MapEntry *f = sym ? map_find(m, sym) : NULL;
+        return f ? (SkObj **)&f->value : NULL;
+    }
+    return env_findg_str(sk_get_cdata(h), key);
+}
+
 static SkObj *bif_hash_ref(SkEnv *env, SkObj *e) {
     SkObj *ho = sk_car(e);
-    if(sk_get_cdtor(ho) != (ref_dtor_t)hash_table_dtor)
+    if(!is_hash(ho))
         return sk_error("'hash-ref' expects a hash table");
-    SkEnv *ht = sk_get_cdata(ho);
     const char *key = sk_get_text(sk_cadr(e));
     if(!key)
         return sk_error("'hash-ref' expects a key");
 
-    hash_element* v = env_findg_r(ht, key);
+    SkObj **v = hash_find(ho, key);
     if(!v) {
         SkObj *fail = sk_caddr(e);
         if(!fail)
@@ -1527,32 +5966,449 @@ static SkObj *bif_hash_ref(SkEnv *env, SkObj *e) {
         else
             return rc_retain(fail);
     }
-    return rc_retain(v->ex);
+    return rc_retain(*v);
 }
 
 static SkObj *bif_hash_has_key(SkEnv *env, SkObj *e) {
     SkObj *ho = sk_car(e);
-    if(sk_get_cdtor(ho) != (ref_dtor_t)hash_table_dtor)
+    if(!is_hash(ho))
         return sk_error("'hash-has-key' expects a hash table");
-    SkEnv *ht = sk_get_cdata(ho);
     const char *key = sk_get_text(sk_cadr(e));
     if(!key)
         return sk_error("'hash-has-key' expects a key");
 
-    hash_element* v = env_findg_r(ht, key);
+    SkObj **v = hash_find(ho, key);
     return sk_boolean(!!v);
 }
 
+static SkObj *bif_hash_remove(SkEnv *env, SkObj *e) {
+    SkObj *ho = sk_car(e);
+    if(!is_hash(ho))
+        return sk_error("'hash-remove' expects a hash table");
+    const char *key = sk_get_text(sk_cadr(e));
+    if(!key)
+        return sk_error("'hash-remove' expects a key");
+
+    MapNode *m = map_of(ho);
+    if(m) {
+        SkObj *sym = find_symbol(symbols, key);
+        if(!sym)
+            return rc_retain(ho);
+        MapNode *c = map_remove(m, sym, 0);
+        if(c == m) {
+            rc_release(c);
+            return rc_retain(ho);
+        }
+        return sk_cdata(c ? c : map_node(0), map_dtor);
+    }
+    sk_env_remove(sk_get_cdata(ho), key);
+    return rc_retain(ho);
+}
+
 static SkObj *bif_hash_next(SkEnv *env, SkObj *e) {
     SkObj *ho = sk_car(e);
-    if(sk_get_cdtor(ho) != (ref_dtor_t)hash_table_dtor)
+    if(!is_hash(ho))
         return sk_error("'hash-next' expects a hash table");
-    SkEnv *ht = sk_get_cdata(ho);
-    const char *key = sk_cadr(e) ? sk_get_text(sk_cadr(e)) : NULL;
-    const char *next = sk_env_next(ht, key);
+    MapNode *m = map_of(ho);
+    SkObj *key = NULL, *next;
+    if(sk_cadr(e)) {
+        key = find_symbol(symbols, sk_get_text(sk_cadr(e)));
+        if(!key)
+            return NULL;
+    }
+    if(m) {
+        if(!key)
+            next = map_first(m);
+        else
+            next = map_find(m, key) ? map_next(m, key, 0) : NULL;
+    } else
+        next = sk_env_next(sk_get_cdata(ho), key);
     if(!next)
         return NULL;
-    return sk_value(next);
+    return sk_value(next->value);
+}
+
+static SkObj *bif_hash_count(SkEnv *env, SkObj *e) {
+    SkObj *ho = sk_car(e);
+    if(!is_hash(ho))
+        return sk_error("'hash-count' expects a hash table");
+    MapNode *m = map_of(ho);
+    if(m)
+        return sk_integer(m->size);
+    SkEnv *ht = sk_get_cdata(ho);
+    return sk_integer(ht->count);
+}
+
+enum { HASH_KEYS, HASH_VALUES, HASH_PAIRS };
+
+static void hash_list_append(SkObj *key, SkObj *value, int what, SkObj **list, SkObj **last) {
+    switch(what) {
+        case HASH_KEYS: list_append1(list, sk_value(key->value), last); break;
+        case HASH_VALUES: list_append1(list, rc_retain(value), last); break;
+        default: list_append1(list, sk_cons(sk_value(key->value), rc_retain(value)), last); break;
+    }
+}
+
+static void map_list(MapNode *m, int what, SkObj **list, SkObj **last) {
+    unsigned int i;
+    for(i = 0; i < m->n; i++) {
+        if(m->entries[i].key)
+            hash_list_append(m->entries[i].key, m->entries[i].value, what, list, last);
+        else
+            map_list(m->entries[i].value, what, list, last);
+    }
+}
+
+/* Lists the keys, values or key-value pairs of a hash table in the order
+that they were added, or in the order of the trie if it is immutable */
+static SkObj *hash_list(SkObj *ho, int what) {
+    SkObj *result = NULL, *last = NULL;
+    MapNode *m = map_of(ho);
+    if(m)
+        map_list(m, what, &result, &last);
+    else {
+        SkEnv *ht = sk_get_cdata(ho);
+        hash_element *f;
+        for(f = next_element(ht, NULL); f; f = next_element(ht, f))
+            hash_list_append(f->sym, f->ex, what, &result, &last);
+    }
+    return result;
+}
+
+static SkObj *bif_hash_keys(SkEnv *env, SkObj *e) {
+    if(!is_hash(sk_car(e)))
+        return sk_error("'hash-keys' expects a hash table");
+    return hash_list(sk_car(e), HASH_KEYS);
+}
+
+static SkObj *bif_hash_values(SkEnv *env, SkObj *e) {
+    if(!is_hash(sk_car(e)))
+        return sk_error("'hash-values' expects a hash table");
+    return hash_list(sk_car(e), HASH_VALUES);
+}
+
+static SkObj *bif_hash_to_list(SkEnv *env, SkObj *e) {
+    if(!is_hash(sk_car(e)))
+        return sk_error("'hash->list' expects a hash table");
+    return hash_list(sk_car(e), HASH_PAIRS);
+}
+
+/* Calls `f` with the values `a`, `b` and `c` (if they aren't NULL). The
+arguments are quoted, so that they aren't evaluated again by the call */
+static SkObj *call_values(SkEnv *env, SkObj *f, SkObj *a, SkObj *b, SkObj *c) {
+    SkObj *quote = sk_symbol("quote"), *args = NULL, *values[3], *r;
+    int i;
+    values[0] = a;
+    values[1] = b;
+    values[2] = c;
+    for(i = 2; i >= 0; i--) {
+        if(values[i])
+            args = sk_cons(sk_cons(rc_retain(quote), sk_cons(rc_retain(values[i]), NULL)), args);
+    }
+    r = sk_apply(env, f, args);
+    rc_release(args);
+    rc_release(quote);
+    return r;
+}
+
+static SkObj *bif_hash_map(SkEnv *env, SkObj *e) {
+    SkObj *ho = sk_car(e), *f = sk_cadr(e), *result = NULL, *last = NULL;
+    if(!is_hash(ho) || !sk_is_procedure(f))
+        return sk_error("'hash-map' expects a hash table and a procedure");
+    /* `proc` may change the table, and elements move while a table is
+    resized, so the pairs are listed before any of them is visited */
+    SkObj *pairs = hash_list(ho, HASH_PAIRS), *p;
+    for(p = pairs; p; p = p->cdr) {
+        SkObj *res = call_values(env, f, p->car->car, p->car->cdr, NULL);
+        if(sk_is_error(res)) {
+            rc_release(result);
+            result = res;
+            break;
+        }
+        list_append1(&result, res, &last);
+    }
+    rc_release(pairs);
+    return result;
+}
+
+/* Sorted maps are CData objects of the SortedMap type */
+
+static void sorted_map_cdtor(void *p) {
+    rc_release(p);
+}
+
+static SortedMap *sorted_map_of(SkObj *e) {
+    return sk_get_cdtor(e) == (ref_dtor_t)sorted_map_cdtor ? sk_get_cdata(e) : NULL;
+}
+
+static SkObj *bif_make_sorted_map(SkEnv *env, SkObj *e) {
+    SkObj *list = sk_car(e);
+    if(!sk_is_list(list))
+        return sk_error("make-sorted-map expects a list of key-value pairs");
+    SortedMap *m = sorted_map_create();
+    for(; list; list = sk_cdr(list)) {
+        SkObj *pair = sk_car(list);
+        if(!sk_is_cons(pair) || !pair->car) {
+            rc_release(m);
+            return sk_error("make-sorted-map expects a pair in the list");
+        }
+        smap_set(m, rc_retain(pair->car), rc_retain(pair->cdr));
+    }
+    return sk_cdata(m, sorted_map_cdtor);
+}
+
+static SkObj *bif_is_sorted_map(SkEnv *env, SkObj *e) {
+    return sk_boolean(!!sorted_map_of(sk_car(e)));
+}
+
+static SkObj *bif_sorted_map_set(SkEnv *env, SkObj *e) {
+    SortedMap *m = sorted_map_of(sk_car(e));
+    if(!m)
+        return sk_error("'sorted-map-set' expects a sorted map");
+    if(!sk_cadr(e))
+        return sk_error("'sorted-map-set' expects a key");
+    smap_set(m, rc_retain(sk_cadr(e)), rc_retain(sk_caddr(e)));
+    return rc_retain(sk_car(e));
+}
+
+static SkObj *bif_sorted_map_ref(SkEnv *env, SkObj *e) {
+    SortedMap *m = sorted_map_of(sk_car(e));
+    if(!m)
+        return sk_error("'sorted-map-ref' expects a sorted map");
+    if(!sk_cadr(e))
+        return sk_error("'sorted-map-ref' expects a key");
+    SkObj **v = smap_find(m, sk_cadr(e));
+    if(!v) {
+        SkObj *fail = sk_caddr(e);
+        if(!fail)
+            return sk_errorf("no mapping for '%s' in sorted map", sk_get_text(sk_cadr(e)));
+        if(sk_is_procedure(fail))
+            return sk_apply(env, fail, NULL);
+        else
+            return rc_retain(fail);
+    }
+    return rc_retain(*v);
+}
+
+static SkObj *bif_sorted_map_has_key(SkEnv *env, SkObj *e) {
+    SortedMap *m = sorted_map_of(sk_car(e));
+    if(!m)
+        return sk_error("'sorted-map-has-key' expects a sorted map");
+    return sk_boolean(sk_cadr(e) && smap_find(m, sk_cadr(e)));
+}
+
+static SkObj *bif_sorted_map_remove(SkEnv *env, SkObj *e) {
+    SortedMap *m = sorted_map_of(sk_car(e));
+    if(!m)
+        return sk_error("'sorted-map-remove' expects a sorted map");
+    if(sk_cadr(e))
+        smap_remove(m, sk_cadr(e));
+    return rc_retain(sk_car(e));
+}
+
+static SkObj *bif_sorted_map_count(SkEnv *env, SkObj *e) {
+    SortedMap *m = sorted_map_of(sk_car(e));
+    if(!m)
+        return sk_error("'sorted-map-count' expects a sorted map");
+    return sk_integer(m->count);
+}
+
+/* The first key that is not less than `key` (or greater than it, if
+`after` is set), or the first key if `key` is NULL */
+static SkObj *sorted_map_seek(SkObj *e, const char *name, int after) {
+    SortedMap *m = sorted_map_of(sk_car(e));
+    SMapKey key;
+    unsigned int i;
+    if(!m)
+        return sk_errorf("'%s' expects a sorted map", name);
+    if(sk_cadr(e))
+        key = smap_key(sk_cadr(e));
+    SMapNode *leaf = smap_seek(m, sk_cadr(e) ? &key : NULL, after, &i);
+    return leaf ? rc_retain(leaf->keys[i].obj) : NULL;
+}
+
+static SkObj *bif_sorted_map_lower_bound(SkEnv *env, SkObj *e) {
+    return sorted_map_seek(e, "sorted-map-lower-bound", 0);
+}
+
+static SkObj *bif_sorted_map_next(SkEnv *env, SkObj *e) {
+    return sorted_map_seek(e, "sorted-map-next", 1);
+}
+
+/* Lists the keys (or key-value pairs, if `pairs` is set) from `lo` up to,
+but not including, `hi`. `lo` and `hi` can be NULL for no bound */
+static SkObj *sorted_map_list(SortedMap *m, SkObj *lo, SkObj *hi, int pairs) {
+    SkObj *result = NULL, *last = NULL;
+    SMapKey lk, hk;
+    SMapNode *leaf;
+    unsigned int i;
+    if(lo)
+        lk = smap_key(lo);
+    if(hi)
+        hk = smap_key(hi);
+    for(leaf = smap_seek(m, lo ? &lk : NULL, 0, &i); leaf; leaf = leaf->next, i = 0) {
+        for(; i < leaf->n; i++) {
+            if(hi && smap_compare(&leaf->keys[i], &hk) >= 0)
+                return result;
+            if(pairs)
+                list_append1(&result, sk_cons(rc_retain(leaf->keys[i].obj), rc_retain(leaf->values[i])), &last);
+            else
+                list_append1(&result, rc_retain(leaf->keys[i].obj), &last);
+        }
+    }
+    return result;
+}
+
+static SkObj *bif_sorted_map_keys(SkEnv *env, SkObj *e) {
+    SortedMap *m = sorted_map_of(sk_car(e));
+    if(!m)
+        return sk_error("'sorted-map-keys' expects a sorted map");
+    return sorted_map_list(m, NULL, NULL, 0);
+}
+
+static SkObj *bif_sorted_map_to_list(SkEnv *env, SkObj *e) {
+    SortedMap *m = sorted_map_of(sk_car(e));
+    if(!m)
+        return sk_error("'sorted-map->list' expects a sorted map");
+    return sorted_map_list(m, NULL, NULL, 1);
+}
+
+static SkObj *bif_sorted_map_range(SkEnv *env, SkObj *e) {
+    SortedMap *m = sorted_map_of(sk_car(e));
+    if(!m)
+        return sk_error("'sorted-map-range' expects a sorted map");
+    return sorted_map_list(m, sk_cadr(e), sk_caddr(e), 1);
+}
+
+static SkObj *bif_sorted_map_fold(SkEnv *env, SkObj *e) {
+    SortedMap *m = sorted_map_of(sk_car(e));
+    SkObj *f = sk_cadr(e), *acc = sk_caddr(e), *args = sk_cdr(sk_cddr(e)), *lo, *hi;
+    SMapKey lk, hk;
+    SMapNode *leaf;
+    unsigned int i;
+    if(!m || !sk_is_procedure(f))
+        return sk_error("'sorted-map-fold' expects a sorted map and a procedure");
+    lo = sk_car(args);
+    hi = sk_cadr(args);
+    if(lo)
+        lk = smap_key(lo);
+    if(hi)
+        hk = smap_key(hi);
+    rc_retain(acc);
+    leaf = smap_seek(m, lo ? &lk : NULL, 0, &i);
+    while(leaf) {
+        if(hi && smap_compare(&leaf->keys[i], &hk) >= 0)
+            break;
+        SkObj *key = rc_retain(leaf->keys[i].obj), *res;
+        unsigned int version = m->version;
+        res = call_values(env, f, key, leaf->values[i], acc);
+        rc_release(acc);
+        acc = res;
+        if(sk_is_error(res)) {
+            rc_release(key);
+            break;
+        }
+        if(m->version == version) {
+            if(++i == leaf->n) {
+                leaf = leaf->next;
+                i = 0;
+            }
+        } else {
+            /* `f` added or removed keys, so the leaves may have changed */
+            SMapKey k = smap_key(key);
+            leaf = smap_seek(m, &k, 1, &i);
+        }
+        rc_release(key);
+    }
+    return acc;
+}
+
+/* Vectors keep their items in a contiguous array, so that they can be
+indexed in constant time. Like lists, they can't be changed once created */
+
+static SkObj *bif_vector(SkEnv *env, SkObj *e) {
+    return sk_vector(e);
+}
+
+static SkObj *bif_is_vector(SkEnv *env, SkObj *e) {
+    return sk_boolean(sk_is_vector(sk_car(e)));
+}
+
+static SkObj *bif_make_vector(SkEnv *env, SkObj *e) {
+    long long n;
+    unsigned int i;
+    if(!exact_integer(sk_car(e), &n) || n < 0 || n > INT_MAX)
+        return sk_error("'make-vector' expects a length");
+    SkObj *v = vector_create((unsigned int)n), *fill = sk_cadr(e);
+    if(!v)
+        return memory_error();
+    for(i = 0; i < v->length; i++)
+        v->items[i] = rc_retain(fill);
+    return v;
+}
+
+static SkObj *bif_vector_ref(SkEnv *env, SkObj *e) {
+    SkObj *v = sk_car(e);
+    long long i;
+    if(!sk_is_vector(v) || !exact_integer(sk_cadr(e), &i))
+        return sk_error("'vector-ref' expects a vector and an index");
+    if(i < 0 || i >= v->length)
+        return sk_errorf("'vector-ref' index %lld out of range", i);
+    return rc_retain(v->items[i]);
+}
+
+static SkObj *bif_vector_length(SkEnv *env, SkObj *e) {
+    if(!sk_is_vector(sk_car(e)))
+        return sk_error("'vector-length' expects a vector");
+    return sk_integer(sk_car(e)->length);
+}
+
+static SkObj *bif_list_to_vector(SkEnv *env, SkObj *e) {
+    if(!sk_is_list(sk_car(e)))
+        return sk_error("'list->vector' expects a list");
+    return sk_vector(sk_car(e));
+}
+
+static SkObj *bif_vector_to_list(SkEnv *env, SkObj *e) {
+    SkObj *v = sk_car(e), *result = NULL, *last = NULL;
+    unsigned int i;
+    if(!sk_is_vector(v))
+        return sk_error("'vector->list' expects a vector");
+    for(i = 0; i < v->length; i++)
+        list_append1(&result, rc_retain(v->items[i]), &last);
+    return result;
+}
+
+static SkObj *bif_vector_map(SkEnv *env, SkObj *e) {
+    SkObj *f = sk_car(e), *v = sk_cadr(e), *result;
+    unsigned int i;
+    if(!sk_is_procedure(f) || !sk_is_vector(v))
+        return sk_error("'vector-map' expects a procedure and a vector");
+    if(!(result = vector_create(v->length)))
+        return memory_error();
+    for(i = 0; i < v->length; i++) {
+        SkObj *res = call_values(env, f, v->items[i], NULL, NULL);
+        if(sk_is_error(res)) {
+            rc_release(result);
+            return res;
+        }
+        result->items[i] = res;
+    }
+    return result;
+}
+
+static SkObj *bif_vector_for_each(SkEnv *env, SkObj *e) {
+    SkObj *f = sk_car(e), *v = sk_cadr(e);
+    unsigned int i;
+    if(!sk_is_procedure(f) || !sk_is_vector(v))
+        return sk_error("'vector-for-each' expects a procedure and a vector");
+    for(i = 0; i < v->length; i++) {
+        SkObj *res = call_values(env, f, v->items[i], NULL, NULL);
+        if(sk_is_error(res))
+            return res;
+        rc_release(res);
+    }
+    return NULL;
 }
 
 #define TEXT_LIB(g,t) do {SkObj *x=sk_eval_str(g,t);assert(!sk_is_error(x));rc_release(x);} while(0)
@@ -1560,74 +6416,86 @@ static SkObj *bif_hash_next(SkEnv *env, SkObj *e) {
 /** ## Built-in Functions */
 SkEnv *sk_global_env() {
     SkEnv *global = sk_env_createn(NULL, 512);
+    unsigned int account;
+
+    /* The library is charged to the interpreter as well */
+    global->account = rc_account_create();
+    account = rc_account_use(global->account);
+    /* Until another interpreter is used, `sk_parse()` on
+    this thread interns its symbols in the new one */
+    global->symbols = symbols_create();
+    symbols_release(symbols_use(global->symbols));
+    global->closures = closures_create();
 
     /** `(serialize val)` - Serializes a value into a string */
-    sk_env_put(global, "serialize", sk_cfun(bif_serialize));
+    sk_env_put(global, "serialize", pure_cfun(bif_serialize));
     /** `(write val)` - writes a serialized value to `stdout` */
     TEXT_LIB(global,"(define (write val) (display (serialize val)))");
     /** `(display str)` - writes string to `stdout` */
-    sk_env_put(global, "display", sk_cfun(bif_display));
+    sk_env_put(global, "display", pure_cfun(bif_display));
     /** `(cons car cdr)` - Creates a cons cell with the given car and cdr */
-    sk_env_put(global, "cons", sk_cfun(bif_cons));
+    sk_env_put(global, "cons", pure_cfun(bif_cons));
     /** `(car c)` - returns the car of the cons cell `c` */
-    sk_env_put(global, "car", sk_cfun(bif_car));
+    sk_env_put(global, "car", pure_cfun(bif_car));
     /** `(cdr c)` - returns the cdr of the cons cell `c` */
-    sk_env_put(global, "cdr", sk_cfun(bif_cdr));
+    sk_env_put(global, "cdr", pure_cfun(bif_cdr));
     /** `(caar c)`, `(cadr c)`, `(cdar c)`, `(cddr c)` - extensions around `car` and `cdr` */
     TEXT_LIB(global,"(define (caar x) (car (car x)))");
     TEXT_LIB(global,"(define (cadr x) (car (cdr x)))");
     TEXT_LIB(global,"(define (cdar x) (cdr (car x)))");
     TEXT_LIB(global,"(define (cddr x) (cdr (cdr x)))");
     /** `(list e1 e2 e3...)` - Creates a list consisting of `e1`, `e2`, `e3` etc */
-    sk_env_put(global, "list", sk_cfun(bif_list));
+    sk_env_put(global, "list", pure_cfun(bif_list));
     /** `(length L)` - finds the length of the list `L` */
-    sk_env_put(global, "length", sk_cfun(bif_length));
+    sk_env_put(global, "length", pure_cfun(bif_length));
 
     /** `(list? x)` - returns `#t` if `x` is a list */
-    sk_env_put(global, "list?", sk_cfun(bif_is_list));
+    sk_env_put(global, "list?", pure_cfun(bif_is_list));
     /** `(null? x)` - returns `#t` if `x` is null (also represented as `'()`) */
-    sk_env_put(global, "null?", sk_cfun(bif_is_null));
+    sk_env_put(global, "null?", pure_cfun(bif_is_null));
     /** `(symbol? x)` - returns `#t` if `x` is a symbol */
-    sk_env_put(global, "symbol?", sk_cfun(bif_is_symbol));
+    sk_env_put(global, "symbol?", pure_cfun(bif_is_symbol));
     /** `(pair? x)` - returns `#t` if `x` is a pair (a cons cell) */
-    sk_env_put(global, "pair?", sk_cfun(bif_is_pair));
+    sk_env_put(global, "pair?", pure_cfun(bif_is_pair));
     /** `(procedure? x)` - returns `#t` if `x` is a callable procedure (a lambda or a CFun object) */
-    sk_env_put(global, "procedure?", sk_cfun(bif_is_procedure));
+    sk_env_put(global, "procedure?", pure_cfun(bif_is_procedure));
     /** `(cdata? x)` - returns `#t` if `x` is a CData object */
-    sk_env_put(global, "cdata?", sk_cfun(bif_is_cdata));
+    sk_env_put(global, "cdata?", pure_cfun(bif_is_cdata));
     /** `(value? x)` - returns `#t` if `x` is a value object */
-    sk_env_put(global, "value?", sk_cfun(bif_is_value));
+    sk_env_put(global, "value?", pure_cfun(bif_is_value));
     /** `(string? x)` - returns `#t` if `x` is a string value object */
     TEXT_LIB(global,"(define (string? x) (and (value? x) (not (number? x))))");
     /** `(number? x)` - returns `#t` if `x` is a number value object */
-    sk_env_put(global, "number?", sk_cfun(bif_is_number));
+    sk_env_put(global, "number?", pure_cfun(bif_is_number));
+    /** `(integer? x)` - returns `#t` if `x` is an exact integer */
+    sk_env_put(global, "integer?", pure_cfun(bif_is_integer));
     /** `(zero? x)` - returns `#t` if `x` is 0 */
     TEXT_LIB(global,"(define (zero? x) (and (number? x) (= 0 x)))");
     /** `(boolean? x)` - returns `#t` if `x` is a boolean object (`#t` or `#f`) */
-    sk_env_put(global, "boolean?", sk_cfun(bif_is_boolean));
+    sk_env_put(global, "boolean?", pure_cfun(bif_is_boolean));
     /** `(true? x)` - returns `#t` if `x` evaluates to truth */
     TEXT_LIB(global,"(define (true? x) (if x #t #f))");
 
     /** `(equal? x y)` - Compares `x` and `y` for equality */
-    sk_env_put(global, "equal?", sk_cfun(bif_equal));
+    sk_env_put(global, "equal?", pure_cfun(bif_equal));
     /** `(eq? x y)` - returns true if and only if `x` and `y` references the same object */
-    sk_env_put(global, "eq?", sk_cfun(bif_eq));
+    sk_env_put(global, "eq?", pure_cfun(bif_eq));
     /** `(not x)` - logical not. Returns `#f` if and only if `x` evaluates to `#t` */
-    sk_env_put(global, "not", sk_cfun(bif_not));
+    sk_env_put(global, "not", pure_cfun(bif_not));
     /** `(apply f '(arg1 arg2))` - Applies a function to the given arguments */
     sk_env_put(global, "apply", sk_cfun(bif_apply));
     /** `(+ v1 v2...)`, `(- v1 v2...)`, `(* v1 v2...)`, `(/ v1 v2...)`, `(% v1 v2...)` - Arithmetic operators */
-    sk_env_put(global, "+", sk_cfun(bif_add));
-    sk_env_put(global, "-", sk_cfun(bif_sub));
-    sk_env_put(global, "*", sk_cfun(bif_mul));
-    sk_env_put(global, "/", sk_cfun(bif_div));
-    sk_env_put(global, "%", sk_cfun(bif_mod));
+    sk_env_put(global, "+", pure_cfun(bif_add));
+    sk_env_put(global, "-", pure_cfun(bif_sub));
+    sk_env_put(global, "*", pure_cfun(bif_mul));
+    sk_env_put(global, "/", pure_cfun(bif_div));
+    sk_env_put(global, "%", pure_cfun(bif_mod));
     /** `(= v1 v2)`, `(> v1 v2)`, `(< v1 v2)`, `(>= v1 v2)`, `(<= v1 v2)` - Comparison operators */
-    sk_env_put(global, "=", sk_cfun(bif_number_eq));
-    sk_env_put(global, ">", sk_cfun(bif_gt));
-    sk_env_put(global, "<", sk_cfun(bif_lt));
-    sk_env_put(global, ">=", sk_cfun(bif_ge));
-    sk_env_put(global, "<=", sk_cfun(bif_le));
+    sk_env_put(global, "=", pure_cfun(bif_number_eq));
+    sk_env_put(global, ">", pure_cfun(bif_gt));
+    sk_env_put(global, "<", pure_cfun(bif_lt));
+    sk_env_put(global, ">=", pure_cfun(bif_ge));
+    sk_env_put(global, "<=", pure_cfun(bif_le));
     /** `(map f L)` - Returns a list where each element is the result of the function `f` applied to the
      * corresponding element in the list `L` */
     sk_env_put(global, "map", sk_cfun(bif_map));
@@ -1647,7 +6515,7 @@ SkEnv *sk_global_env() {
     TEXT_LIB(global,"(define (member x l) [if (null? l) #f [if (equal? x (car l)) l (member x (cdr l)) ]] )");
 
     /** `(append L1 L2)` - Returns containing the elements of `L1` and `L2` */
-    sk_env_put(global, "append", sk_cfun(bif_append));
+    sk_env_put(global, "append", pure_cfun(bif_append));
 
     /** `(reverse L)` - Reverses a list `L` */
     TEXT_LIB(global,"(define (reverse l) (fold cons '() l))");
@@ -1656,28 +6524,49 @@ SkEnv *sk_global_env() {
     /** `(nth n L)` - Returns the `n`-th element of the list `L` */
     TEXT_LIB(global,"(define (nth n L) (if (or (null? L) (< n 0)) '() (if (= n 1) (car L) (nth (- n 1) (cdr L)))))");
 
+    /** `(vector e1 e2 e3...)` - Creates a vector consisting of `e1`, `e2`, `e3` etc.
+     * Vectors can also be written as `#(e1 e2 e3)` */
+    sk_env_put(global, "vector", pure_cfun(bif_vector));
+    /** `(vector? x)` - returns `#t` if `x` is a vector */
+    sk_env_put(global, "vector?", pure_cfun(bif_is_vector));
+    /** `(make-vector k [fill])` - Creates a vector of `k` elements that are all `fill` (or `'()`) */
+    sk_env_put(global, "make-vector", pure_cfun(bif_make_vector));
+    /** `(vector-ref V k)` - Returns the element at index `k` of the vector `V`, counting from 0 */
+    sk_env_put(global, "vector-ref", pure_cfun(bif_vector_ref));
+    /** `(vector-length V)` - Returns the number of elements in the vector `V` */
+    sk_env_put(global, "vector-length", pure_cfun(bif_vector_length));
+    /** `(list->vector L)` - Returns a vector with the elements of the list `L` */
+    sk_env_put(global, "list->vector", pure_cfun(bif_list_to_vector));
+    /** `(vector->list V)` - Returns a list with the elements of the vector `V` */
+    sk_env_put(global, "vector->list", pure_cfun(bif_vector_to_list));
+    /** `(vector-map f V)` - Returns a vector where each element is the result of the function `f`
+     * applied to the corresponding element in the vector `V` */
+    sk_env_put(global, "vector-map", sk_cfun(bif_vector_map));
+    /** `(vector-for-each f V)` - Calls the function `f` on each element of the vector `V`, in order */
+    sk_env_put(global, "vector-for-each", sk_cfun(bif_vector_for_each));
+
     /** `(string-length s)` - returns the length of the string `s` */
-    sk_env_put(global, "string-length?", sk_cfun(bif_string_length));
+    sk_env_put(global, "string-length?", pure_cfun(bif_string_length));
     /** `(string-append s1 s2...)` - Appends all parameters into a new string. */
-    sk_env_put(global, "string-append", sk_cfun(bif_string_append));
+    sk_env_put(global, "string-append", pure_cfun(bif_string_append));
     /** `(string-replace str find repl)` - Replaces all occurances of `find` in the string `str` with `repl` */
-    sk_env_put(global, "string-replace", sk_cfun(bif_string_replace));
+    sk_env_put(global, "string-replace", pure_cfun(bif_string_replace));
     /** `(string-split str sep)` - Splits a string `str` into a list of substrings */
-    sk_env_put(global, "string-split", sk_cfun(bif_string_split));
+    sk_env_put(global, "string-split", pure_cfun(bif_string_split));
     /** `(substring str start [end])` - Retrieves the substring of `str` between `start` and `end`. */
-    sk_env_put(global, "substring", sk_cfun(bif_substring));
+    sk_env_put(global, "substring", pure_cfun(bif_substring));
     /** `(string-upcase str)` - Converts a string `str` to uppercase */
-    sk_env_put(global, "string-upcase", sk_cfun(bif_string_upcase));
+    sk_env_put(global, "string-upcase", pure_cfun(bif_string_upcase));
     /** `(string-downcase str)` - Converts a string `str` to lowercase */
-    sk_env_put(global, "string-downcase", sk_cfun(bif_string_downcase));
+    sk_env_put(global, "string-downcase", pure_cfun(bif_string_downcase));
     /** `(string-ascii c)` - Returns the ASCII value of the first character in the string `c` */
-    sk_env_put(global, "string-ascii", sk_cfun(bif_string_ascii));
+    sk_env_put(global, "string-ascii", pure_cfun(bif_string_ascii));
     /** `(string-char a)` - Converts the ASCII value `a` to a string */
-    sk_env_put(global, "string-char", sk_cfun(bif_string_char));
+    sk_env_put(global, "string-char", pure_cfun(bif_string_char));
     /** `(string-trim s)` - Trims whitespace from the start and end of a string `s` */
-    sk_env_put(global, "string-trim", sk_cfun(bif_string_trim));
+    sk_env_put(global, "string-trim", pure_cfun(bif_string_trim));
     /** `(string-find h n)` - Searches for the substring `n` in the string `h` and returns the position, `'()` if not found. */
-    sk_env_put(global, "string-find", sk_cfun(bif_string_find));
+    sk_env_put(global, "string-find", pure_cfun(bif_string_find));
 
     /** `(string-contains? h n)` - Returns `#t` if the string `h` contains the substring `n`. */
     TEXT_LIB(global,"(define (string-contains? h n) (not (null? (string-find h n))))");
@@ -1688,8 +6577,8 @@ SkEnv *sk_global_env() {
     /** `(non-empty-string? s)` - Returns `#t` if the string is not empty. */
     TEXT_LIB(global,"(define (non-empty-string? s) (not (= 0 (string-length? s))))");
     /** `(string=? s1 s2)`, `(string<? s1 s2)`, `(string<=? s1 s2)`, `(string>? s1 s2)` and `(string>=? s1 s2)` - string comparisons between `s1` and `s2` */
-    sk_env_put(global, "string=?", sk_cfun(bif_string_eq));
-    sk_env_put(global, "string<?", sk_cfun(bif_string_lt));
+    sk_env_put(global, "string=?", pure_cfun(bif_string_eq));
+    sk_env_put(global, "string<?", pure_cfun(bif_string_lt));
     TEXT_LIB(global,"(define (string<=? a b) (or (string<? a b) (string=? a b)))");
     TEXT_LIB(global,"(define (string>? a b) (not (string<=? a b)))");
     TEXT_LIB(global,"(define (string>=? a b) (not (string<? a b)))");
@@ -1700,65 +6589,79 @@ SkEnv *sk_global_env() {
     TEXT_LIB(global,"(define (min . args) (fold (lambda (a b) (if (< a b) a b)) (car args) (cdr args)))");
 
     /** `(sin x)` - sine of `x` */
-    sk_env_put(global, "sin", sk_cfun(bif_sin));
+    sk_env_put(global, "sin", pure_cfun(bif_sin));
     /** `(cos x)` - cosine of `x` */
-    sk_env_put(global, "cos", sk_cfun(bif_cos));
+    sk_env_put(global, "cos", pure_cfun(bif_cos));
     /** `(tan x)` - tangent of `x` */
-    sk_env_put(global, "tan", sk_cfun(bif_tan));
+    sk_env_put(global, "tan", pure_cfun(bif_tan));
     /** `(asin x)` - arc-sine of `x` */
-    sk_env_put(global, "asin", sk_cfun(bif_asin));
+    sk_env_put(global, "asin", pure_cfun(bif_asin));
     /** `(acos x)` - arc-cosine of `x` */
-    sk_env_put(global, "acos", sk_cfun(bif_acos));
+    sk_env_put(global, "acos", pure_cfun(bif_acos));
     /** `(atan p)` or `(atan y x)` - arc-tangent of `p` or `y/x` */
-    sk_env_put(global, "atan", sk_cfun(bif_atan));
+    sk_env_put(global, "atan", pure_cfun(bif_atan));
     /** `(log x)` - natural logartihm of `x` */
-    sk_env_put(global, "log", sk_cfun(bif_log));
+    sk_env_put(global, "log", pure_cfun(bif_log));
     /** `(exp x)` - exponential of `x` */
-    sk_env_put(global, "exp", sk_cfun(bif_exp));
+    sk_env_put(global, "exp", pure_cfun(bif_exp));
     /** `(sqrt x)` - square root of `x` */
-    sk_env_put(global, "sqrt", sk_cfun(bif_sqrt));
+    sk_env_put(global, "sqrt", pure_cfun(bif_sqrt));
     /** `(ceil x)` - ceiling of `x` */
-    sk_env_put(global, "ceil", sk_cfun(bif_ceil));
+    sk_env_put(global, "ceil", pure_cfun(bif_ceil));
     /** `(floor x)` - floor of `x` */
-    sk_env_put(global, "floor", sk_cfun(bif_floor));
+    sk_env_put(global, "floor", pure_cfun(bif_floor));
     /** `(abs x)` - absolute value of `x` */
-    sk_env_put(global, "abs", sk_cfun(bif_fabs));
+    sk_env_put(global, "abs", pure_cfun(bif_abs));
     /** `(pow x y)` - `x` raised to the power of `y` */
-    sk_env_put(global, "pow", sk_cfun(bif_pow));
+    sk_env_put(global, "pow", pure_cfun(bif_pow));
     /** `pi` - 3.14159... */
     sk_env_put(global, "pi", sk_number(M_PI));
 
     /** `(make-hash [mappings])` - creates a hash table. The optional parameter `mappings`
      * is a list of key-value pairs. For example `(make-hash '[("a" . 2) ("b" . 4) ("c" . 6) ])`
      */
-    sk_env_put(global, "make-hash", sk_cfun(bif_make_hash));
+    sk_env_put(global, "make-hash", pure_cfun(bif_make_hash));
+    /** `(make-immutable-hash [mappings])` - creates an immutable hash table, like `make-hash`.
+     * `hash-set` and `hash-remove` return an updated copy of an immutable hash table instead of
+     * changing it, and the copy shares most of its memory with the original.
+     * The other `hash-` functions work on both kinds of hash tables, but the keys of an
+     * immutable hash table are not in the order that they were added.
+     */
+    sk_env_put(global, "make-immutable-hash", pure_cfun(bif_make_immutable_hash));
     /** `(hash? h)` - checks whether `h` is a hash table */
-    sk_env_put(global, "hash?", sk_cfun(bif_is_hash));
-    /** `(hash-set h k v)` - sets the value associated with `k` to `v` in hash table `h`. */
-    sk_env_put(global, "hash-set", sk_cfun(bif_hash_set));
+    sk_env_put(global, "hash?", pure_cfun(bif_is_hash));
+    /** `(immutable? h)` - checks whether `h` is an immutable hash table */
+    sk_env_put(global, "immutable?", pure_cfun(bif_is_immutable));
+    /** `(hash-set h k v)` - sets the value associated with `k` to `v` in hash table `h`,
+     * and returns `h`, or a copy of `h` with the new value if it is immutable. */
+    sk_env_put(global, "hash-set", pure_cfun(bif_hash_set));
     /** `(hash-ref h k [fail])` - retrieves the value associated with `k` in hash table `h`.
      * If `k` is not found: if `fail` is a procedure, `fail` is called and its result returned,
      * otherwise `fail` is returned directly. */
     sk_env_put(global, "hash-ref", sk_cfun(bif_hash_ref));
     /** `(hash-has-key h k)` - Returns `#t` if key `k` is in hash table `h`, `#f` otherwise. */
-    sk_env_put(global, "hash-has-key", sk_cfun(bif_hash_has_key));
+    sk_env_put(global, "hash-has-key", pure_cfun(bif_hash_has_key));
+    /** `(hash-remove h k)` - removes the key `k` and its value from the hash table `h`, if it is there.
+     * It returns `h`, or a copy of `h` without `k` if `h` is immutable. */
+    sk_env_put(global, "hash-remove", pure_cfun(bif_hash_remove));
 
     /** `(hash-next h k)` - returns the next key after `k` in the hash table `h`.
      * If `k` is `'()` the first key is returned. It will return null if `k` is the last key.
+     * The keys of a hash table are in the order that they were added.
      */
-    sk_env_put(global, "hash-next", sk_cfun(bif_hash_next));
+    sk_env_put(global, "hash-next", pure_cfun(bif_hash_next));
 
     /** `(hash-map h proc)` - Calls the function `(proc k v)` on each key-value pair `k,v` in the
-     * hash table `h`, and returns a list of the results */
-    TEXT_LIB(global, "(define (hash-map h proc) [let [(iter (lambda (h i acc) (let* [(j (hash-next h i))] (if (null? j) acc (iter h j (append acc [list (proc j (hash-ref h j))])) ))))] (iter h '() '())])");
+     * hash table `h`, in the order they were added, and returns a list of the results */
+    sk_env_put(global, "hash-map", sk_cfun(bif_hash_map));
     /** `(hash-keys h)` - Returns a list of all the keys in the hash table `h` */
-    TEXT_LIB(global, "(define (hash-keys h) (hash-map h (lambda (k v) k )))");
+    sk_env_put(global, "hash-keys", pure_cfun(bif_hash_keys));
     /** `(hash-values h)` - Returns a list of all the values in the hash table `h` */
-    TEXT_LIB(global, "(define (hash-values h) (hash-map h (lambda (k v) v )))");
+    sk_env_put(global, "hash-values", pure_cfun(bif_hash_values));
     /** `(hash->list h)` - Returns a list of the key-value pairs in the hash table `h` */
-    TEXT_LIB(global, "(define (hash->list h) (hash-map h (lambda (k v) (cons k v) )))");
+    sk_env_put(global, "hash->list", pure_cfun(bif_hash_to_list));
     /** `(hash-count h)` - Returns the number of key-value pairs in the hash table `h` */
-    TEXT_LIB(global, "(define (hash-count h) (length (hash-keys h)))");
+    sk_env_put(global, "hash-count", pure_cfun(bif_hash_count));
     /** `(hash-empty? h)` - returns `#t` if the hash table `h` is empty, `#f` otherwise */
     TEXT_LIB(global, "(define (hash-empty? h) (zero? (hash-count h)))");
     /** `(hash->string h)` - Returns a string representation of the hash table `h` */
@@ -1766,5 +6669,42 @@ SkEnv *sk_global_env() {
     /** `(hash-display h)` - Displays the contents of the hash table `h` */
     TEXT_LIB(global, "(define (hash-display h) (display (hash->string h)))");
 
+    /** `(make-sorted-map [mappings])` - Creates a sorted map, optionally populated with the
+     * key-value pairs in the list `mappings`. Numeric keys are ordered by their values and come
+     * before all other keys, which are ordered by their text */
+    sk_env_put(global, "make-sorted-map", pure_cfun(bif_make_sorted_map));
+    /** `(sorted-map? m)` - Returns `#t` if `m` is a sorted map, `#f` otherwise */
+    sk_env_put(global, "sorted-map?", pure_cfun(bif_is_sorted_map));
+    /** `(sorted-map-set m k v)` - Maps the key `k` to `v` in the sorted map `m`, and returns `m` */
+    sk_env_put(global, "sorted-map-set", pure_cfun(bif_sorted_map_set));
+    /** `(sorted-map-ref m k [fail])` - Returns the value mapped to `k` in the sorted map `m`.
+     * If there is no such key, it returns `fail` (or calls it, if it is a procedure) */
+    sk_env_put(global, "sorted-map-ref", sk_cfun(bif_sorted_map_ref));
+    /** `(sorted-map-has-key m k)` - Returns `#t` if the sorted map `m` contains the key `k` */
+    sk_env_put(global, "sorted-map-has-key", pure_cfun(bif_sorted_map_has_key));
+    /** `(sorted-map-remove m k)` - Removes the key `k` from the sorted map `m`, and returns `m` */
+    sk_env_put(global, "sorted-map-remove", pure_cfun(bif_sorted_map_remove));
+    /** `(sorted-map-count m)` - Returns the number of keys in the sorted map `m` */
+    sk_env_put(global, "sorted-map-count", pure_cfun(bif_sorted_map_count));
+    /** `(sorted-map-lower-bound m k)` - Returns the first key in the sorted map `m` that is not
+     * less than `k`, or `'()` if there is none */
+    sk_env_put(global, "sorted-map-lower-bound", pure_cfun(bif_sorted_map_lower_bound));
+    /** `(sorted-map-next m k)` - Returns the first key in the sorted map `m` after `k`, or
+     * `'()` if there is none. If `k` is `'()` it returns the first key in `m` */
+    sk_env_put(global, "sorted-map-next", pure_cfun(bif_sorted_map_next));
+    /** `(sorted-map-keys m)` - Returns a list of the keys in the sorted map `m`, in order */
+    sk_env_put(global, "sorted-map-keys", pure_cfun(bif_sorted_map_keys));
+    /** `(sorted-map->list m)` - Returns a list of the key-value pairs in the sorted map `m`, in order */
+    sk_env_put(global, "sorted-map->list", pure_cfun(bif_sorted_map_to_list));
+    /** `(sorted-map-range m lo hi)` - Returns a list of the key-value pairs in the sorted map `m`
+     * with keys from `lo` up to, but not including, `hi`. Either bound can be `'()` */
+    sk_env_put(global, "sorted-map-range", pure_cfun(bif_sorted_map_range));
+    /** `(sorted-map-fold m proc init [lo [hi]])` - Calls `(proc k v acc)` on the keys `k` and
+     * values `v` of the sorted map `m` in order, from `lo` up to, but not including, `hi`, where
+     * `acc` is `init` for the first key and the result of the previous call for the others.
+     * Returns the result of the last call */
+    sk_env_put(global, "sorted-map-fold", sk_cfun(bif_sorted_map_fold));
+
+    rc_account_use(account);
     return global;
 }
@@ -118,12 +118,56 @@ int sk_is_list(SkObj *e);
  */
 int sk_length(SkObj *e);
 
+/**
+ * ### Vectors
+ *
+ * #### `SkObj *sk_vector(SkObj *list);`
+ *
+ * Constructs a new vector with the elements of the Skeem list `list`.
+ * The elements are retained, `list` itself is not.
+ *
+ * Vectors can't be changed once they are created.
+ */
+SkObj *sk_vector(SkObj *list);
+
+/**
+ * #### `int sk_is_vector(SkObj *e);`
+ *
+ * Tests whether the given expression `e` is a vector.
+ */
+int sk_is_vector(SkObj *e);
+
+/**
+ * #### `int sk_vector_length(SkObj *e);`
+ *
+ * Returns the number of elements in the vector `e`, or 0 if `e` isn't a vector.
+ */
+int sk_vector_length(SkObj *e);
+
+/**
+ * #### `SkObj *sk_vector_ref(SkObj *e, int i);`
+ *
+ * Returns the element at index `i` of the vector `e`, or `NULL` if `e` isn't
+ * a vector or `i` is out of range. The element is **not** retained.
+ */
+SkObj *sk_vector_ref(SkObj *e, int i);
+
 /**
  * ### Symbols
  *
  * #### `SkObj *sk_symbol(const char *sk_value);`
  *
- * Creates a new symbol object with the given string value.
+ * Returns a symbol object with the given string value.
+ *
+ * Symbols are interned: There is only one symbol object for any given
+ * name, so the same (retained) object is returned every time, and symbols
+ * can be compared by their pointers.
+ *
+ * Each interpreter has its own table of symbols. `sk_symbol()` and
+ * `sk_parse()` intern their symbols in the table of the interpreter that
+ * was last created with `sk_global_env()`, or evaluated in, on the calling
+ * thread, so parse the code for an interpreter after it has been created
+ * or used on that thread.
  */
 SkObj *sk_symbol(const char *sk_value);
 
@@ -166,7 +210,9 @@ int sk_is_value(SkObj *e);
  *
  * Creates a new value object with the given numeric value.
  *
- * Skeem stores numbers as strings internallyy for technical reasons.
+ * Numbers are stored as `double`s internally. Their text representation
+ * is only generated (and then cached) when `sk_get_text()` or
+ * `sk_serialize()` need it.
  */
 SkObj *sk_number(double n);
 
@@ -174,9 +220,50 @@ SkObj *sk_number(double n);
  * #### `int sk_is_number(SkObj *e);`
  *
  * Tests whether the given expression `e` is a numeric value.
+ *
+ * This is true for numbers, as well as for values whose text
+ * passes `sk_check_numeric()`.
  */
 int sk_is_number(SkObj *e);
 
+/**
+ * #### `double sk_get_number(SkObj *e);`
+ *
+ * Gets the numeric value of the expression `e`.
+ *
+ * Values that are not numbers are converted with `atof()`,
+ * so non-numeric values evaluate to 0.
+ */
+double sk_get_number(SkObj *e);
+
+/**
+ * #### `SkObj *sk_integer(long long n);`
+ *
+ * Creates a new value object with the given exact integer value.
+ *
+ * Arithmetic on integers stays exact, and is only promoted to a `double`
+ * if the result overflows or isn't an integer.
+ */
+SkObj *sk_integer(long long n);
+
+/**
+ * #### `int sk_is_integer(SkObj *e);`
+ *
+ * Tests whether the given expression `e` is an exact integer.
+ *
+ * Values whose text is an integer, like `"42"`, are also exact integers.
+ */
+int sk_is_integer(SkObj *e);
+
+/**
+ * #### `long long sk_get_integer(SkObj *e);`
+ *
+ * Gets the value of the expression `e` as an integer.
+ *
+ * Numbers that are not exact integers are truncated.
+ */
+long long sk_get_integer(SkObj *e);
+
 /**
  * ### Booleans
  *
@@ -184,6 +271,10 @@ int sk_is_number(SkObj *e);
  *
  * Creates a new boolean object with the given value `val` that is either
  * `#t` for non-zero and `#f` for zero.
+ *
+ * Booleans (and small integers) are immediate values encoded in the `SkObj`
+ * pointer itself. They are never allocated, and `rc_retain()` and
+ * `rc_release()` ignore them.
  */
 SkObj *sk_boolean(int val);
 
@@ -219,6 +310,10 @@ int sk_is_true(SkObj *e);
  *
  * Creates a new object of type Lambda with pointers to the list of
  * arguments and the body of the lambda.
+ *
+ * The references to the lambda's parameters in `body` are resolved to
+ * slots in its call frame, so `body` should not be shared with other code.
+ * It returns an error if `args` is not a valid parameter list.
  */
 SkObj *sk_lambda(SkObj *args, SkObj *body);
 
@@ -350,6 +445,27 @@ int sk_equal(SkObj *a, SkObj *b);
  */
 char *sk_serialize(SkObj *e);
 
+/**
+ * #### `size_t sk_collect(void);`
+ *
+ * Frees the objects that are only kept alive by references to each other.
+ *
+ * Lambdas keep copies of the variables they capture from the functions they
+ * were created in. If a lambda captures a hash table and is then stored in
+ * that same hash table, the reference counts of both never drop to zero.
+ * The interpreter calls
+ * `sk_collect()` automatically as the number of these lambdas grows, but a
+ * program can call it after it has released its global environment to
+ * free everything before it exits.
+ *
+ * Each interpreter keeps track of its own lambdas, so that they can go with
+ * it to another thread. `sk_collect()` looks at those of the interpreters
+ * that were released on the calling thread.
+ *
+ * It returns the number of objects that were freed.
+ */
+size_t sk_collect(void);
+
 /**
  * #### `void sk_write(SkObj *e, FILE *f);`
  *
@@ -370,11 +486,26 @@ int sk_check_numeric(const char *s);
  *
  * Gets the text associated with an expression.
  *
- * Only value, symbol, boolean and error objects have textual
+ * Only value, number, symbol, boolean and error objects have textual
  * representations. Other oject types return an empty string, `""`.
+ *
+ * Small integers are immediate values that have nowhere to keep their
+ * text, so their text is written to a small ring of per-thread buffers,
+ * and is overwritten a few calls later. Use `sk_get_text_buf()` to keep
+ * the text of more than one object at a time.
  */
 const char *sk_get_text(SkObj *e);
 
+/**
+ * #### `const char *sk_get_text_buf(SkObj *e, char buf[SK_TEXT_SIZE]);`
+ *
+ * Like `sk_get_text()`, but the text of small integers is written to
+ * `buf`, which must have room for `SK_TEXT_SIZE` characters, so it stays
+ * valid for as long as `buf` and `e` do.
+ */
+#define SK_TEXT_SIZE 24
+const char *sk_get_text_buf(SkObj *e, char *buf);
+
 /**
  * ## Environments
  *
@@ -407,6 +538,10 @@ const char *sk_get_text(SkObj *e);
  *
  * It populates this global environment with the interpreter's built in
  * functions.
+ *
+ * The reference counts aren't atomic, so an interpreter and the objects
+ * it creates must only be used on one thread at a time. The interpreter
+ * can be handed to another thread, which can then use and release it.
  */
 SkEnv *sk_global_env();
 
@@ -452,6 +587,17 @@ SkObj *sk_env_put(SkEnv *env, const char *name, SkObj *e);
  */
 SkObj *sk_env_get(SkEnv *env, const char *name);
 
+/**
+ * #### `int sk_env_remove(SkEnv *env, const char *name);`
+ *
+ * Removes the variable named `name` from the environment `env`, and
+ * releases its value. Unlike `sk_env_get()` it doesn't look in the
+ * environment's parents.
+ *
+ * Returns 0 if there is no such variable in `env`.
+ */
+int sk_env_remove(SkEnv *env, const char *name);
+
 /**
  * ## Parser and Interpreter
  *
@@ -492,6 +638,95 @@ SkObj *sk_parse_stmts(const char *text);
  */
 SkObj *sk_eval(SkEnv *env, SkObj *e);
 
+/**
+ * #### `void sk_set_engine(SkEnv *env, int engine)`
+ *
+ * Selects the engine `sk_eval()` uses to evaluate expressions in the
+ * global environment of `env` and every environment derived from it:
+ *
+ * * `SK_ENGINE_TREE` - walks the expression tree directly (the default).
+ * * `SK_ENGINE_VM` - compiles the expression to bytecode for a stack
+ *   based virtual machine. Lambda bodies are compiled the first time
+ *   they are called, and the bytecode is kept for subsequent calls.
+ * * `SK_ENGINE_CLOSURE` - compiles the expression to a tree of nodes that
+ *   each point to the function that executes them (see `sk_compile()`).
+ *   Lambda bodies are also compiled the first time they are called.
+ *
+ * All the engines produce the same results.
+ */
+enum {SK_ENGINE_TREE, SK_ENGINE_VM, SK_ENGINE_CLOSURE};
+
+void sk_set_engine(SkEnv *env, int engine);
+
+/**
+ * #### `typedef struct SkMemStats SkMemStats;`
+ *
+ * The memory used by an interpreter, as reported by `sk_memory_stats()`:
+ *
+ * * `live` - the number of bytes in use.
+ * * `peak` - the largest that `live` has been.
+ * * `allocs` - the number of objects that have been allocated.
+ */
+typedef struct SkMemStats {
+    size_t live, peak;
+    unsigned long allocs;
+} SkMemStats;
+
+/**
+ * #### `int sk_memory_stats(SkEnv *env, SkMemStats *stats)`
+ *
+ * Fills in `stats` with the memory used by the interpreter that `env`
+ * belongs to.
+ *
+ * Each global environment created by `sk_global_env()` has its own
+ * account. The objects that are created while `sk_eval()` evaluates
+ * something in it are charged to that account, along with the text of
+ * strings and the hash tables of environments. They remain charged to it
+ * until they are freed, even if they outlive the global environment.
+ * Objects that are created outside of `sk_eval()`, and the expressions
+ * that `sk_eval_str()` parses, are not charged.
+ *
+ * It returns 0 if the interpreter isn't accounted, which is the case
+ * when Skeem is built with `SK_USE_EXTERNAL_REF_COUNTER`.
+ */
+int sk_memory_stats(SkEnv *env, SkMemStats *stats);
+
+/**
+ * #### `void sk_set_memory_limit(SkEnv *env, size_t limit)`
+ *
+ * Limits the memory that the interpreter that `env` belongs to can use
+ * to `limit` bytes, as counted by `sk_memory_stats()`. A `limit` of 0
+ * removes the limit.
+ *
+ * Allocations whose size depends on the data are checked when they are
+ * made: vectors, the strings that `string-append` builds and the hash tables
+ * of `hash-set` and `make-hash` fail with a "memory limit exceeded" error
+ * instead of being allocated, and `rc_alloc()` returns NULL for objects
+ * larger than a few hundred bytes that don't fit. Small objects are let
+ * through, and the limit is checked again before every function call, so
+ * `sk_eval()` stops with the same error soon after they have exceeded it.
+ */
+void sk_set_memory_limit(SkEnv *env, size_t limit);
+
+/**
+ * #### `SkObj *sk_compile(SkObj *e)`
+ *
+ * Analyses the expression `e` once, so that it can be evaluated many
+ * times with `sk_eval()` without being analysed again.
+ *
+ * Each part of the expression becomes a node with a pointer to the
+ * function that executes it, so `sk_eval()` doesn't need to examine
+ * the type of each expression or the name of each special form.
+ * Compiled expressions are evaluated like this regardless of the
+ * engine selected with `sk_set_engine()`.
+ *
+ * Errors in the structure of a form are only reported when the form
+ * is evaluated, as they would be if `e` were evaluated directly.
+ *
+ * The result must be released through `rc_release()` after use.
+ */
+SkObj *sk_compile(SkObj *e);
+
 /**
  * #### `SkObj *sk_eval_str(SkEnv *global, const char *text);`
  *
@@ -527,6 +762,9 @@ SkObj *sk_apply(SkEnv *env, SkObj *f, SkObj *a);
  * #### `void *rc_alloc(size_t size);`
  *
  * Allocates a reference counted block of memort
+ *
+ * It returns NULL if there isn't enough memory, or if a large block would
+ * go over the limit set by `sk_set_memory_limit()`.
  */
 void *rc_alloc(size_t size);
 
@@ -548,11 +786,58 @@ void rc_release(void *p);
 void *rc_retain(void *p);
 
 /**
- * #### `void rc_set_dtor(void *p, ref_dtor_t dtor);`
+ * #### `int rc_unique(void *p);`
+ *
+ * Returns non-zero if there is only one reference to the reference
+ * counted block `p`.
+ *
+ * Objects are treated as immutable, but if the caller holds the only
+ * reference to an object, nothing else can observe a change to it, so
+ * it can be updated in place rather than copied.
+ */
+int rc_unique(void *p);
+
+/**
+ * #### `unsigned int rc_count(void *p);`
+ *
+ * Returns the number of references to the reference counted block `p`.
+ */
+unsigned int rc_count(void *p);
+
+/**
+ * #### `int rc_set_dtor(void *p, ref_dtor_t dtor);`
  *
  * Sets the destructor of a reference counted object.
+ *
+ * The objects only hold the index of their destructor in a table of up
+ * to 256 destructors (`RC_MAX_DTORS`), a few of which Skeem uses itself.
+ * A destructor is added to the table the first time it is set, from
+ * any thread. If the table is full, `rc_set_dtor()` returns 0 without
+ * setting it, and the object would be released without it, so check the
+ * result and release the object instead of using it. Objects that need
+ * a destructor for each object are better wrapped in `sk_cdata()`, which
+ * keeps its destructor with the object.
+ */
+int rc_set_dtor(void *p, ref_dtor_t dtor);
+
+/**
+ * #### `size_t rc_trim(void);`
+ *
+ * Objects of up to a couple of hundred bytes are allocated from pages
+ * (slabs) that are kept and reused after the objects are released.
+ * `rc_trim()` returns the pages that have no objects in use to the
+ * system, for example after a script that created a lot of temporary
+ * objects has finished.
+ *
+ * The pages are kept per thread. When an interpreter is handed to another
+ * thread, that thread keeps the space of the objects it releases for its
+ * own use, so the pages they came from stay with the thread that
+ * allocated them. A thread should call `rc_trim()` before it exits, which
+ * also frees the space it keeps for releasing objects.
+ *
+ * It returns the number of bytes that were released.
  */
-void rc_set_dtor(void *p, ref_dtor_t dtor);
+size_t rc_trim(void);
 
 #if defined(__cplusplus) || defined(c_plusplus)
 } /* extern "C" */
@@ -0,0 +1,87 @@
+/* Tests `sk_memory_stats()` and `sk_set_memory_limit()`.
+Run it with `make test` */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "skeem.h"
+
+#ifdef SK_USE_EXTERNAL_REF_COUNTER
+#  include "refcnt.h"
+#endif
+
+static int failures = 0;
+
+static void check(const char *name, int ok) {
+    printf("%-40s: %s\n", name, ok ? "PASS" : "FAIL *");
+    if(!ok)
+        failures++;
+}
+
+/* Evaluates `text` and returns whether it failed with `error` */
+static int fails_with(SkEnv *global, const char *text, const char *error) {
+    SkObj *result = sk_eval_str(global, text);
+    int ok = sk_is_error(result) && !strcmp(sk_get_text(result), error);
+    rc_release(result);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    SkMemStats before, after;
+    SkObj *result;
+
+#ifdef SK_USE_EXTERNAL_REF_COUNTER
+    rc_init();
+#endif
+
+    SkEnv *global = sk_global_env();
+
+    if(!sk_memory_stats(global, &before)) {
+        puts("The interpreter isn't accounted; skipping the memory tests");
+        rc_release(global);
+        return 0;
+    }
+
+    rc_release(sk_eval_str(global, "(define big (range 1 10000))"));
+    sk_memory_stats(global, &after);
+    check("Memory: live grows", after.live > before.live + 10000 * sizeof(void *));
+    check("Memory: allocs counted", after.allocs >= before.allocs + 10000);
+    check("Memory: peak at least live", after.peak >= after.live);
+
+    before = after;
+    rc_release(sk_eval_str(global, "(define big '())"));
+    sk_memory_stats(global, &after);
+    check("Memory: live shrinks when freed", after.live + 10000 * sizeof(void *) < before.live);
+    check("Memory: peak stays", after.peak == before.peak);
+
+    /* The limits are refused when the memory is allocated, not afterwards */
+    sk_memory_stats(global, &before);
+    sk_set_memory_limit(global, before.live + (1 << 20));
+    check("Limit: large vector refused", fails_with(global, "(vector-length (make-vector 400000000 1))", "memory limit exceeded"));
+    check("Limit: growing string refused", fails_with(global,
+        "(define (grow s n) (if (= n 0) (string-length s) (grow (string-append s s) (- n 1)))) (grow \"x\" 40)",
+        "memory limit exceeded"));
+    check("Limit: growing hash table refused", fails_with(global,
+        "(define h (make-hash '())) (define (fill i) (begin (hash-set h i i) (fill (+ i 1)))) (fill 0)",
+        "memory limit exceeded"));
+    check("Limit: deep recursion refused", fails_with(global,
+        "(define (deep n) (cons n (deep (+ n 1)))) (deep 0)",
+        "memory limit exceeded"));
+    rc_release(sk_eval_str(global, "(define h '())"));
+    sk_memory_stats(global, &after);
+    check("Limit: peak stays near the limit", after.peak < before.live + (2 << 20));
+
+    result = sk_eval_str(global, "(vector-length (make-vector 1000 1))");
+    check("Limit: small allocations still work", sk_get_text(result) && !strcmp(sk_get_text(result), "1000"));
+    rc_release(result);
+
+    sk_set_memory_limit(global, 0);
+    result = sk_eval_str(global, "(vector-length (make-vector 1000000 1))");
+    check("Limit: removed", sk_get_text(result) && !strcmp(sk_get_text(result), "1000000"));
+    rc_release(result);
+
+    rc_release(global);
+    sk_collect();
+
+    return failures ? 1 : 0;
+}
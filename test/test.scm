@@ -26,7 +26,7 @@
 (display "Test 8 .............................:" (test-equal a 10))
 (display "Test 9 .............................:" (test-not-equal a 20))
 (define b a)
-(display "Test 10 ............................:" (test-not (eq? a 10) ))
+(display "Test 10 ............................:" (test-not (eq? (list a) (list 10)) ))
 (display "Test 11 ............................:" (test (eq? a b) ))
 
 ; Lists
@@ -326,3 +326,198 @@
 (display "Test 191 ...........................:" (test-equal (hash-count X) 4 ))
 (display "Test 192 ...........................:" (test-not (hash-empty? X) ))
 (display "Test 193 ...........................:" (test (hash-empty? (make-hash)) ))
+
+; Numbers
+(display "Test 194 ...........................:" (test (number? (+ 1 2))))
+(display "Test 195 ...........................:" (test-not (string? (* 2 3))))
+(display "Test 196 ...........................:" (test (string? "abc")))
+(display "Test 197 ...........................:" (test-equal (serialize (list 1.5 "x")) "( 1.5 \"x\" ) "))
+(display "Test 198 ...........................:" (test-equal (+ 0.1 0.2) 0.30000000000000004))
+(display "Test 199 ...........................:" (test-equal (string-append (/ 1 4) " " 1.50) "0.25 1.50"))
+
+; Exact integers
+(display "Test 200 ...........................:" (test (integer? (+ 1 2))))
+(display "Test 201 ...........................:" (test-not (integer? (/ 7 2))))
+(display "Test 202 ...........................:" (test-equal (/ 7 2) 3.5))
+(display "Test 203 ...........................:" (test (integer? (/ 8 2))))
+(display "Test 204 ...........................:" (test-equal (+ 9007199254740992 1) 9007199254740993))
+(display "Test 205 ...........................:" (test-equal (* 9223372036854775807 2) 18446744073709551614))
+(display "Test 206 ...........................:" (test-equal (% 17 5) 2))
+(display "Test 207 ...........................:" (test-equal (% 7.5 2) 1.5))
+(display "Test 208 ...........................:" (test (< 9007199254740992 9007199254740993)))
+(display "Test 209 ...........................:" (test-equal (serialize (range 1 3)) "( 1 2 3 ) "))
+
+; Immediate values
+(display "Test 210 ...........................:" (test (eq? a 10)))
+(display "Test 211 ...........................:" (test (eq? (< 1 2) #t)))
+(display "Test 212 ...........................:" (test (eq? (> 1 2) #f)))
+(display "Test 213 ...........................:" (test-equal (string-append 1 (+ 1 1) -3) "12-3"))
+(display "Test 214 ...........................:" (test-equal (serialize (cons 1 #t)) "( 1 . #t ) "))
+(display "Test 215 ...........................:" (test (integer? 4611686018427387904)))
+(display "Test 216 ...........................:" (test-equal (- 4611686018427387904 1) 4611686018427387903))
+
+; Interned symbols
+(display "Test 217 ...........................:" (test (eq? 'abc 'abc)))
+(display "Test 218 ...........................:" (test (eq? (car '(x y)) 'x)))
+(display "Test 219 ...........................:" (test-not (eq? 'abc 'abd)))
+(display "Test 220 ...........................:" (test-equal (hash-ref (make-hash '[(a . 1) ("b" . 2)]) "a") 1))
+
+; Special forms
+(display "Test 221 ...........................:" (test-equal (serialize '(if and or)) "( if and or ) "))
+(display "Test 222 ...........................:" (test-equal (let* ((x 2) (y (* x 3))) (begin x y)) 6))
+(display "Test 223 ...........................:" (test-equal (let ((if-not (lambda (c a b) (if c b a)))) (if-not #f 1 2)) 1))
+
+; Forms are only validated the first time they are evaluated
+(define (sum-to n acc) (if (= n 0) acc (let ((m (- n 1))) (sum-to m (+ acc n)))))
+(display "Test 224 ...........................:" (test-equal (sum-to 1000 0) 500500))
+(display "Test 225 ...........................:" (test-equal (map (lambda (x) ((lambda (y) (* y y)) x)) '(1 2 3)) '(1 4 9)))
+
+; Local variables are resolved to frame slots
+(define (lex-a x y . z) (list y x z))
+(display "Test 226 ...........................:" (test-equal (lex-a 1 2 3 4) '(2 1 (3 4))))
+(display "Test 227 ...........................:" (test-equal (let* ((x 1) (x (+ x 1)) (y (* x 10))) (list x y)) '(2 20)))
+(define (lex-b x) (begin (let ((y 1)) (set! x (+ x y))) x))
+(display "Test 228 ...........................:" (test-equal (lex-b 5) 6))
+(define (lex-c x) (begin (set! x (* x 2)) x))
+(display "Test 229 ...........................:" (test-equal (lex-c 5) 10))
+(define (lex-d) lex-free)
+(define (lex-e lex-free) (lex-d))
+(display "Test 230 ...........................:" (test-equal (lex-e 7) 7))
+(define (lex-f k) (map (lambda (v) (+ v k)) '(1 2 3)))
+(display "Test 231 ...........................:" (test-equal (lex-f 10) '(11 12 13)))
+
+; Global variable caches
+(define gc-var 1)
+(define (gc-get) gc-var)
+(display "Test 232 ...........................:" (test-equal (gc-get) 1))
+(define gc-var 2)
+(display "Test 233 ...........................:" (test-equal (gc-get) 2))
+(define (gc-shadow gc-var) (gc-get))
+(display "Test 234 ...........................:" (test-equal (gc-shadow 3) 3))
+(display "Test 235 ...........................:" (test-equal (gc-get) 2))
+(define gc-a1 1) (define gc-a2 2) (define gc-a3 3) (define gc-a4 4) (define gc-a5 5) (define gc-a6 6)
+(display "Test 236 ...........................:" (test-equal (list (gc-get) gc-a6) '(2 6)))
+
+; Temporaries are updated in place, but shared objects are not
+(define ip-l (list 1 2))
+(display "Test 237 ...........................:" (test-equal (append (append ip-l (list 3)) (list 4)) '(1 2 3 4)))
+(display "Test 238 ...........................:" (test-equal ip-l '(1 2)))
+(define ip-s "ab")
+(display "Test 239 ...........................:" (test-equal (string-append (string-append ip-s "c") "d" 5) "abcd5"))
+(display "Test 240 ...........................:" (test-equal ip-s "ab"))
+(display "Test 241 ...........................:" (test-equal (fold cons '() (list 1 2 3)) '(3 2 1)))
+(display "Test 242 ...........................:" (test-equal (append (cdr ip-l) (list 5)) '(2 5)))
+(display "Test 243 ...........................:" (test-equal ip-l '(1 2)))
+
+; Closures
+(define (cl-adder k) (lambda (x) (+ x k)))
+(define cl-add5 (cl-adder 5))
+(display "Test 244 ...........................:" (test-equal (cl-add5 10) 15))
+(display "Test 245 ...........................:" (test-equal (map (cl-adder 1) '(1 2 3)) '(2 3 4)))
+(define (cl-self v) (let ((f 0)) (begin (set! f (lambda () (list v f))) f)))
+(display "Test 246 ...........................:" (test-equal (car ((cl-self 7))) 7))
+(define (cl-shadow k) ((cl-adder 2) 3))
+(display "Test 247 ...........................:" (test-equal (cl-shadow 100) 5))
+(define (cl-curry a) (lambda (b) (lambda (c) (list a b c))))
+(display "Test 248 ...........................:" (test-equal (((cl-curry 1) 2) 3) '(1 2 3)))
+(define (cl-let x) (let* ((y (* x 2)) (g (lambda () (+ x y)))) (g)))
+(display "Test 249 ...........................:" (test-equal (cl-let 5) 15))
+(define (cl-hash v) (let ((h (make-hash '()))) (begin (hash-set h "f" (lambda () (list v h))) h)))
+(display "Test 250 ...........................:" (test-equal (car ((hash-ref (cl-hash 3) "f"))) 3))
+(define ht-rm (make-hash '[("a" . 1) ("b" . 2) ("c" . 3)]))
+(hash-remove ht-rm "b")
+(hash-remove ht-rm "z")
+(display "Test 251 ...........................:" (test-equal (hash-has-key ht-rm "a") #t))
+(display "Test 252 ...........................:" (test-equal (hash-has-key ht-rm "b") #f))
+(display "Test 253 ...........................:" (test-equal (hash-count ht-rm) 2))
+(define (ht-fill h i n) (if (> i n) h (ht-fill (hash-set h i i) (+ i 1) n)))
+(define (ht-drop h i n) (if (> i n) h (ht-drop (hash-remove h i) (+ i 2) n)))
+(define ht-big (ht-drop (ht-fill (make-hash '()) 1 200) 1 200))
+(display "Test 254 ...........................:" (test-equal (hash-count ht-big) 100))
+(display "Test 255 ...........................:" (test-equal (hash-ref ht-big "100") 100))
+(display "Test 256 ...........................:" (test-equal (hash-has-key ht-big "99") #f))
+(define ht-ord (make-hash '[("z" . 1) ("y" . (2 3)) ("x" . 4)]))
+(hash-remove ht-ord "z")
+(hash-set ht-ord "w" 5)
+(display "Test 257 ...........................:" (test-equal (hash->list ht-ord) '(("y" 2 3) ("x" . 4) ("w" . 5))))
+(display "Test 258 ...........................:" (test-equal (hash-map ht-ord (lambda (k v) (list k v))) '(("y" (2 3)) ("x" 4) ("w" 5))))
+(display "Test 259 ...........................:" (test-equal (hash-count ht-ord) 3))
+(display "Test 260 ...........................:" (test-equal (hash-keys ht-ord) '("y" "x" "w")))
+(display "Test 261 ...........................:" (test-equal (hash-values ht-ord) '((2 3) 4 5)))
+(define ht-inc (hash-remove (ht-fill (make-hash '()) 1 300) 150))
+(display "Test 262 ...........................:" (test-equal (car (hash-keys ht-inc)) "1"))
+(display "Test 263 ...........................:" (test-equal (car (reverse (hash-keys ht-inc))) "300"))
+(display "Test 264 ...........................:" (test-equal (hash-count ht-inc) 299))
+(display "Test 265 ...........................:" (test-equal (hash-ref ht-inc 151) 151))
+(define im-a (make-immutable-hash '[("a" . 1) ("b" . 2)]))
+(define im-b (hash-remove (hash-set im-a "c" 3) "a"))
+(display "Test 266 ...........................:" (test-equal (hash-count im-a) 2))
+(display "Test 267 ...........................:" (test-equal (hash-count im-b) 2))
+(display "Test 268 ...........................:" (test-equal (hash-ref im-a "a") 1))
+(display "Test 269 ...........................:" (test-equal (hash-has-key im-b "a") #f))
+(display "Test 270 ...........................:" (test-equal (hash-ref im-b "c") 3))
+(define im-c (ht-fill (make-immutable-hash '()) 1 300))
+(display "Test 271 ...........................:" (test-equal (hash-count im-c) 300))
+(display "Test 272 ...........................:" (test-equal (hash-ref im-c 123) 123))
+(display "Test 273 ...........................:" (test-equal (length (hash-keys (hash-remove im-c 5))) 299))
+(display "Test 274 ...........................:" (test-equal (hash-count im-c) 300))
+(display "Test 275 ...........................:" (test-equal (immutable? im-a) #t))
+(display "Test 276 ...........................:" (test-equal (immutable? ht-rm) #f))
+(display "Test 277 ...........................:" (test-equal (hash? im-a) #t))
+(define sm-a (make-sorted-map '[(b . 1) (10 . 2) (a . 3) (2 . 4) (1.5 . 5)]))
+(display "Test 278 ...........................:" (test-equal (sorted-map-keys sm-a) '(1.5 2 10 a b)))
+(display "Test 279 ...........................:" (test-equal (sorted-map-ref sm-a 'a) 3))
+(display "Test 280 ...........................:" (test-equal (sorted-map-count sm-a) 5))
+(display "Test 281 ...........................:" (test-equal (sorted-map? sm-a) #t))
+(define (sm-fill m i n) (if (> i n) m (begin (sorted-map-set m (% (* i 37) 1009) i) (sm-fill m (+ i 1) n))))
+(define (sm-drop m i n) (if (> i n) m (begin (sorted-map-remove m i) (sm-drop m (+ i 2) n))))
+(define sm-big (sm-drop (sm-fill (make-sorted-map) 0 1008) 0 1008))
+(display "Test 282 ...........................:" (test-equal (sorted-map-count sm-big) 504))
+(display "Test 283 ...........................:" (test-equal (sorted-map-has-key sm-big 500) #f))
+(display "Test 284 ...........................:" (test-equal (sorted-map-lower-bound sm-big 500) 501))
+(display "Test 285 ...........................:" (test-equal (sorted-map-next sm-big 501) 503))
+(display "Test 286 ...........................:" (test-equal (sorted-map-next sm-big '()) 1))
+(display "Test 287 ...........................:" (test-equal (sorted-map-range sm-big 10 16) '((11 . 273) (13 . 873) (15 . 464))))
+(display "Test 288 ...........................:" (test-equal (sorted-map-fold sm-big (lambda (k v acc) (+ acc 1)) 0 100 200) 50))
+(display "Test 289 ...........................:" (test-equal (sorted-map-fold sm-big (lambda (k v acc) (+ k acc)) 0 1000) 4016))
+(display "Test 290 ...........................:" (test-equal (sorted-map-ref sm-big 2 "none") "none"))
+(define sm-int (make-sorted-map))
+(sorted-map-set sm-int 9007199254740992 'a)
+(sorted-map-set sm-int 9007199254740993 'b)
+(display "Test 291 ...........................:" (test-equal (sorted-map-count sm-int) 2))
+(display "Test 292 ...........................:" (test-equal (sorted-map-ref sm-int 9007199254740992) 'a))
+(display "Test 293 ...........................:" (test-equal (sorted-map-ref sm-int 9007199254740993) 'b))
+(define vec-a #(1 "two" (3 4) #(5 6)))
+(display "Test 294 ...........................:" (test-equal (vector-length vec-a) 4))
+(display "Test 295 ...........................:" (test-equal (vector-ref vec-a 1) "two"))
+(display "Test 296 ...........................:" (test-equal (vector-ref vec-a 2) '(3 4)))
+(display "Test 297 ...........................:" (test-equal (vector? vec-a) #t))
+(display "Test 298 ...........................:" (test-equal (vector? '(1 2)) #f))
+(display "Test 299 ...........................:" (test-equal (vector->list (list->vector '(a b c))) '(a b c)))
+(display "Test 300 ...........................:" (test-equal (vector 1 2) #(1 2)))
+(display "Test 301 ...........................:" (test-equal (make-vector 3 'x) #(x x x)))
+(display "Test 302 ...........................:" (test-equal (vector-map (lambda (x) (* x x)) #(1 2 3)) #(1 4 9)))
+(define vec-seen (make-hash '()))
+(vector-for-each (lambda (x) (hash-set vec-seen x (* x 10))) #[1 2 3 4])
+(display "Test 303 ...........................:" (test-equal (hash-values vec-seen) '(10 20 30 40)))
+(display "Test 304 ...........................:" (test-equal (vector-ref (list->vector (range 1 1000)) 999) 1000))
+(display "Test 305 ...........................:" (test-equal (equal? #(1 2) #(1 3)) #f))
+(define (box-a) (let ((x 1)) (let ((g (lambda () x))) (set! x 2) (g))))
+(define (box-b) (let ((x 1)) (define box-k (lambda () x)) (set! x 3) (box-k)))
+(display "Test 306 ...........................:" (test-equal (list (box-a) (box-b)) '(2 3)))
+(define (box-c n) (let ((g (lambda () (lambda () n)))) (let ((gg (g))) (set! n (* n 10)) (list (gg) ((g))))))
+(define (box-d) (let ((x 1)) (let ((f (lambda () (set! x 2) x))) (list (f) x))))
+(display "Test 307 ...........................:" (test-equal (list (box-c 4) (box-d)) '((40 40) (2 1))))
+(define (acc l n) (if (= n 0) l (acc (append l (list n)) (- n 1))))
+(display "Test 308 ...........................:" (test-equal (list (acc (list) 5) (length (acc (list) 2000))) '((5 4 3 2 1) 2000)))
+(define (acc-keep x y) (begin (append x (list 4)) y))
+(define (acc-tail x) (acc-keep x (cdr x)))
+(define acc-q (list 5))
+(display "Test 309 ...........................:" (test-equal (list (acc-tail (append (list 1 2) (list 3))) (acc acc-q 2) acc-q) '((2 3) (5 2 1) (5))))
+(define (last-g) last-l)
+(define (last-f last-l) (list last-l (last-g)))
+(display "Test 310 ...........................:" (test-equal (last-f 5) '(5 5)))
+(define (last-h last-l) (list last-l (apply last-g '())))
+(display "Test 311 ...........................:" (test-equal (last-h 6) '(6 6)))
+(define (last-k last-l) (begin (length last-l) (last-g)))
+(display "Test 312 ...........................:" (test-equal (last-k (list 7)) '(7)))